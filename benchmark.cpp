@@ -0,0 +1,859 @@
+//
+// g++ -O2 benchmark.cpp -o benchmark -I.. -lboost_program_options -lboost_thread -lboost_chrono -lhiredis -lev
+//
+// Runs every combination of --mode and --depth with the given workload and
+// prints one row per command and run:
+//
+//   ./benchmark --mix get=70,set=20,mget=10 --distribution zipfian
+//               --value-size 64:90,4096:10 --threads 4 --connections 2
+//               --mode sync,async --depth 1,16,128 --format csv
+//
+// --mock runs against the in-process RedisMockServer instead of host and
+// port, so client overhead is measured without redis-server scheduling noise.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <hiredispp/hiredispp.h>
+#include <hiredispp/hiredispp_async.h>
+#include <hiredispp/hiredispp_epoll.h>
+#include <hiredispp/hiredispp_mock.h>
+#include <hiredispp/hiredispp_stats.h>
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/random.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+using namespace hiredispp;
+
+namespace po = boost::program_options;
+
+typedef boost::chrono::steady_clock Clock;
+
+enum Op { Get, Set, Mget, Hset, Hgetall, Zadd, Zrange, Lrange, OpCount };
+
+static const char* opNames[OpCount] =
+    { "GET", "SET", "MGET", "HSET", "HGETALL", "ZADD", "ZRANGE", "LRANGE" };
+
+static Op parseOp(const string& name)
+{
+    for (int i = 0; i < OpCount; ++i)
+    {
+        if (boost::iequals(name, opNames[i]))
+        {
+            return static_cast<Op>(i);
+        }
+    }
+
+    throw runtime_error("unknown command " + name);
+}
+
+// Popularity of keys 0..n-1, uniform or zipfian as generated by YCSB
+// (Gray et al., "Quickly generating billion-record synthetic databases")
+class KeyDistribution
+{
+public:
+    KeyDistribution(size_t n, bool zipfian, double theta)
+        : _n(n), _zipfian(zipfian), _theta(theta), _zetan(0)
+    {
+        if (!_zipfian)
+        {
+            return;
+        }
+
+        if (theta <= 0 || theta >= 1)
+        {
+            throw runtime_error("zipfian theta must be in (0, 1)");
+        }
+
+        for (size_t i = 1; i <= n; ++i)
+        {
+            _zetan += 1 / pow(static_cast<double>(i), theta);
+        }
+
+        const double zeta2 = 1 + pow(0.5, theta);
+
+        _alpha = 1 / (1 - theta);
+        _eta = (1 - pow(2. / n, 1 - theta)) / (1 - zeta2 / _zetan);
+    }
+
+    template<class Rng>
+    size_t operator()(Rng& rng) const
+    {
+        const double u = boost::random::uniform_01<double>()(rng);
+
+        if (!_zipfian)
+        {
+            return static_cast<size_t>(u * _n);
+        }
+
+        const double uz = u * _zetan;
+
+        if (uz < 1)
+        {
+            return 0;
+        }
+
+        if (uz < 1 + pow(0.5, _theta))
+        {
+            return 1;
+        }
+
+        return min(_n - 1, static_cast<size_t>(_n * pow(_eta * u - _eta + 1, _alpha)));
+    }
+
+private:
+    size_t _n;
+    bool _zipfian;
+    double _theta;
+    double _zetan;
+    double _alpha;
+    double _eta;
+};
+
+// Value sizes given as "N" fixed, "MIN-MAX" uniform or "N:W,N:W..."
+// weighted; values of sampled sizes are generated once and picked at random
+class Values
+{
+public:
+    Values(const string& spec, boost::random::mt19937& rng)
+    {
+        vector<size_t> sizes;
+        vector<double> weights;
+        vector<string> parts;
+
+        boost::split(parts, spec, boost::is_any_of(","));
+
+        for (size_t i = 0; i < parts.size(); ++i)
+        {
+            vector<string> sw;
+            boost::split(sw, parts[i], boost::is_any_of(":"));
+            sizes.push_back(sw[0].find('-') == string::npos ? boost::lexical_cast<size_t>(sw[0]) : 0);
+            weights.push_back(sw.size() > 1 ? boost::lexical_cast<double>(sw[1]) : 1);
+        }
+
+        size_t low = 0, high = 0;
+        const size_t dash = spec.find('-');
+
+        if (dash != string::npos)
+        {
+            low = boost::lexical_cast<size_t>(spec.substr(0, dash));
+            high = boost::lexical_cast<size_t>(spec.substr(dash + 1));
+        }
+
+        boost::random::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+        boost::random::uniform_int_distribution<size_t> range(low, max(low, high));
+
+        for (size_t i = 0; i < Samples; ++i)
+        {
+            const size_t size = (dash != string::npos) ? range(rng) : sizes[pick(rng)];
+            _values.push_back(string(size, static_cast<char>('a' + i % 26)));
+        }
+    }
+
+    template<class Rng>
+    const string& operator()(Rng& rng) const
+    {
+        return _values[rng() % Samples];
+    }
+
+private:
+    static const size_t Samples = 1024;
+    vector<string> _values;
+};
+
+struct Workload
+{
+    string prefix;
+    vector<Op> ops;
+    vector<double> weights;
+    size_t keys;
+    size_t mgetKeys;
+    size_t range;
+    size_t fields;
+    KeyDistribution* distribution;
+    Values* values;
+};
+
+struct Result
+{
+    RedisHistogram latency[OpCount];
+    boost::uint64_t errors[OpCount];
+
+    Result()
+    {
+        fill(errors, errors + OpCount, 0);
+    }
+
+    void merge(const Result& other)
+    {
+        for (int i = 0; i < OpCount; ++i)
+        {
+            latency[i].merge(other.latency[i]);
+            errors[i] += other.errors[i];
+        }
+    }
+};
+
+// Builds random commands of the workload
+class Generator
+{
+public:
+    Generator(const Workload& w, boost::uint32_t seed)
+        : _w(w), _rng(seed), _pick(w.weights.begin(), w.weights.end()) { }
+
+    Op next(Redis::Command& cmd)
+    {
+        const Op op = _w.ops[_pick(_rng)];
+
+        cmd.clear();
+
+        switch (op)
+        {
+        case Get:
+            cmd << "GET" << key("str", (*_w.distribution)(_rng));
+            break;
+        case Set:
+            cmd << "SET" << key("str", (*_w.distribution)(_rng)) << (*_w.values)(_rng);
+            break;
+        case Mget:
+            cmd << "MGET";
+            for (size_t i = 0; i < _w.mgetKeys; ++i)
+            {
+                cmd << key("str", (*_w.distribution)(_rng));
+            }
+            break;
+        case Hset:
+            cmd << "HSET" << key("hash", (*_w.distribution)(_rng))
+                << field(_rng() % _w.fields) << (*_w.values)(_rng);
+            break;
+        case Hgetall:
+            cmd << "HGETALL" << key("hash", (*_w.distribution)(_rng));
+            break;
+        case Zadd:
+            cmd << "ZADD" << key("zset", (*_w.distribution)(_rng))
+                << static_cast<double>(_rng() % 1000000) << field(_rng() % _w.fields);
+            break;
+        case Zrange:
+            cmd << "ZRANGE" << key("zset", (*_w.distribution)(_rng)) << 0 << static_cast<int>(_w.range) - 1;
+            break;
+        case Lrange:
+            cmd << "LRANGE" << key("list", (*_w.distribution)(_rng)) << 0 << static_cast<int>(_w.range) - 1;
+            break;
+        default:
+            break;
+        }
+
+        return op;
+    }
+
+private:
+    const char* key(const char* type, size_t n)
+    {
+        snprintf(_key, sizeof(_key), "%s%s:%zu", _w.prefix.c_str(), type, n);
+        return _key;
+    }
+
+    const char* field(size_t n)
+    {
+        snprintf(_field, sizeof(_field), "f%zu", n);
+        return _field;
+    }
+
+    const Workload& _w;
+    boost::random::mt19937 _rng;
+    boost::random::discrete_distribution<size_t> _pick;
+    char _key[256];
+    char _field[32];
+};
+
+static boost::uint64_t elapsed(Clock::time_point start)
+{
+    return boost::chrono::duration_cast<boost::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+// Each connection sends depth commands and reads their replies in turn
+class SyncClient
+{
+public:
+    SyncClient(const string& host, int port, size_t connections, const Workload& w, boost::uint32_t seed)
+        : _generator(w, seed)
+    {
+        for (size_t i = 0; i < connections; ++i)
+        {
+            _connections.push_back(new Redis(host, port));
+        }
+    }
+
+    void run(size_t requests, size_t depth, Result& result)
+    {
+        vector<Op> ops(depth * _connections.size());
+        vector<Clock::time_point> starts(ops.size());
+        vector<bool> begun(ops.size());
+        Redis::Command cmd;
+
+        while (requests > 0)
+        {
+            size_t sent = 0;
+
+            for (size_t c = 0; c < _connections.size(); ++c)
+            {
+                bool broken = false;
+
+                for (size_t i = 0; i < depth && sent < requests; ++i, ++sent)
+                {
+                    ops[sent] = _generator.next(cmd);
+                    starts[sent] = Clock::now();
+                    begun[sent] = false;
+
+                    try
+                    {
+                        if (!broken)
+                        {
+                            _connections[c].beginCommand(cmd);
+                            begun[sent] = true;
+                        }
+                    }
+                    catch (const RedisException&)
+                    {
+                        broken = true;
+                    }
+                }
+            }
+
+            for (size_t c = 0, done = 0; done < sent; ++c)
+            {
+                // replies after a read failure are lost with the connection
+                bool lost = false;
+
+                for (size_t i = 0; i < depth && done < sent; ++i, ++done)
+                {
+                    if (!begun[done] || lost)
+                    {
+                        ++result.errors[ops[done]];
+                        continue;
+                    }
+
+                    Redis::Reply reply;
+
+                    try
+                    {
+                        reply = _connections[c].endCommand();
+                    }
+                    catch (const RedisException&)
+                    {
+                        lost = true;
+                        ++result.errors[ops[done]];
+                        continue;
+                    }
+
+                    try
+                    {
+                        reply.checkError();
+                        result.latency[ops[done]].record(elapsed(starts[done]));
+                    }
+                    catch (const RedisException&)
+                    {
+                        ++result.errors[ops[done]];
+                    }
+                }
+            }
+
+            requests -= sent;
+        }
+    }
+
+private:
+    Generator _generator;
+    boost::ptr_vector<Redis> _connections;
+};
+
+// Connections of one thread on an epoll loop, each keeping depth commands
+// in flight until the requests are done
+class AsyncClient
+{
+    struct Done
+    {
+        AsyncClient* client;
+        RedisConnectionAsync* connection;
+        Op op;
+        Clock::time_point start;
+
+        void operator()(RedisConnectionAsync&, Redis::Element* reply) const
+        {
+            client->completed(*connection, reply, op, start);
+        }
+    };
+
+public:
+    AsyncClient(const string& host, int port, size_t connections, const Workload& w, boost::uint32_t seed)
+        : _generator(w, seed), _result(NULL), _sent(0), _done(0), _requests(0)
+    {
+        for (size_t i = 0; i < connections; ++i)
+        {
+            _connections.push_back(new RedisConnectionAsync(host, port, _loop));
+        }
+    }
+
+    ~AsyncClient()
+    {
+        for (size_t i = 0; i < _connections.size(); ++i)
+        {
+            _connections[i].close();
+        }
+    }
+
+    void run(size_t requests, size_t depth, Result& result)
+    {
+        _result = &result;
+        _requests = requests;
+        _sent = 0;
+        _done = 0;
+
+        for (size_t c = 0; c < _connections.size(); ++c)
+        {
+            RedisConnectionAsync& ac = _connections[c];
+
+            if (!ac.connected())
+            {
+                // commands are buffered by hiredis until connected, those
+                // given to a connection which failed count as errors
+                try
+                {
+                    ac.connect(boost::bind(&AsyncClient::onConnected, this, _1),
+                               boost::bind(&AsyncClient::onDisconnected, this, _1));
+                }
+                catch (const RedisException& ex)
+                {
+                    cerr << "connect: " << ex.what() << endl;
+                    ac.close();
+                }
+            }
+
+            for (size_t i = 0; i < depth; ++i)
+            {
+                send(ac);
+            }
+        }
+
+        while (_done < _requests)
+        {
+            _loop.runOnce();
+        }
+    }
+
+private:
+    void onConnected(boost::shared_ptr<RedisException>& ex)
+    {
+        if (ex)
+        {
+            cerr << "connect: " << ex->what() << endl;
+        }
+    }
+
+    void onDisconnected(boost::shared_ptr<RedisException>& ex)
+    {
+        if (ex)
+        {
+            cerr << "disconnected: " << ex->what() << endl;
+        }
+    }
+
+    // Commands the connection refuses count as errors, the next one is
+    // tried in their place
+    void send(RedisConnectionAsync& ac)
+    {
+        while (_sent < _requests)
+        {
+            ++_sent;
+            Done done = { this, &ac, _generator.next(_cmd), Clock::now() };
+
+            try
+            {
+                ac.execAsyncCommand(_cmd, done);
+                return;
+            }
+            catch (const RedisException&)
+            {
+                ++_result->errors[done.op];
+                ++_done;
+            }
+        }
+    }
+
+    void completed(RedisConnectionAsync& ac, Redis::Element* reply, Op op, Clock::time_point start)
+    {
+        ++_done;
+
+        if (reply == NULL || reply->isError())
+        {
+            ++_result->errors[op];
+        }
+        else
+        {
+            _result->latency[op].record(elapsed(start));
+        }
+
+        send(ac);
+    }
+
+    RedisEpollLoop _loop;
+    Generator _generator;
+    Redis::Command _cmd;
+    Result* _result;
+    size_t _sent;
+    size_t _done;
+    size_t _requests;
+    boost::ptr_vector<RedisConnectionAsync> _connections;
+};
+
+// Loads every key of the command types in the mix, so reads find data
+static void populate(const string& host, int port, const Workload& w)
+{
+    bool types[OpCount] = { false };
+
+    for (size_t i = 0; i < w.ops.size(); ++i)
+    {
+        types[w.ops[i]] = true;
+    }
+
+    Redis r(host, port);
+    boost::random::mt19937 rng(1);
+    const size_t batch = 1000;
+    size_t pending = 0;
+    char key[256];
+
+    for (size_t k = 0; k < w.keys; ++k)
+    {
+        if (types[Get] || types[Mget])
+        {
+            snprintf(key, sizeof(key), "%sstr:%zu", w.prefix.c_str(), k);
+            r.beginCommand(Redis::Command("SET") << key << (*w.values)(rng));
+            ++pending;
+        }
+
+        for (size_t i = 0; i < w.range; ++i)
+        {
+            const string member = "f" + boost::lexical_cast<string>(i);
+
+            if (types[Hgetall])
+            {
+                snprintf(key, sizeof(key), "%shash:%zu", w.prefix.c_str(), k);
+                r.beginCommand(Redis::Command("HSET") << key << member << (*w.values)(rng));
+                ++pending;
+            }
+
+            if (types[Zrange])
+            {
+                snprintf(key, sizeof(key), "%szset:%zu", w.prefix.c_str(), k);
+                r.beginCommand(Redis::Command("ZADD") << key << static_cast<int>(i) << member);
+                ++pending;
+            }
+
+            if (types[Lrange])
+            {
+                snprintf(key, sizeof(key), "%slist:%zu", w.prefix.c_str(), k);
+                r.beginCommand(Redis::Command("RPUSH") << key << member);
+                ++pending;
+            }
+        }
+
+        if (pending >= batch || k + 1 == w.keys)
+        {
+            for (; pending > 0; --pending)
+            {
+                r.endCommand().checkError();
+            }
+        }
+    }
+}
+
+struct Run
+{
+    string mode;
+    size_t depth;
+    double seconds;
+    Result result;
+};
+
+static void printRows(ostream& out, const string& format, const vector<Run>& runs,
+                      size_t threads, size_t connections)
+{
+    if (format == "csv")
+    {
+        out << "mode,depth,threads,connections,command,count,errors,seconds,rps,"
+               "mean_us,p50_us,p99_us,p999_us,max_us" << endl;
+    }
+    else if (format == "json")
+    {
+        out << "[" << endl;
+    }
+    else
+    {
+        out << "mode   depth command         count  errors        rps    mean_us     p50_us     p99_us    p999_us     max_us" << endl;
+    }
+
+    bool first = true;
+
+    for (size_t r = 0; r < runs.size(); ++r)
+    {
+        const Run& run = runs[r];
+        RedisHistogram all;
+        boost::uint64_t allErrors = 0;
+
+        for (int op = 0; op <= OpCount; ++op)
+        {
+            const bool total = (op == OpCount);
+            const RedisHistogram& h = total ? all : run.result.latency[op];
+            const boost::uint64_t errors = total ? allErrors : run.result.errors[op];
+
+            if (!total)
+            {
+                all.merge(h);
+                allErrors += errors;
+            }
+
+            if (h.count() == 0 && errors == 0)
+            {
+                continue;
+            }
+
+            const char* name = total ? "ALL" : opNames[op];
+            const double rps = (h.count() + errors) / run.seconds;
+            char line[512];
+
+            if (format == "csv")
+            {
+                snprintf(line, sizeof(line), "%s,%zu,%zu,%zu,%s,%llu,%llu,%.3f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f",
+                         run.mode.c_str(), run.depth, threads, connections, name,
+                         (unsigned long long)h.count(), (unsigned long long)errors, run.seconds, rps,
+                         h.mean() / 1e3, h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+                         h.percentile(99.9) / 1e3, h.max() / 1e3);
+            }
+            else if (format == "json")
+            {
+                snprintf(line, sizeof(line),
+                         "%s  {\"mode\": \"%s\", \"depth\": %zu, \"threads\": %zu, \"connections\": %zu, "
+                         "\"command\": \"%s\", \"count\": %llu, \"errors\": %llu, \"seconds\": %.3f, "
+                         "\"rps\": %.0f, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                         "\"p999_us\": %.1f, \"max_us\": %.1f}",
+                         first ? "" : ",\n", run.mode.c_str(), run.depth, threads, connections, name,
+                         (unsigned long long)h.count(), (unsigned long long)errors, run.seconds, rps,
+                         h.mean() / 1e3, h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+                         h.percentile(99.9) / 1e3, h.max() / 1e3);
+            }
+            else
+            {
+                snprintf(line, sizeof(line), "%-6s %5zu %-8s %12llu %7llu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f",
+                         run.mode.c_str(), run.depth, name,
+                         (unsigned long long)h.count(), (unsigned long long)errors, rps,
+                         h.mean() / 1e3, h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+                         h.percentile(99.9) / 1e3, h.max() / 1e3);
+            }
+
+            out << line << (format == "json" ? "" : "\n");
+            first = false;
+        }
+    }
+
+    if (format == "json")
+    {
+        out << endl << "]" << endl;
+    }
+}
+
+template<class Client>
+static void runClients(boost::ptr_vector<Client>& clients, size_t requests, size_t depth, Run& run)
+{
+    boost::ptr_vector<Result> results;
+    boost::thread_group threads;
+
+    for (size_t t = 0; t < clients.size(); ++t)
+    {
+        results.push_back(new Result);
+    }
+
+    const Clock::time_point start = Clock::now();
+
+    for (size_t t = 0; t < clients.size(); ++t)
+    {
+        const size_t share = requests / clients.size() + (t < requests % clients.size() ? 1 : 0);
+        threads.create_thread(boost::bind(&Client::run, &clients[t], share, depth, boost::ref(results[t])));
+    }
+
+    threads.join_all();
+    run.seconds = elapsed(start) / 1e9;
+
+    for (size_t t = 0; t < results.size(); ++t)
+    {
+        run.result.merge(results[t]);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    string host;
+    int    port;
+    size_t requests;
+    size_t threads;
+    size_t connections;
+    string modes;
+    string depths;
+    string mix;
+    string distribution;
+    double theta;
+    string valueSize;
+    string format;
+    bool   fill;
+    bool   mock;
+    unsigned mockLatency;
+    unsigned seed;
+    Workload w;
+
+    po::options_description desc("options");
+
+    desc.add_options()
+        ("help", "produce this help message")
+        ("host", po::value<string>(&host)->default_value("localhost"), "host")
+        ("port", po::value<int>(&port)->default_value(6379), "port")
+        ("mock", po::bool_switch(&mock), "run against the in-process mock server instead of host and port")
+        ("mock-latency", po::value<unsigned>(&mockLatency)->default_value(0), "reply latency of the mock server in microseconds")
+        ("requests", po::value<size_t>(&requests)->default_value(100000), "requests per run")
+        ("threads", po::value<size_t>(&threads)->default_value(1), "client threads")
+        ("connections", po::value<size_t>(&connections)->default_value(1), "connections per thread")
+        ("mode", po::value<string>(&modes)->default_value("async"), "sync, async or both comma separated")
+        ("depth", po::value<string>(&depths)->default_value("1,16,128"), "commands in flight per connection, comma separated")
+        ("mix", po::value<string>(&mix)->default_value("get=80,set=20"),
+         "command weights of get, set, mget, hset, hgetall, zadd, zrange, lrange")
+        ("keys", po::value<size_t>(&w.keys)->default_value(100000), "number of keys of each type")
+        ("distribution", po::value<string>(&distribution)->default_value("uniform"), "key popularity, uniform or zipfian")
+        ("theta", po::value<double>(&theta)->default_value(0.99), "zipfian skew")
+        ("value-size", po::value<string>(&valueSize)->default_value("64"),
+         "value size N, uniform MIN-MAX or weighted N:W,N:W")
+        ("mget-keys", po::value<size_t>(&w.mgetKeys)->default_value(10), "keys per MGET")
+        ("range", po::value<size_t>(&w.range)->default_value(10), "elements of populated hashes, sorted sets and lists")
+        ("fields", po::value<size_t>(&w.fields)->default_value(100), "fields and members written by HSET and ZADD")
+        ("prefix", po::value<string>(&w.prefix)->default_value("bench:"), "key prefix")
+        ("populate", po::value<bool>(&fill)->default_value(true), "load keys before the runs")
+        ("format", po::value<string>(&format)->default_value("text"), "text, csv or json")
+        ("seed", po::value<unsigned>(&seed)->default_value(1), "random seed")
+        ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        cout << desc << endl;
+        return 0;
+    }
+
+    try
+    {
+        vector<string> items;
+        boost::split(items, mix, boost::is_any_of(","));
+
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            const size_t eq = items[i].find('=');
+            w.ops.push_back(parseOp(items[i].substr(0, eq)));
+            w.weights.push_back(eq == string::npos ? 1 : boost::lexical_cast<double>(items[i].substr(eq + 1)));
+        }
+
+        boost::random::mt19937 rng(seed);
+        KeyDistribution keys(max<size_t>(w.keys, 1), distribution == "zipfian", theta);
+        Values values(valueSize, rng);
+
+        w.distribution = &keys;
+        w.values = &values;
+        w.fields = max<size_t>(w.fields, 1);
+
+        signal(SIGPIPE, SIG_IGN);
+
+        boost::scoped_ptr<RedisMockServer> server;
+
+        if (mock)
+        {
+            RedisMockConfig config;
+            config.latency = boost::chrono::microseconds(mockLatency);
+            config.seed = seed;
+            server.reset(new RedisMockServer(config));
+            host = config.host;
+            port = server->port();
+        }
+
+        if (fill)
+        {
+            populate(host, port, w);
+        }
+
+        vector<string> modeList, depthList;
+        boost::split(modeList, modes, boost::is_any_of(","));
+        boost::split(depthList, depths, boost::is_any_of(","));
+
+        boost::ptr_vector<SyncClient> syncClients;
+        boost::ptr_vector<AsyncClient> asyncClients;
+        vector<Run> runs;
+
+        for (size_t t = 0; t < threads; ++t)
+        {
+            if (find(modeList.begin(), modeList.end(), "sync") != modeList.end())
+            {
+                syncClients.push_back(new SyncClient(host, port, connections, w, seed + t));
+            }
+
+            if (find(modeList.begin(), modeList.end(), "async") != modeList.end())
+            {
+                asyncClients.push_back(new AsyncClient(host, port, connections, w, seed + t));
+            }
+        }
+
+        for (size_t m = 0; m < modeList.size(); ++m)
+        {
+            for (size_t d = 0; d < depthList.size(); ++d)
+            {
+                Run run;
+                run.mode = modeList[m];
+                run.depth = max<size_t>(boost::lexical_cast<size_t>(depthList[d]), 1);
+
+                if (run.mode == "sync")
+                {
+                    runClients(syncClients, requests, run.depth, run);
+                }
+                else if (run.mode == "async")
+                {
+                    runClients(asyncClients, requests, run.depth, run);
+                }
+                else
+                {
+                    throw runtime_error("unknown mode " + run.mode);
+                }
+
+                runs.push_back(run);
+            }
+        }
+
+        printRows(cout, format, runs, threads, connections);
+    }
+    catch (const std::exception& ex)
+    {
+        cerr << ex.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
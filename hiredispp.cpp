@@ -3,9 +3,17 @@
  */
 
 #include "hiredispp.h"
+#include <stdlib.h>
+#include <new>
 #include <ostream>
 #include <iterator>
-#include <boost/archive/detail/utf8_codecvt_facet.hpp>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace hiredispp
 {
@@ -15,101 +23,1014 @@ namespace hiredispp
     template<>
     const std::basic_string<wchar_t> RedisConst<wchar_t>::Nil = L"**NIL**";
 
-    template<>
-    const std::basic_string<char> RedisConst<char>::InfoSeparator = ":";
+    namespace
+    {
+        boost::atomic<boost::uint64_t> lastInstanceId(0);
+    }
 
-    template<>
-    const std::basic_string<wchar_t> RedisConst<wchar_t>::InfoSeparator = L":";
+    boost::uint64_t RedisInstance::nextId()
+    {
+        return lastInstanceId.fetch_add(1, boost::memory_order_relaxed) + 1;
+    }
 
-    template<>
-    const std::basic_string<char> RedisConst<char>::InfoCrLf = "\r\n";
+    const size_t RedisReplyArena::Alignment;
+    const size_t RedisReplyArena::ChunkSize;
+    const size_t RedisReplyArena::MaxChunkSize;
 
-    template<>
-    const std::basic_string<wchar_t> RedisConst<wchar_t>::InfoCrLf = L"\r\n";
+#if HIREDIS_MAJOR >= 1
+    redisReplyObjectFunctions RedisReplyArena::Functions =
+    {
+        RedisReplyArena::createString,
+        RedisReplyArena::createArray,
+        RedisReplyArena::createInteger,
+        RedisReplyArena::createDouble,
+        RedisReplyArena::createNil,
+        RedisReplyArena::createBool,
+        RedisReplyArena::freeObject
+    };
+#else
+    redisReplyObjectFunctions RedisReplyArena::Functions =
+    {
+        RedisReplyArena::createString,
+        RedisReplyArena::createArray,
+        RedisReplyArena::createInteger,
+        RedisReplyArena::createNil,
+        RedisReplyArena::freeObject
+    };
+#endif
 
-    template<>
-    void RedisEncoding<wchar_t>::decode(const char* data, size_t size, std::basic_string<wchar_t>& string)
+    size_t RedisReplyArena::headerSize()
+    {
+        return (sizeof(Chunk) + sizeof(RedisReplyArena) + Alignment - 1) & ~(Alignment - 1);
+    }
+
+    RedisReplyArena* RedisReplyArena::create(size_t hint)
+    {
+        return construct(std::max(ChunkSize, headerSize() + hint));
+    }
+
+    RedisReplyArena* RedisReplyArena::adopt(redisReply* r)
+    {
+        RedisReplyArena* arena = construct(headerSize() + sizeof(Cleanup) + Alignment);
+
+        arena->addCleanup(::freeReplyObject, r);
+        return arena;
+    }
+
+    RedisReplyArena* RedisReplyArena::construct(size_t size)
+    {
+        const size_t header = headerSize();
+        Chunk* chunk = static_cast<Chunk*>(::malloc(size));
+
+        if (chunk == 0)
+        {
+            throw std::bad_alloc();
+        }
+
+        chunk->next = 0;
+        chunk->size = size;
+
+        char* base = reinterpret_cast<char*>(chunk);
+        return new (chunk + 1) RedisReplyArena(chunk, base + header, base + size);
+    }
+
+    void RedisReplyArena::destroy(RedisReplyArena* arena)
+    {
+        for (Cleanup* cleanup = arena->_cleanups; cleanup != 0; cleanup = cleanup->next)
+        {
+            cleanup->fn(cleanup->data);
+        }
+
+        // arena itself lives in the last chunk of the list
+        Chunk* chunk = arena->_chunks;
+
+        while (chunk != 0)
+        {
+            Chunk* next = chunk->next;
+            ::free(chunk);
+            chunk = next;
+        }
+    }
+
+    void* RedisReplyArena::grow(size_t size)
+    {
+        const size_t header = (sizeof(Chunk) + Alignment - 1) & ~(Alignment - 1);
+        const size_t chunkSize = std::max(_next, header + size);
+
+        Chunk* chunk = static_cast<Chunk*>(::malloc(chunkSize));
+
+        if (chunk == 0)
+        {
+            throw std::bad_alloc();
+        }
+
+        chunk->next = _chunks;
+        chunk->size = chunkSize;
+        _chunks = chunk;
+
+        if (_next < MaxChunkSize)
+        {
+            _next *= 2;
+        }
+
+        char* base = reinterpret_cast<char*>(chunk);
+        _top = base + header + size;
+        _end = base + chunkSize;
+
+        return base + header;
+    }
+
+    RedisReplyArena& RedisReplyArena::of(const redisReadTask* task, size_t hint)
+    {
+        RedisReplyArena*& arena = *static_cast<RedisReplyArena**>(task->privdata);
+
+        if (arena == 0)
+        {
+            arena = create(hint);
+        }
+
+        return *arena;
+    }
+
+    redisReply* RedisReplyArena::createReply(const redisReadTask* task, size_t extra, size_t reserve)
+    {
+        const size_t size = sizeof(redisReply) + extra;
+        redisReply* r = static_cast<redisReply*>(of(task, size + reserve + Alignment).allocate(size));
+
+        ::memset(r, 0, sizeof(redisReply));
+        r->type = task->type;
+
+        if (task->parent != 0)
+        {
+            static_cast<redisReply*>(task->parent->obj)->element[task->idx] = r;
+        }
+
+        return r;
+    }
+
+    void* RedisReplyArena::createString(const redisReadTask* task, char* str, size_t len)
+    {
+        try
+        {
+#if HIREDIS_MAJOR >= 1
+            if (task->type == REDIS_REPLY_VERB)
+            {
+                return createVerbatim(task, str, len);
+            }
+#endif
+            redisReply* r = createReply(task, len + 1, 0);
+
+            r->str = reinterpret_cast<char*>(r + 1);
+            r->len = len;
+            ::memcpy(r->str, str, len);
+            r->str[len] = '\0';
+
+            return r;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+    void* RedisReplyArena::createArray(const redisReadTask* task, ElementCount elements)
+    {
+        try
+        {
+            const size_t size = elements * sizeof(redisReply*);
+
+            // top level array sizes first chunk for its elements up front
+            redisReply* r = createReply(task, size, elements * (sizeof(redisReply) + 2 * Alignment));
+
+            r->elements = elements;
+
+            if (elements > 0)
+            {
+                r->element = reinterpret_cast<redisReply**>(r + 1);
+                ::memset(r->element, 0, size);
+            }
+
+            return r;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+    void* RedisReplyArena::createInteger(const redisReadTask* task, long long value)
+    {
+        try
+        {
+            redisReply* r = createReply(task, 0, 0);
+            r->type = REDIS_REPLY_INTEGER;
+            r->integer = value;
+            return r;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+    void* RedisReplyArena::createNil(const redisReadTask* task)
+    {
+        try
+        {
+            redisReply* r = createReply(task, 0, 0);
+            r->type = REDIS_REPLY_NIL;
+            return r;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+#if HIREDIS_MAJOR >= 1
+    // Verbatim string "xxx:<text>" is kept as text with xxx in vtype,
+    // malformed ones fail the reader as with hiredis default functions
+    void* RedisReplyArena::createVerbatim(const redisReadTask* task, char* str, size_t len)
+    {
+        try
+        {
+            if (len < 4 || str[3] != ':')
+            {
+                return 0;
+            }
+
+            redisReply* r = createReply(task, len - 3, 0);
+
+            r->str = reinterpret_cast<char*>(r + 1);
+            r->len = len - 4;
+            ::memcpy(r->vtype, str, 3);
+            r->vtype[3] = '\0';
+            ::memcpy(r->str, str + 4, len - 4);
+            r->str[len - 4] = '\0';
+
+            return r;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+    void* RedisReplyArena::createDouble(const redisReadTask* task, double value, char* str, size_t len)
+    {
+        redisReply* r = static_cast<redisReply*>(createString(task, str, len));
+
+        if (r != 0)
+        {
+            r->type = REDIS_REPLY_DOUBLE;
+            r->dval = value;
+        }
+
+        return r;
+    }
+
+    void* RedisReplyArena::createBool(const redisReadTask* task, int value)
+    {
+        try
+        {
+            redisReply* r = createReply(task, 0, 0);
+            r->type = REDIS_REPLY_BOOL;
+            r->integer = value != 0;
+            return r;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+#endif
+
+    void RedisReplyArena::freeObject(void*)
+    {
+        // reply tree is released with its arena
+    }
+
+#if HIREDIS_MAJOR >= 1
+    redisReplyObjectFunctions RedisLazyArray::Functions =
+    {
+        RedisLazyArray::createString,
+        RedisLazyArray::createArray,
+        RedisLazyArray::createInteger,
+        RedisLazyArray::createDouble,
+        RedisLazyArray::createNil,
+        RedisLazyArray::createBool,
+        RedisReplyArena::freeObject
+    };
+#else
+    redisReplyObjectFunctions RedisLazyArray::Functions =
+    {
+        RedisLazyArray::createString,
+        RedisLazyArray::createArray,
+        RedisLazyArray::createInteger,
+        RedisLazyArray::createNil,
+        RedisReplyArena::freeObject
+    };
+#endif
+
+    // Packed element is a type byte followed by
+    //   strings: size_t length, bytes and terminating zero
+    //   integers and booleans: long long
+    //   doubles: double, then the string form as for strings
+    //   nested aggregates: size_t count, then the packed children
+    //   nil: nothing
+
+    RedisLazyArray::RedisLazyArray(RedisReplyArena* arena, int type, size_t elements)
+        : _arena(arena), _data(0), _size(0), _capacity(0),
+          _offsets(0), _indexed(0), _elements(0)
+    {
+        ::memset(&_reply, 0, sizeof(_reply));
+        _reply.type = type;
+        _reply.elements = elements;
+    }
+
+    RedisLazyArray& RedisLazyArray::of(const redisReadTask* task)
+    {
+        while (task->parent != 0)
+        {
+            task = task->parent;
+        }
+
+        return *reinterpret_cast<RedisLazyArray*>(task->obj);
+    }
+
+    void RedisLazyArray::release(void* data)
+    {
+        ::free(static_cast<RedisLazyArray*>(data)->_data);
+    }
+
+    char* RedisLazyArray::reserve(size_t size)
+    {
+        if (_size + size > _capacity)
+        {
+            size_t capacity = std::max(_capacity * 2, _size + size);
+            char* data = static_cast<char*>(::realloc(_data, capacity));
+
+            if (data == 0)
+            {
+                throw std::bad_alloc();
+            }
+
+            _data = data;
+            _capacity = capacity;
+        }
+
+        char* p = _data + _size;
+        _size += size;
+        return p;
+    }
+
+    size_t RedisLazyArray::skip(size_t offset) const
+    {
+        const int type = static_cast<unsigned char>(_data[offset++]);
+        size_t size;
+
+        switch (type)
+        {
+        case REDIS_REPLY_NIL:
+            return offset;
+
+        case REDIS_REPLY_INTEGER:
+#if HIREDIS_MAJOR >= 1
+        case REDIS_REPLY_BOOL:
+#endif
+            return offset + sizeof(long long);
+
+        case REDIS_REPLY_ARRAY:
+#if HIREDIS_MAJOR >= 1
+        case REDIS_REPLY_MAP:
+        case REDIS_REPLY_SET:
+        case REDIS_REPLY_ATTR:
+        case REDIS_REPLY_PUSH:
+#endif
+            ::memcpy(&size, _data + offset, sizeof(size));
+            offset += sizeof(size);
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                offset = skip(offset);
+            }
+
+            return offset;
+
+#if HIREDIS_MAJOR >= 1
+        case REDIS_REPLY_DOUBLE:
+            offset += sizeof(double);
+            // fall through to the string form
+#endif
+        default:
+            ::memcpy(&size, _data + offset, sizeof(size));
+            return offset + sizeof(size) + size + 1;
+        }
+    }
+
+    redisReply* RedisLazyArray::materialize(size_t& offset)
+    {
+        redisReply* r = static_cast<redisReply*>(_arena->allocate(sizeof(redisReply)));
+        size_t size;
+
+        ::memset(r, 0, sizeof(redisReply));
+        r->type = static_cast<unsigned char>(_data[offset++]);
+
+        switch (r->type)
+        {
+        case REDIS_REPLY_NIL:
+            break;
+
+        case REDIS_REPLY_INTEGER:
+#if HIREDIS_MAJOR >= 1
+        case REDIS_REPLY_BOOL:
+#endif
+            ::memcpy(&r->integer, _data + offset, sizeof(r->integer));
+            offset += sizeof(r->integer);
+            break;
+
+        case REDIS_REPLY_ARRAY:
+#if HIREDIS_MAJOR >= 1
+        case REDIS_REPLY_MAP:
+        case REDIS_REPLY_SET:
+        case REDIS_REPLY_ATTR:
+        case REDIS_REPLY_PUSH:
+#endif
+            ::memcpy(&size, _data + offset, sizeof(size));
+            offset += sizeof(size);
+
+            r->elements = size;
+
+            if (size > 0)
+            {
+                r->element = static_cast<redisReply**>(_arena->allocate(size * sizeof(redisReply*)));
+
+                for (size_t i = 0; i < size; ++i)
+                {
+                    r->element[i] = materialize(offset);
+                }
+            }
+            break;
+
+        default:
+#if HIREDIS_MAJOR >= 1
+            if (r->type == REDIS_REPLY_DOUBLE)
+            {
+                ::memcpy(&r->dval, _data + offset, sizeof(r->dval));
+                offset += sizeof(r->dval);
+            }
+#endif
+            ::memcpy(&size, _data + offset, sizeof(size));
+            offset += sizeof(size);
+
+            // string stays in the packed buffer which does not move after parsing
+            r->str = _data + offset;
+            r->len = size;
+            offset += size + 1;
+
+#if HIREDIS_MAJOR >= 1
+            if (r->type == REDIS_REPLY_VERB)
+            {
+                // format prefix was checked while parsing
+                ::memcpy(r->vtype, r->str, 3);
+                r->str += 4;
+                r->len -= 4;
+            }
+#endif
+            break;
+        }
+
+        return r;
+    }
+
+    redisReply* RedisLazyArray::element(const redisReply* r, size_t i)
+    {
+        RedisLazyArray* array = reinterpret_cast<RedisLazyArray*>(const_cast<redisReply*>(r));
+
+        if (array->_elements == 0)
+        {
+            const size_t size = array->_reply.elements;
+
+            array->_elements = static_cast<redisReply**>(array->_arena->allocate(size * sizeof(redisReply*)));
+            array->_offsets = static_cast<size_t*>(array->_arena->allocate(size * sizeof(size_t)));
+            ::memset(array->_elements, 0, size * sizeof(redisReply*));
+
+            array->_offsets[0] = 0;
+            array->_indexed = 1;
+        }
+
+        if (array->_elements[i] == 0)
+        {
+            while (array->_indexed <= i)
+            {
+                array->_offsets[array->_indexed] = array->skip(array->_offsets[array->_indexed - 1]);
+                ++array->_indexed;
+            }
+
+            size_t offset = array->_offsets[i];
+            array->_elements[i] = array->materialize(offset);
+        }
+
+        return array->_elements[i];
+    }
+
+    void* RedisLazyArray::createString(const redisReadTask* task, char* str, size_t len)
     {
-        const size_t bufferSize = 512;
-        wchar_t buffer[bufferSize];
+        try
+        {
+            if (task->parent == 0)
+            {
+                return RedisReplyArena::createString(task, str, len);
+            }
+
+#if HIREDIS_MAJOR >= 1
+            if (task->type == REDIS_REPLY_VERB && (len < 4 || str[3] != ':'))
+            {
+                return 0;
+            }
+#endif
+
+            RedisLazyArray& array = of(task);
+            char* p = array.reserve(1 + sizeof(len) + len + 1);
 
-        string.resize(0);
+            *p++ = static_cast<char>(task->type);
+            ::memcpy(p, &len, sizeof(len));
+            p += sizeof(len);
+            ::memcpy(p, str, len);
+            p[len] = '\0';
 
-        if (size)
+            return &array._reply;
+        }
+        catch (const std::bad_alloc&)
         {
-            std::codecvt_base::result result = std::codecvt_base::partial;
+            return 0;
+        }
+    }
 
-            while (result == std::codecvt_base::partial)
+    void* RedisLazyArray::createArray(const redisReadTask* task, RedisReplyArena::ElementCount elements)
+    {
+        try
+        {
+            if (task->parent == 0)
             {
-                wchar_t* bufferIt;
-                const char* dataIt;
+                if (elements == 0)
+                {
+                    return RedisReplyArena::createArray(task, elements);
+                }
+
+                RedisReplyArena& arena = RedisReplyArena::of(task, sizeof(RedisLazyArray) +
+                                                            elements * (sizeof(size_t) + sizeof(redisReply*)));
+                RedisLazyArray* array = new (arena.allocate(sizeof(RedisLazyArray)))
+                    RedisLazyArray(&arena, task->type, elements);
 
-                std::mbstate_t conversionState = std::mbstate_t();
-                result = std::use_facet<std::codecvt<wchar_t, char, std::mbstate_t> >(std::locale(std::locale::classic(),
-                        new boost::archive::detail::utf8_codecvt_facet)).in(conversionState, data, data + size, dataIt, buffer, buffer + bufferSize, bufferIt);
+                arena.addCleanup(release, array);
 
-                string.append(buffer, bufferIt);
-                size -= (dataIt - data);
-                data = dataIt;
+                return &array->_reply;
             }
 
-            if (result == std::codecvt_base::error)
+            RedisLazyArray& array = of(task);
+            const size_t size = elements;
+            char* p = array.reserve(1 + sizeof(size));
+
+            *p++ = static_cast<char>(task->type);
+            ::memcpy(p, &size, sizeof(size));
+
+            return &array._reply;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+    void* RedisLazyArray::createInteger(const redisReadTask* task, long long value)
+    {
+        try
+        {
+            if (task->parent == 0)
             {
+                return RedisReplyArena::createInteger(task, value);
             }
+
+            RedisLazyArray& array = of(task);
+            char* p = array.reserve(1 + sizeof(value));
+
+            *p++ = static_cast<char>(REDIS_REPLY_INTEGER);
+            ::memcpy(p, &value, sizeof(value));
+
+            return &array._reply;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
         }
     }
 
+    void* RedisLazyArray::createNil(const redisReadTask* task)
+    {
+        try
+        {
+            if (task->parent == 0)
+            {
+                return RedisReplyArena::createNil(task);
+            }
+
+            RedisLazyArray& array = of(task);
+            *array.reserve(1) = static_cast<char>(REDIS_REPLY_NIL);
+
+            return &array._reply;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+#if HIREDIS_MAJOR >= 1
+    void* RedisLazyArray::createDouble(const redisReadTask* task, double value, char* str, size_t len)
+    {
+        try
+        {
+            if (task->parent == 0)
+            {
+                return RedisReplyArena::createDouble(task, value, str, len);
+            }
+
+            RedisLazyArray& array = of(task);
+            char* p = array.reserve(1 + sizeof(value) + sizeof(len) + len + 1);
+
+            *p++ = static_cast<char>(REDIS_REPLY_DOUBLE);
+            ::memcpy(p, &value, sizeof(value));
+            p += sizeof(value);
+            ::memcpy(p, &len, sizeof(len));
+            p += sizeof(len);
+            ::memcpy(p, str, len);
+            p[len] = '\0';
+
+            return &array._reply;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+
+    void* RedisLazyArray::createBool(const redisReadTask* task, int value)
+    {
+        try
+        {
+            if (task->parent == 0)
+            {
+                return RedisReplyArena::createBool(task, value);
+            }
+
+            RedisLazyArray& array = of(task);
+            char* p = array.reserve(1 + sizeof(long long));
+            const long long integer = value != 0;
+
+            *p++ = static_cast<char>(REDIS_REPLY_BOOL);
+            ::memcpy(p, &integer, sizeof(integer));
+
+            return &array._reply;
+        }
+        catch (const std::bad_alloc&)
+        {
+            return 0;
+        }
+    }
+#endif
+
+    namespace
+    {
+        // Copies the ASCII run at the start of src, returns its length
+        size_t widenAscii(const char* src, size_t size, wchar_t* dst)
+        {
+            size_t i = 0;
+
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+
+            for (; i + 16 <= size; i += 16)
+            {
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+                if (_mm_movemask_epi8(bytes) != 0)
+                {
+                    break;
+                }
+
+                const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+                const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+                __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+
+                if (sizeof(wchar_t) == 4)
+                {
+                    _mm_storeu_si128(out, _mm_unpacklo_epi16(low, zero));
+                    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low, zero));
+                    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high, zero));
+                    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high, zero));
+                }
+                else
+                {
+                    _mm_storeu_si128(out, low);
+                    _mm_storeu_si128(out + 1, high);
+                }
+            }
+#endif
+
+            for (; i < size && static_cast<unsigned char>(src[i]) < 0x80; ++i)
+            {
+                dst[i] = static_cast<wchar_t>(src[i]);
+            }
+
+            return i;
+        }
+
+        // Copies the run of characters below 0x80 at the start of src,
+        // returns its length
+        size_t narrowAscii(const wchar_t* src, size_t size, char* dst)
+        {
+            size_t i = 0;
+
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+
+            if (sizeof(wchar_t) == 4)
+            {
+                const __m128i high = _mm_set1_epi32(~0x7F);
+
+                for (; i + 16 <= size; i += 16)
+                {
+                    const __m128i* in = reinterpret_cast<const __m128i*>(src + i);
+                    const __m128i a = _mm_loadu_si128(in);
+                    const __m128i b = _mm_loadu_si128(in + 1);
+                    const __m128i c = _mm_loadu_si128(in + 2);
+                    const __m128i d = _mm_loadu_si128(in + 3);
+                    const __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, high), zero)) != 0xFFFF)
+                    {
+                        break;
+                    }
+
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                                     _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+                }
+            }
+            else
+            {
+                const __m128i high = _mm_set1_epi16(~0x7F);
+
+                for (; i + 16 <= size; i += 16)
+                {
+                    const __m128i* in = reinterpret_cast<const __m128i*>(src + i);
+                    const __m128i a = _mm_loadu_si128(in);
+                    const __m128i b = _mm_loadu_si128(in + 1);
+
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(a, b), high), zero)) != 0xFFFF)
+                    {
+                        break;
+                    }
+
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(a, b));
+                }
+            }
+#endif
+
+            for (; i < size && static_cast<boost::uint32_t>(src[i]) < 0x80; ++i)
+            {
+                dst[i] = static_cast<char>(src[i]);
+            }
+
+            return i;
+        }
+
+        void invalidUtf8(size_t offset)
+        {
+            throw RedisException("Invalid UTF-8 at byte " + boost::lexical_cast<std::string>(offset));
+        }
+
+        void invalidCharacter(size_t offset)
+        {
+            throw RedisException("Invalid character at " + boost::lexical_cast<std::string>(offset));
+        }
+
+        // Code point of src[i], with UTF-16 surrogate pairs of two byte
+        // wchar_t joined; i is advanced past it
+        boost::uint32_t codePoint(const wchar_t* src, size_t size, size_t& i)
+        {
+            const boost::uint32_t c = static_cast<boost::uint32_t>(src[i]) &
+                (sizeof(wchar_t) == 2 ? 0xFFFF : 0xFFFFFFFF);
+
+            if (c >= 0xD800 && c <= 0xDFFF)
+            {
+                if (sizeof(wchar_t) == 2 && c < 0xDC00 && i + 1 < size)
+                {
+                    const boost::uint32_t low = static_cast<boost::uint32_t>(src[i + 1]) & 0xFFFF;
+
+                    if (low >= 0xDC00 && low <= 0xDFFF)
+                    {
+                        i += 2;
+                        return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                }
+
+                invalidCharacter(i);
+            }
+
+            if (c > 0x10FFFF)
+            {
+                invalidCharacter(i);
+            }
+
+            ++i;
+            return c;
+        }
+
+        // Length of src in UTF-8, throws on characters with no encoding
+        size_t utf8Length(const wchar_t* src, size_t size)
+        {
+            size_t length = 0;
+
+            for (size_t i = 0; i < size; )
+            {
+                const boost::uint32_t c = codePoint(src, size, i);
+                length += (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+            }
+
+            return length;
+        }
+    }
+
+    // Runs of ASCII are converted 16 characters at a time, other
+    // characters one by one with full validation
     template<>
-    void RedisEncoding<wchar_t>::encode(const std::basic_string<wchar_t>& src,
-                                        std::ostream& dst)
+    void RedisEncoding<wchar_t>::decode(const char* data, size_t size, std::basic_string<wchar_t>& string)
     {
-        const size_t bufferSize = 512;
-        char buffer[bufferSize];
-        size_t size = src.size();
+        // never more characters than bytes
+        string.resize(size);
+
+        if (size == 0)
+        {
+            return;
+        }
 
-        if (size)
+        wchar_t* const begin = &string[0];
+        wchar_t* out = begin;
+
+        for (size_t i = 0; ; )
         {
-            std::ostream_iterator<char> out(dst);
-            std::codecvt_base::result result = std::codecvt_base::partial;
-            char* bufferIt;
-            const wchar_t* stringBegin = src.c_str();
-            const wchar_t* stringIt;
+            const size_t ascii = widenAscii(data + i, size - i, out);
+
+            i += ascii;
+            out += ascii;
+
+            if (i == size)
+            {
+                break;
+            }
+
+            const unsigned char lead = static_cast<unsigned char>(data[i]);
+            size_t length;
+            boost::uint32_t c;
+            boost::uint32_t min;
 
-            while (result == std::codecvt_base::partial)
+            if ((lead & 0xE0) == 0xC0)
             {
-                std::mbstate_t conversionState = std::mbstate_t();
-                result = std::use_facet<std::codecvt<wchar_t, char, std::mbstate_t> >
-                    (std::locale(std::locale::classic(),
-                                 new boost::archive::detail::utf8_codecvt_facet))
-                    .out(conversionState, stringBegin, stringBegin+size, stringIt, buffer,
-                         buffer+bufferSize, bufferIt);
+                length = 2; c = lead & 0x1F; min = 0x80;
+            }
+            else if ((lead & 0xF0) == 0xE0)
+            {
+                length = 3; c = lead & 0x0F; min = 0x800;
+            }
+            else if ((lead & 0xF8) == 0xF0)
+            {
+                length = 4; c = lead & 0x07; min = 0x10000;
+            }
+            else
+            {
+                string.clear();
+                invalidUtf8(i);
+            }
+
+            if (length > size - i)
+            {
+                string.clear();
+                invalidUtf8(i);
+            }
+
+            for (size_t k = 1; k < length; ++k)
+            {
+                const unsigned char next = static_cast<unsigned char>(data[i + k]);
+
+                if ((next & 0xC0) != 0x80)
+                {
+                    string.clear();
+                    invalidUtf8(i);
+                }
 
-                std::copy(buffer, bufferIt, out);
-                size -= (stringIt - stringBegin);
-                stringBegin = stringIt;
+                c = (c << 6) | (next & 0x3F);
             }
 
-            if (result == std::codecvt_base::error)
+            // overlong forms, surrogates and code points above Unicode
+            if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
             {
+                string.clear();
+                invalidUtf8(i);
             }
+
+            if (sizeof(wchar_t) == 2 && c >= 0x10000)
+            {
+                c -= 0x10000;
+                *out++ = static_cast<wchar_t>(0xD800 + (c >> 10));
+                *out++ = static_cast<wchar_t>(0xDC00 + (c & 0x3FF));
+            }
+            else
+            {
+                *out++ = static_cast<wchar_t>(c);
+            }
+
+            i += length;
         }
+
+        string.resize(out - begin);
     }
 
     template<>
     void RedisEncoding<wchar_t>::decode(const std::string& data,
                                                std::basic_string<wchar_t>& string)
     {
-        decode(data.c_str(), data.size(), string);
+        decode(data.data(), data.size(), string);
     }
 
+    // Output is sized for ASCII and grown once to the exact length at the
+    // first other character
     template<>
     void RedisEncoding<wchar_t>::encode(const std::basic_string<wchar_t>& string,
                                                std::string& data)
     {
-        std::ostringstream out;
-        encode(string, static_cast<std::ostream&>(out));
-        data=out.str();
+        const wchar_t* src = string.data();
+        const size_t size = string.size();
+
+        data.resize(size);
+
+        if (size == 0)
+        {
+            return;
+        }
+
+        size_t i = narrowAscii(src, size, &data[0]);
+
+        if (i == size)
+        {
+            return;
+        }
+
+        data.resize(i + utf8Length(src + i, size - i));
+
+        char* out = &data[i];
+
+        while (i < size)
+        {
+            const boost::uint32_t c = codePoint(src, size, i);
+
+            if (c < 0x80)
+            {
+                *out++ = static_cast<char>(c);
+
+                const size_t ascii = narrowAscii(src + i, size - i, out);
+
+                i += ascii;
+                out += ascii;
+            }
+            else if (c < 0x800)
+            {
+                *out++ = static_cast<char>(0xC0 | (c >> 6));
+                *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            }
+            else if (c < 0x10000)
+            {
+                *out++ = static_cast<char>(0xE0 | (c >> 12));
+                *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            }
+            else
+            {
+                *out++ = static_cast<char>(0xF0 | (c >> 18));
+                *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+                *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            }
+        }
     }
 
+    template<>
+    void RedisEncoding<wchar_t>::encode(const std::basic_string<wchar_t>& src,
+                                        std::ostream& dst)
+    {
+        std::string data;
+        encode(src, data);
+        dst.write(data.data(), data.size());
+    }
 
 }
@@ -5,14 +5,32 @@
 #ifndef HIREDISPP_H
 #define HIREDISPP_H
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
 #include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <iterator>
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+#include <boost/chrono/duration.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/cstdint.hpp>
 #include <boost/optional.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/config.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+#include <boost/type_traits/is_integral.hpp>
+#include <boost/type_traits/is_floating_point.hpp>
+#include <boost/utility/string_view.hpp>
 #include <hiredis/hiredis.h>
 
 namespace hiredispp
@@ -48,6 +66,209 @@ namespace hiredispp
         }
     };
 
+    // Receives timings of commands sent on connections it is attached to,
+    // called from the thread using the connection
+    class RedisInstrument
+    {
+    public:
+        struct Sample
+        {
+            RedisInstrument* instrument;
+            void* token;
+            boost::uint64_t start;
+            // RESP version the reply is read with, set by the connection
+            int protocol;
+        };
+
+        virtual ~RedisInstrument() { }
+
+        // Command about to be sent, fills the sample passed to completed()
+        virtual void started(const char* data, size_t length, Sample& sample) = 0;
+
+        // Reply is NULL when the command was lost or timed out
+        virtual void completed(const Sample& sample, const redisReply* reply) = 0;
+
+        static void complete(const Sample& sample, const redisReply* reply)
+        {
+            if (sample.instrument != 0)
+            {
+                sample.instrument->completed(sample, reply);
+            }
+        }
+    };
+
+    // Connect, read or write not finished in time, or async command past
+    // its deadline
+    class RedisTimeoutException : public RedisException
+    {
+    public:
+        RedisTimeoutException(const char* cstr)
+            : RedisException(cstr) { }
+        RedisTimeoutException(const std::string& what)
+            : RedisException(what) { }
+    };
+
+    // Bump allocator holding a whole reply tree. Arena header is placed in its
+    // first chunk, so a small reply costs one malloc and is released at once.
+    class RedisReplyArena
+    {
+        struct Chunk
+        {
+            Chunk* next;
+            size_t size;
+        };
+
+        struct Cleanup
+        {
+            void (*fn)(void*);
+            void* data;
+            Cleanup* next;
+        };
+
+        Chunk* _chunks;
+        Cleanup* _cleanups;
+        char* _top;
+        char* _end;
+        size_t _next;
+        int _refs;
+
+        RedisReplyArena(Chunk* chunk, char* top, char* end)
+            : _chunks(chunk), _cleanups(0), _top(top), _end(end), _next(ChunkSize), _refs(1) { }
+
+        static size_t headerSize();
+        static RedisReplyArena* construct(size_t size);
+
+        RedisReplyArena(const RedisReplyArena&);
+        RedisReplyArena& operator=(const RedisReplyArena&);
+
+        void* grow(size_t size);
+
+#if HIREDIS_MAJOR >= 1
+        typedef size_t ElementCount;
+#else
+        typedef int ElementCount;
+#endif
+
+        static RedisReplyArena& of(const redisReadTask* task, size_t hint);
+        static redisReply* createReply(const redisReadTask* task, size_t extra, size_t reserve);
+
+        static void* createString(const redisReadTask* task, char* str, size_t len);
+        static void* createArray(const redisReadTask* task, ElementCount elements);
+        static void* createInteger(const redisReadTask* task, long long value);
+        static void* createNil(const redisReadTask* task);
+#if HIREDIS_MAJOR >= 1
+        static void* createVerbatim(const redisReadTask* task, char* str, size_t len);
+        static void* createDouble(const redisReadTask* task, double value, char* str, size_t len);
+        static void* createBool(const redisReadTask* task, int value);
+#endif
+        static void freeObject(void* reply);
+
+        friend class RedisLazyArray;
+
+    public:
+        static const size_t Alignment = 8;
+        static const size_t ChunkSize = 512;
+        static const size_t MaxChunkSize = 64 * 1024;
+
+        // Reply object functions for hiredis reader, reader privdata must
+        // point to RedisReplyArena* which receives the arena of the reply.
+        // They do not throw, failed allocation fails the reader with
+        // REDIS_ERR_OOM as NULL objects do with hiredis default functions.
+        static redisReplyObjectFunctions Functions;
+
+        // New arena is referenced once, by its creator
+        static RedisReplyArena* create(size_t hint = 0);
+        static void destroy(RedisReplyArena* arena);
+
+        // Minimal arena releasing reply made by hiredis default functions
+        static RedisReplyArena* adopt(redisReply* r);
+
+        void addRef()
+        {
+            ++_refs;
+        }
+
+        // Returns true when the last reference is gone
+        bool release()
+        {
+            return --_refs == 0;
+        }
+
+        void* allocate(size_t size)
+        {
+            size = (size + Alignment - 1) & ~(Alignment - 1);
+
+            if (static_cast<size_t>(_end - _top) < size)
+            {
+                return grow(size);
+            }
+
+            void* p = _top;
+            _top += size;
+            return p;
+        }
+
+        // Registers fn(data) to be called when the arena is destroyed
+        void addCleanup(void (*fn)(void*), void* data)
+        {
+            Cleanup* cleanup = static_cast<Cleanup*>(allocate(sizeof(Cleanup)));
+
+            cleanup->fn = fn;
+            cleanup->data = data;
+            cleanup->next = _cleanups;
+            _cleanups = cleanup;
+        }
+    };
+
+    // Top level array of a lazy reply. While parsing, elements are packed one
+    // after another into a single buffer instead of reply objects; element
+    // offsets and redisReply objects are produced only for accessed elements.
+    class RedisLazyArray
+    {
+        redisReply _reply;
+        RedisReplyArena* _arena;
+        char* _data;
+        size_t _size;
+        size_t _capacity;
+        size_t* _offsets;
+        size_t _indexed;
+        redisReply** _elements;
+
+        RedisLazyArray(RedisReplyArena* arena, int type, size_t elements);
+
+        RedisLazyArray(const RedisLazyArray&);
+        RedisLazyArray& operator=(const RedisLazyArray&);
+
+        char* reserve(size_t size);
+        size_t skip(size_t offset) const;
+        redisReply* materialize(size_t& offset);
+
+        static RedisLazyArray& of(const redisReadTask* task);
+        static void release(void* data);
+
+        static void* createString(const redisReadTask* task, char* str, size_t len);
+        static void* createArray(const redisReadTask* task, RedisReplyArena::ElementCount elements);
+        static void* createInteger(const redisReadTask* task, long long value);
+        static void* createNil(const redisReadTask* task);
+#if HIREDIS_MAJOR >= 1
+        static void* createDouble(const redisReadTask* task, double value, char* str, size_t len);
+        static void* createBool(const redisReadTask* task, int value);
+#endif
+
+    public:
+        // Reply object functions producing lazy top level arrays, privdata
+        // is the same as for RedisReplyArena::Functions
+        static redisReplyObjectFunctions Functions;
+
+        // Lazy arrays are the only ones with elements but no element vector
+        static bool isLazy(const redisReply* r)
+        {
+            return r->elements > 0 && r->element == 0;
+        }
+
+        static redisReply* element(const redisReply* r, size_t i);
+    };
+
     class RedisElementBase
     {
         redisReply* _r;
@@ -81,13 +302,253 @@ namespace hiredispp
     {
     public:
         static const std::basic_string<CharT> Nil;
-        static const std::basic_string<CharT> InfoSeparator;
-        static const std::basic_string<CharT> InfoCrLf;
+    };
+
+    // boost::thread_specific_ptr is keyed by address, pointers an object
+    // cached in other threads are found by one later created at the same
+    // address; caching objects keep an id next to the pointer to tell them
+    class RedisInstance
+    {
+    public:
+        // Unique over the process, never 0
+        static boost::uint64_t nextId();
+    };
+
+    // Converts a single reply object to a value without intermediate strings,
+    // numbers are parsed straight from reply buffer
+    template<typename CharT>
+    class RedisDecoder
+    {
+        typedef boost::integral_constant<int, 0> OtherTag;
+        typedef boost::integral_constant<int, 1> IntegerTag;
+        typedef boost::integral_constant<int, 2> FloatTag;
+
+        static void checkError(const redisReply* r)
+        {
+            if (r->type == REDIS_REPLY_ERROR)
+            {
+                throw RedisException(std::string(r->str, r->len));
+            }
+        }
+
+        // Bulk strings and the RESP3 types carrying their value as text
+        static bool isText(int type)
+        {
+#if HIREDIS_MAJOR >= 1
+            if (type == REDIS_REPLY_VERB || type == REDIS_REPLY_BIGNUM || type == REDIS_REPLY_DOUBLE)
+            {
+                return true;
+            }
+#endif
+            return type == REDIS_REPLY_STRING;
+        }
+
+        static void checkString(const redisReply* r)
+        {
+            checkError(r);
+
+            if (!isText(r->type))
+            {
+                if (r->type == REDIS_REPLY_NIL)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+
+                throw std::runtime_error("Invalid reply type");
+            }
+        }
+
+        template<class V>
+        static void toInteger(bool negative, boost::uint64_t magnitude, V& v)
+        {
+            const boost::uint64_t max = static_cast<boost::uint64_t>(std::numeric_limits<V>::max());
+
+            if (magnitude == 0)
+            {
+                // "-0" is zero for any type
+                v = 0;
+            }
+            else if (negative)
+            {
+                if (!std::numeric_limits<V>::is_signed || magnitude - 1 > max)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+
+                v = static_cast<V>(-static_cast<boost::int64_t>(magnitude - 1) - 1);
+            }
+            else
+            {
+                if (magnitude > max)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+
+                v = static_cast<V>(magnitude);
+            }
+        }
+
+        template<class V>
+        static void decode(const redisReply* r, V& v, IntegerTag)
+        {
+            checkError(r);
+
+#if HIREDIS_MAJOR >= 1
+            if (r->type == REDIS_REPLY_INTEGER || r->type == REDIS_REPLY_BOOL)
+#else
+            if (r->type == REDIS_REPLY_INTEGER)
+#endif
+            {
+                toInteger(r->integer < 0, r->integer < 0 ?
+                          0 - static_cast<boost::uint64_t>(r->integer) :
+                          static_cast<boost::uint64_t>(r->integer), v);
+                return;
+            }
+
+            checkString(r);
+
+            const char* p = r->str;
+            const char* end = r->str + r->len;
+#if __cplusplus >= 201703L
+            std::from_chars_result result = std::from_chars(p, end, v);
+
+            if (result.ec != std::errc() || result.ptr != end)
+            {
+                throw boost::bad_lexical_cast();
+            }
+#else
+            const bool negative = (p != end && *p == '-');
+            boost::uint64_t magnitude = 0;
+
+            if (negative)
+            {
+                ++p;
+            }
+
+            if (p == end)
+            {
+                throw boost::bad_lexical_cast();
+            }
+
+            for (; p != end; ++p)
+            {
+                const unsigned digit = static_cast<unsigned>(*p - '0');
+
+                if (digit > 9 || magnitude > (~static_cast<boost::uint64_t>(0) - digit) / 10)
+                {
+                    throw boost::bad_lexical_cast();
+                }
+
+                magnitude = magnitude * 10 + digit;
+            }
+
+            toInteger(negative, magnitude, v);
+#endif
+        }
+
+        template<class V>
+        static void decode(const redisReply* r, V& v, FloatTag)
+        {
+            checkError(r);
+
+            if (r->type == REDIS_REPLY_INTEGER)
+            {
+                v = static_cast<V>(r->integer);
+                return;
+            }
+
+#if HIREDIS_MAJOR >= 1
+            if (r->type == REDIS_REPLY_DOUBLE)
+            {
+                v = static_cast<V>(r->dval);
+                return;
+            }
+#endif
+
+            checkString(r);
+
+            const char* end = r->str + r->len;
+#if __cplusplus >= 201703L
+            std::from_chars_result result = std::from_chars(r->str, end, v);
+
+            if (result.ec != std::errc() || result.ptr != end)
+            {
+                throw boost::bad_lexical_cast();
+            }
+#else
+            // reply strings are zero terminated
+            char* parsed = 0;
+            v = static_cast<V>(::strtod(r->str, &parsed));
+
+            if (r->len == 0 || parsed != end)
+            {
+                throw boost::bad_lexical_cast();
+            }
+#endif
+        }
+
+        template<class V>
+        static void decode(const redisReply* r, V& v, OtherTag)
+        {
+            std::basic_string<CharT> s;
+            decode(r, s);
+            v = boost::lexical_cast<V>(s);
+        }
+
+    public:
+        static void decode(const redisReply* r, std::basic_string<CharT>& v)
+        {
+            checkError(r);
+
+            if (r->type == REDIS_REPLY_NIL)
+            {
+                v = RedisConst<CharT>::Nil;
+                return;
+            }
+
+            if (!isText(r->type))
+            {
+                throw std::runtime_error("Invalid reply type");
+            }
+
+            RedisEncoding<CharT>::decode(r->str, r->len, v);
+        }
+
+        static void decode(const redisReply* r, bool& v)
+        {
+            int i;
+            decode(r, i, IntegerTag());
+
+            if (i != 0 && i != 1)
+            {
+                throw boost::bad_lexical_cast();
+            }
+
+            v = (i != 0);
+        }
+
+        template<class V>
+        static void decode(const redisReply* r, V& v)
+        {
+            decode(r, v, boost::integral_constant<int,
+                   boost::is_integral<V>::value ? 1 : boost::is_floating_point<V>::value ? 2 : 0>());
+        }
     };
 
     template<class T, typename CharT>
     class RedisResult : public T
     {
+        // Unchecked element access for bulk decoders validating reply once
+        const redisReply* element(size_t i) const
+        {
+            if (RedisLazyArray::isLazy(T::get()))
+            {
+                return RedisLazyArray::element(T::get(), i);
+            }
+
+            return T::get()->element[i];
+        }
+
         std::basic_string<CharT> getString() const
         {
             std::basic_string<CharT> s;
@@ -95,10 +556,73 @@ namespace hiredispp
             return s;
         }
 
+        // Arrays and the RESP3 aggregates, maps hold keys and values in turn
+        bool isAggregate() const
+        {
+            switch (T::get()->type)
+            {
+            case REDIS_REPLY_ARRAY:
+#if HIREDIS_MAJOR >= 1
+            case REDIS_REPLY_MAP:
+            case REDIS_REPLY_SET:
+            case REDIS_REPLY_ATTR:
+            case REDIS_REPLY_PUSH:
+#endif
+                return true;
+
+            default:
+                return false;
+            }
+        }
+
+        // Bulk strings and the RESP3 types carrying their value as text
+        bool isText() const
+        {
+#if HIREDIS_MAJOR >= 1
+            if (
+                    T::get()->type == REDIS_REPLY_VERB ||
+                    T::get()->type == REDIS_REPLY_BIGNUM ||
+                    T::get()->type == REDIS_REPLY_DOUBLE)
+            {
+                return true;
+            }
+#endif
+            return T::get()->type == REDIS_REPLY_STRING;
+        }
+
+        bool isInteger() const
+        {
+#if HIREDIS_MAJOR >= 1
+            if (T::get()->type == REDIS_REPLY_BOOL)
+            {
+                return true;
+            }
+#endif
+            return T::get()->type == REDIS_REPLY_INTEGER;
+        }
+
+        // Pairs of a map, or of a flat array of keys and values
+        size_t pairs() const
+        {
+            const size_t n = size();
+
+            if (n % 2 != 0)
+            {
+                throw std::runtime_error("Invalid reply size");
+            }
+
+            return n / 2;
+        }
+
     public:
+        RedisResult() { }
+
         RedisResult(redisReply* r)
             : T(r) { }
 
+        RedisResult(redisReply* r, RedisReplyArena* arena)
+            : T(r, arena) { }
+
         bool isError() const
         {
             return (T::get()->type == REDIS_REPLY_ERROR);
@@ -119,6 +643,62 @@ namespace hiredispp
             return (T::get()->type == REDIS_REPLY_NIL);
         }
 
+#if HIREDIS_MAJOR >= 1
+        // RESP3 types, replies of connections speaking protocol 3
+        bool isMap() const
+        {
+            return (T::get()->type == REDIS_REPLY_MAP);
+        }
+
+        bool isSet() const
+        {
+            return (T::get()->type == REDIS_REPLY_SET);
+        }
+
+        bool isDouble() const
+        {
+            return (T::get()->type == REDIS_REPLY_DOUBLE);
+        }
+
+        bool isBool() const
+        {
+            return (T::get()->type == REDIS_REPLY_BOOL);
+        }
+
+        bool isBigNumber() const
+        {
+            return (T::get()->type == REDIS_REPLY_BIGNUM);
+        }
+
+        bool isVerbatim() const
+        {
+            return (T::get()->type == REDIS_REPLY_VERB);
+        }
+
+        bool isAttribute() const
+        {
+            return (T::get()->type == REDIS_REPLY_ATTR);
+        }
+
+        bool isPush() const
+        {
+            return (T::get()->type == REDIS_REPLY_PUSH);
+        }
+
+        // Format of a verbatim string such as "txt" or "mkd"
+        std::string verbatimType() const
+        {
+            checkError();
+
+            if (!isVerbatim())
+            {
+                throw std::runtime_error("Invalid reply type");
+            }
+
+            return std::string(T::get()->vtype);
+        }
+#endif
+
         std::basic_string<CharT> getErrorMessage() const
         {
             if (isError())
@@ -145,345 +725,1459 @@ namespace hiredispp
         {
             checkError();
 
-            if (
-                    T::get()->type != REDIS_REPLY_STRING &&
-                    T::get()->type != REDIS_REPLY_NIL)
+            if (!isText() && !isNil())
             {
                 throw std::runtime_error("Invalid reply type");
             }
 
-            if (isNil())
-            {
-                return RedisConst<CharT>::Nil;
-            }
+            if (isNil())
+            {
+                return RedisConst<CharT>::Nil;
+            }
+
+            return getString();
+        }
+
+        operator boost::int64_t() const
+        {
+            checkError();
+
+            if (!isInteger())
+            {
+                throw std::runtime_error("Invalid reply type");
+            }
+
+            return T::get()->integer;
+        }
+
+        operator boost::optional<boost::int64_t>() const
+        {
+            checkError();
+
+            if (!isInteger() && !isNil())
+            {
+                throw std::runtime_error("Invalid reply type");
+            }
+
+            if (isNil())
+            {
+                return boost::optional<boost::int64_t>();
+            }
+
+            return boost::optional<boost::int64_t>(T::get()->integer);
+        }
+
+        size_t size() const
+        {
+            checkError();
+            
+            if (!isAggregate())
+            {
+                throw std::runtime_error("Invalid reply type");
+            }
+
+            return T::get()->elements;
+        }
+
+        RedisResult<RedisElementBase, CharT> operator[](size_t i) const
+        {
+            checkError();
+
+            if (!isAggregate())
+            {
+                throw std::runtime_error("Invalid reply type");
+            }
+
+            if (i >= T::get()->elements)
+            {
+                throw std::runtime_error("Out of range");
+            }
+
+            if (RedisLazyArray::isLazy(T::get()))
+            {
+                return RedisResult<RedisElementBase, CharT>(RedisLazyArray::element(T::get(), i));
+            }
+
+            return RedisResult<RedisElementBase, CharT>(T::get()->element[i]);
+        }
+
+        // Bytes of a string or status reply, valid while the reply is alive.
+        // RESP3 doubles are viewed in the form sent by the server.
+        boost::string_view view() const
+        {
+            checkError();
+
+            if (
+                    !isText() && !isNil() &&
+                    T::get()->type != REDIS_REPLY_STATUS)
+            {
+                throw std::runtime_error("Invalid reply type");
+            }
+
+            if (isNil())
+            {
+                return boost::string_view();
+            }
+
+            return boost::string_view(T::get()->str, T::get()->len);
+        }
+
+        template <class V>
+        void toValue(V& v) const
+        {
+            RedisDecoder<CharT>::decode(T::get(), v);
+        }
+
+        template <class V>
+        void toVector(std::vector<V>& v) const
+        {
+            const size_t n = size();
+
+            v.reserve(v.size() + n);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                v.push_back(V());
+                RedisDecoder<CharT>::decode(element(i), v.back());
+            }
+        }
+
+        // Field/value pairs as returned by HGETALL into std::map like
+        // container, from a RESP3 map or a RESP2 flat array
+        template <class M>
+        void toMap(M& m) const
+        {
+            const size_t n = 2 * pairs();
+
+            for (size_t i = 0; i < n; i += 2)
+            {
+                typename M::key_type key;
+                RedisDecoder<CharT>::decode(element(i), key);
+                RedisDecoder<CharT>::decode(element(i + 1), m[key]);
+            }
+        }
+
+        // Member/score pairs as returned by Z*RANGE* WITHSCORES, flat in
+        // RESP2 and as [member, double] arrays in RESP3
+        template <class V>
+        void toScoredPairs(std::vector<std::pair<V, double> >& v) const
+        {
+            const size_t n = size();
+
+            if (n > 0 && element(0)->type == REDIS_REPLY_ARRAY)
+            {
+                v.reserve(v.size() + n);
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    const redisReply* pair = element(i);
+
+                    if (pair->type != REDIS_REPLY_ARRAY || pair->elements != 2)
+                    {
+                        throw std::runtime_error("Invalid reply size");
+                    }
+
+                    v.push_back(std::pair<V, double>());
+                    RedisDecoder<CharT>::decode(pair->element[0], v.back().first);
+                    RedisDecoder<CharT>::decode(pair->element[1], v.back().second);
+                }
+
+                return;
+            }
+
+            if (n % 2 != 0)
+            {
+                throw std::runtime_error("Invalid reply size");
+            }
+
+            v.reserve(v.size() + n / 2);
+
+            for (size_t i = 0; i < n; i += 2)
+            {
+                v.push_back(std::pair<V, double>());
+                RedisDecoder<CharT>::decode(element(i), v.back().first);
+                RedisDecoder<CharT>::decode(element(i + 1), v.back().second);
+            }
+        }
+    };
+
+    // Reply handle, reference count is kept in the header of the reply arena
+    class RedisReplyBase
+    {
+        redisReply* _r;
+        RedisReplyArena* _arena;
+
+        void addRef()
+        {
+            if (_arena != 0)
+            {
+                _arena->addRef();
+            }
+        }
+
+        void release()
+        {
+            if (_arena != 0 && _arena->release())
+            {
+                RedisReplyArena::destroy(_arena);
+            }
+        }
+
+    public:
+        RedisReplyBase()
+            : _r(0), _arena(0) { }
+
+        // Takes ownership of a reply allocated by hiredis default functions
+        RedisReplyBase(redisReply* r)
+            : _r(r), _arena(r != 0 ? RedisReplyArena::adopt(r) : 0) { }
+
+        // Takes over the reference held by a freshly created arena
+        RedisReplyBase(redisReply* r, RedisReplyArena* arena)
+            : _r(r), _arena(arena) { }
+
+        RedisReplyBase(const RedisReplyBase& from)
+            : _r(from._r), _arena(from._arena)
+        {
+            addRef();
+        }
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+        RedisReplyBase(RedisReplyBase&& from) BOOST_NOEXCEPT
+            : _r(from._r), _arena(from._arena)
+        {
+            from._r = 0;
+            from._arena = 0;
+        }
+
+        RedisReplyBase& operator=(RedisReplyBase&& from) BOOST_NOEXCEPT
+        {
+            swap(from);
+            return *this;
+        }
+#endif
+
+        RedisReplyBase& operator=(const RedisReplyBase& from)
+        {
+            RedisReplyBase(from).swap(*this);
+            return *this;
+        }
+
+        virtual ~RedisReplyBase()
+        {
+            release();
+
+            _r = 0;
+            _arena = 0;
+        }
+
+        void swap(RedisReplyBase& other) BOOST_NOEXCEPT
+        {
+            std::swap(_r, other._r);
+            std::swap(_arena, other._arena);
+        }
+
+        redisReply* get() const
+        {
+            return _r;
+        }
+    };
+
+    class RedisProtocol
+    {
+    public:
+        // Room reserved in front of a command buffer for its "*<argc>\r\n" header
+        static const size_t HeaderSpace = 24;
+
+        // Formats v backwards so that it ends right before end, returns first char
+        static char* formatUnsigned(boost::uint64_t v, char* end)
+        {
+            do
+            {
+                *--end = static_cast<char>('0' + v % 10);
+                v /= 10;
+            }
+            while (v != 0);
+
+            return end;
+        }
+
+        static char* formatInteger(boost::int64_t v, char* end)
+        {
+            if (v < 0)
+            {
+                end = formatUnsigned(0 - static_cast<boost::uint64_t>(v), end);
+                *--end = '-';
+                return end;
+            }
+
+            return formatUnsigned(static_cast<boost::uint64_t>(v), end);
+        }
+
+        // Same precision as boost::lexical_cast<std::string>(double)
+        static size_t formatDouble(double v, char* buffer, size_t size)
+        {
+            return ::snprintf(buffer, size, "%.17g", v);
+        }
+
+        // Writes "*<count>\r\n" right-aligned into first HeaderSpace bytes of buffer,
+        // returns offset of the header start
+        static size_t writeHeader(std::string& buffer, size_t count)
+        {
+            char* end = &buffer[HeaderSpace];
+
+            *--end = '\n';
+            *--end = '\r';
+            end = formatUnsigned(count, end);
+            *--end = '*';
+
+            return end - &buffer[0];
+        }
+
+        static void appendBulk(std::string& out, const char* data, size_t size)
+        {
+            char header[HeaderSpace];
+            char* end = header + HeaderSpace;
+            char* begin;
+
+            *--end = '\n';
+            *--end = '\r';
+            begin = formatUnsigned(size, end);
+            *--begin = '$';
+
+            out.append(begin, header + HeaderSpace - begin);
+            out.append(data, size);
+            out.append("\r\n", 2);
+        }
+
+        static void appendBulk(std::string& out, boost::int64_t v, std::string&)
+        {
+            char buffer[HeaderSpace];
+            char* begin = formatInteger(v, buffer + HeaderSpace);
+            appendBulk(out, begin, buffer + HeaderSpace - begin);
+        }
+
+        static void appendBulk(std::string& out, double v, std::string&)
+        {
+            char buffer[32];
+            appendBulk(out, buffer, formatDouble(v, buffer, sizeof(buffer)));
+        }
+
+        static void appendBulk(std::string& out, const std::string& s, std::string&)
+        {
+            appendBulk(out, s.data(), s.size());
+        }
+
+        template<typename CharT>
+        static void appendBulk(std::string& out, const std::basic_string<CharT>& s, std::string& scratch)
+        {
+            RedisEncoding<CharT>::encode(s, scratch);
+            appendBulk(out, scratch.data(), scratch.size());
+        }
+
+        // First argument of an encoded command, empty when malformed
+        static boost::string_view commandName(const char* data, size_t length)
+        {
+            const char* end = data + length;
+            const char* p = static_cast<const char*>(::memchr(data, '$', length));
+
+            if (p == 0)
+            {
+                return boost::string_view();
+            }
+
+            const char* name = static_cast<const char*>(::memchr(p, '\n', end - p));
+
+            if (name == 0)
+            {
+                return boost::string_view();
+            }
+
+            ++name;
+            const char* last = static_cast<const char*>(::memchr(name, '\r', end - name));
+
+            return boost::string_view(name, (last ? last : end) - name);
+        }
+    };
+
+    // Command is kept RESP encoded in one contiguous buffer which is appended
+    // as is to hiredis output buffer, HeaderSpace bytes in front of the first
+    // argument are reserved for the array header rewritten on every argument.
+    template<typename CharT>
+    class RedisCommandBase
+    {
+        std::string _buffer;
+        std::string _scratch;
+        size_t _offset;
+        size_t _count;
+
+        void addPart(const char* data, size_t size)
+        {
+            RedisProtocol::appendBulk(_buffer, data, size);
+            _offset = RedisProtocol::writeHeader(_buffer, ++_count);
+        }
+
+        void addPart(const std::basic_string<CharT>& s)
+        {
+            RedisProtocol::appendBulk(_buffer, s, _scratch);
+            _offset = RedisProtocol::writeHeader(_buffer, ++_count);
+        }
+
+        void addPart(const char* s)
+        {
+            addPart(s, ::strlen(s));
+        }
+
+        RedisCommandBase<CharT>& addInteger(boost::int64_t v)
+        {
+            char buffer[RedisProtocol::HeaderSpace];
+            char* begin = RedisProtocol::formatInteger(v, buffer + RedisProtocol::HeaderSpace);
+            addPart(begin, buffer + RedisProtocol::HeaderSpace - begin);
+            return *this;
+        }
+
+        RedisCommandBase<CharT>& addUnsigned(boost::uint64_t v)
+        {
+            char buffer[RedisProtocol::HeaderSpace];
+            char* begin = RedisProtocol::formatUnsigned(v, buffer + RedisProtocol::HeaderSpace);
+            addPart(begin, buffer + RedisProtocol::HeaderSpace - begin);
+            return *this;
+        }
+
+        void addParts(const std::vector<std::string>& parts)
+        {
+            for (size_t i = 0; i < parts.size(); ++i)
+            {
+                addPart(parts[i].data(), parts[i].size());
+            }
+        }
+
+    public:
+        RedisCommandBase()
+            : _buffer(RedisProtocol::HeaderSpace, '\0'),
+              _offset(RedisProtocol::HeaderSpace), _count(0) { }
+
+        RedisCommandBase(const char* s)
+            : _buffer(RedisProtocol::HeaderSpace, '\0'),
+              _offset(RedisProtocol::HeaderSpace), _count(0)
+        {
+            addPart(s);
+        }
+
+        RedisCommandBase(const std::basic_string<CharT>& s)
+            : _buffer(RedisProtocol::HeaderSpace, '\0'),
+              _offset(RedisProtocol::HeaderSpace), _count(0)
+        {
+            addPart(s);
+        }
+
+        RedisCommandBase(const std::vector<std::string>& parts)
+            : _buffer(RedisProtocol::HeaderSpace, '\0'),
+              _offset(RedisProtocol::HeaderSpace), _count(0)
+        {
+            addParts(parts);
+        }
+
+        RedisCommandBase(const RedisCommandBase<CharT>& from)
+            : _buffer(from._buffer), _offset(from._offset), _count(from._count) { }
+
+        // Decodes i-th argument, walks the buffer so it is meant for diagnostics
+        std::string operator[](size_t i) const
+        {
+            if (i >= _count)
+            {
+                throw std::runtime_error("Out of range");
+            }
+
+            const char* p = _buffer.data() + RedisProtocol::HeaderSpace;
+
+            for (;;)
+            {
+                size_t size = 0;
+
+                for (++p; *p != '\r'; ++p)
+                {
+                    size = size * 10 + (*p - '0');
+                }
+
+                p += 2;
+
+                if (i-- == 0)
+                {
+                    return std::string(p, size);
+                }
+
+                p += size + 2;
+            }
+        }
+
+        size_t size() const
+        {
+            return _count;
+        }
+
+        // RESP encoded command, ready to be appended to the output buffer
+        const char* data() const
+        {
+            return _buffer.data() + _offset;
+        }
+
+        size_t length() const
+        {
+            return _buffer.size() - _offset;
+        }
+
+        // Drops arguments but keeps allocated buffer for the next command
+        void clear()
+        {
+            _buffer.resize(RedisProtocol::HeaderSpace);
+            _offset = RedisProtocol::HeaderSpace;
+            _count = 0;
+        }
+
+        RedisCommandBase<CharT>& operator=(const std::vector<std::string>& parts)
+        {
+            clear();
+            addParts(parts);
+            return *this;
+        }
+
+        RedisCommandBase<CharT>& operator=(const RedisCommandBase<CharT>& from)
+        {
+            _buffer = from._buffer;
+            _offset = from._offset;
+            _count = from._count;
+            return *this;
+        }
+
+        RedisCommandBase<CharT>& operator<<(const std::basic_string<CharT>& s)
+        {
+            addPart(s);
+            return *this;
+        }
+
+        RedisCommandBase<CharT>& operator<<(const char* s)
+        {
+            addPart(s);
+            return *this;
+        }
+
+        template<size_t N> RedisCommandBase<CharT>& operator<<(const char (&s)[N])
+        {
+            addPart(s);
+            return *this;
+        }
+
+        RedisCommandBase<CharT>& operator<<(const std::vector<std::basic_string<CharT> >& ss)
+        {
+            for (size_t i = 0; i < ss.size(); ++i)
+            {
+                addPart(ss[i]);
+            }
+
+            return *this;
+        }
+
+        RedisCommandBase<CharT>& operator<<(int v)
+        {
+            return addInteger(v);
+        }
+
+        RedisCommandBase<CharT>& operator<<(long v)
+        {
+            return addInteger(v);
+        }
+
+        RedisCommandBase<CharT>& operator<<(long long v)
+        {
+            return addInteger(v);
+        }
+
+        RedisCommandBase<CharT>& operator<<(unsigned int v)
+        {
+            return addUnsigned(v);
+        }
+
+        RedisCommandBase<CharT>& operator<<(unsigned long v)
+        {
+            return addUnsigned(v);
+        }
+
+        RedisCommandBase<CharT>& operator<<(unsigned long long v)
+        {
+            return addUnsigned(v);
+        }
+
+        RedisCommandBase<CharT>& operator<<(double v)
+        {
+            char buffer[32];
+            addPart(buffer, RedisProtocol::formatDouble(v, buffer, sizeof(buffer)));
+            return *this;
+        }
+
+        template<class T> RedisCommandBase<CharT>& operator<<(const T& v)
+        {
+            addPart(boost::lexical_cast<std::basic_string<CharT> >(v));
+            return *this;
+        }
+    };
+
+    // Fixed arity commands with "*<argc>\r\n$<size>\r\n<NAME>\r\n" prefix
+    // assembled by the preprocessor, only the arguments are formatted at runtime
+#define HIREDISPP_RESP_COMMAND(type, argc, size, name) \
+    struct type \
+    { \
+        enum { Argc = argc, PrefixLength = sizeof("*" #argc "\r\n$" #size "\r\n" #name "\r\n") - 1 }; \
+        static const char* prefix() { return "*" #argc "\r\n$" #size "\r\n" #name "\r\n"; } \
+    }; \
+    BOOST_STATIC_ASSERT(sizeof(#name) - 1 == size)
+
+    namespace resp
+    {
+        HIREDISPP_RESP_COMMAND(Ping, 1, 4, PING);
+        HIREDISPP_RESP_COMMAND(Info, 1, 4, INFO);
+        HIREDISPP_RESP_COMMAND(Select, 2, 6, SELECT);
+        HIREDISPP_RESP_COMMAND(Get, 2, 3, GET);
+        HIREDISPP_RESP_COMMAND(Exists, 2, 6, EXISTS);
+        HIREDISPP_RESP_COMMAND(Set, 3, 3, SET);
+        HIREDISPP_RESP_COMMAND(Setnx, 3, 5, SETNX);
+        HIREDISPP_RESP_COMMAND(Incr, 2, 4, INCR);
+        HIREDISPP_RESP_COMMAND(Keys, 2, 4, KEYS);
+        HIREDISPP_RESP_COMMAND(Del, 2, 3, DEL);
+        HIREDISPP_RESP_COMMAND(Lpush, 3, 5, LPUSH);
+        HIREDISPP_RESP_COMMAND(Lpop, 2, 4, LPOP);
+        HIREDISPP_RESP_COMMAND(Rpush, 3, 5, RPUSH);
+        HIREDISPP_RESP_COMMAND(Rpop, 2, 4, RPOP);
+        HIREDISPP_RESP_COMMAND(Lindex, 3, 6, LINDEX);
+        HIREDISPP_RESP_COMMAND(Lrange, 4, 6, LRANGE);
+        HIREDISPP_RESP_COMMAND(Llen, 2, 4, LLEN);
+        HIREDISPP_RESP_COMMAND(Hget, 3, 4, HGET);
+        HIREDISPP_RESP_COMMAND(Hdel, 3, 4, HDEL);
+        HIREDISPP_RESP_COMMAND(Hset, 4, 4, HSET);
+        HIREDISPP_RESP_COMMAND(Hsetnx, 4, 6, HSETNX);
+        HIREDISPP_RESP_COMMAND(Hincrby, 4, 7, HINCRBY);
+        HIREDISPP_RESP_COMMAND(Hgetall, 2, 7, HGETALL);
+        HIREDISPP_RESP_COMMAND(Sadd, 3, 4, SADD);
+        HIREDISPP_RESP_COMMAND(Sismember, 3, 9, SISMEMBER);
+        HIREDISPP_RESP_COMMAND(Srem, 3, 4, SREM);
+        HIREDISPP_RESP_COMMAND(Smembers, 2, 8, SMEMBERS);
+        HIREDISPP_RESP_COMMAND(Sdiff, 3, 5, SDIFF);
+        HIREDISPP_RESP_COMMAND(Sunion, 3, 6, SUNION);
+        HIREDISPP_RESP_COMMAND(Scard, 2, 5, SCARD);
+        HIREDISPP_RESP_COMMAND(Zadd, 4, 4, ZADD);
+        HIREDISPP_RESP_COMMAND(Zrem, 3, 4, ZREM);
+        HIREDISPP_RESP_COMMAND(Zrank, 3, 5, ZRANK);
+        HIREDISPP_RESP_COMMAND(Zrevrank, 3, 8, ZREVRANK);
+        HIREDISPP_RESP_COMMAND(Zrange, 4, 6, ZRANGE);
+        HIREDISPP_RESP_COMMAND(Zrevrange, 4, 9, ZREVRANGE);
+        HIREDISPP_RESP_COMMAND(Zrangebyscore, 4, 13, ZRANGEBYSCORE);
+        HIREDISPP_RESP_COMMAND(Zrevrangebyscore, 4, 16, ZREVRANGEBYSCORE);
+        HIREDISPP_RESP_COMMAND(Zcard, 2, 5, ZCARD);
+        HIREDISPP_RESP_COMMAND(Unwatch, 1, 7, UNWATCH);
+        HIREDISPP_RESP_COMMAND(Multi, 1, 5, MULTI);
+        HIREDISPP_RESP_COMMAND(Exec, 1, 4, EXEC);
+        HIREDISPP_RESP_COMMAND(Asking, 1, 6, ASKING);
+        HIREDISPP_RESP_COMMAND(Hello, 2, 5, HELLO);
+    }
+
+#undef HIREDISPP_RESP_COMMAND
+
+#if HIREDIS_MAJOR >= 1
+    // Receives RESP3 push frames, such as invalidation messages of client
+    // side caching, read on connections it is attached to. Called from the
+    // thread reading replies, it must not send commands on that connection.
+    template<typename CharT>
+    class RedisPushHandler
+    {
+    public:
+        virtual ~RedisPushHandler() { }
+
+        virtual void pushed(const RedisResult<RedisReplyBase, CharT>& push) = 0;
+    };
+#endif
+
+    template<typename CharT>
+    class RedisBase;
+
+    // Reply of a command queued by RedisBase::defer, it is read from the
+    // connection when accessed. Connection must outlive its deferred replies.
+    template<typename CharT>
+    class RedisDeferred
+    {
+        const RedisBase<CharT>* _redis;
+        size_t _slot;
+
+        // Takes over the reference to slot held by its creator
+        RedisDeferred(const RedisBase<CharT>* redis, size_t slot)
+            : _redis(redis), _slot(slot) { }
+
+        const RedisBase<CharT>& redis() const
+        {
+            if (_redis == 0)
+            {
+                throw RedisException("Deferred reply has no command");
+            }
+
+            return *_redis;
+        }
+
+        friend class RedisBase<CharT>;
+
+    public:
+        typedef RedisResult<RedisReplyBase, CharT> Reply;
+
+        // Empty handle, accessing its reply throws RedisException
+        RedisDeferred()
+            : _redis(0), _slot(0) { }
+
+        RedisDeferred(const RedisDeferred<CharT>& from)
+            : _redis(from._redis), _slot(from._slot)
+        {
+            if (_redis != 0)
+            {
+                _redis->retainSlot(_slot);
+            }
+        }
+
+        RedisDeferred<CharT>& operator=(const RedisDeferred<CharT>& from)
+        {
+            RedisDeferred<CharT>(from).swap(*this);
+            return *this;
+        }
+
+        ~RedisDeferred()
+        {
+            if (_redis != 0)
+            {
+                _redis->releaseSlot(_slot);
+            }
+        }
+
+        void swap(RedisDeferred<CharT>& other)
+        {
+            std::swap(_redis, other._redis);
+            std::swap(_slot, other._slot);
+        }
+
+        // True when the reply was already read from the connection
+        bool ready() const
+        {
+            return redis().slotReady(_slot);
+        }
+
+        // Sends queued commands and reads replies up to this one
+        Reply reply() const
+        {
+            return redis().resolve(_slot);
+        }
+
+        operator Reply() const
+        {
+            return reply();
+        }
+
+        operator std::basic_string<CharT>() const
+        {
+            return reply();
+        }
+
+        operator boost::int64_t() const
+        {
+            return reply();
+        }
+
+        operator boost::optional<boost::int64_t>() const
+        {
+            return reply();
+        }
+    };
+
+    template<typename CharT>
+    class RedisBase : public RedisConst<CharT>
+    {
+        // Reply of a deferred command, referenced by its handles and by the
+        // pending queue until the reply is read
+        struct Slot
+        {
+            RedisResult<RedisReplyBase, CharT> reply;
+            std::string error;
+            size_t next;
+            int refs;
+            bool ready;
+        };
+
+        // Marks commands of begin calls in the pending queue, ends free list
+        static const size_t Manual = ~static_cast<size_t>(0);
+
+        mutable redisContext* _context;
+        mutable RedisReplyArena* _arena;
+        bool _lazy;
+        int _protocol;
+
+        std::string _host;
+        int _port;
+
+        mutable std::string _output;
+        mutable std::string _scratch;
+
+        // Replies expected from the connection are those of _ahead begin
+        // calls followed by entries of _pending; replies of begin calls read
+        // while resolving deferred commands wait in _early for endCommand
+        mutable size_t _ahead;
+        mutable std::deque<size_t> _pending;
+        mutable std::deque<RedisResult<RedisReplyBase, CharT> > _early;
+        mutable std::vector<Slot> _slots;
+        mutable size_t _free;
+        size_t _autoPipeline;
+
+        boost::chrono::milliseconds _connectTimeout;
+        boost::chrono::milliseconds _timeout;
+
+        // Samples of replies expected, in order, while instrumented
+        RedisInstrument* _instrument;
+        mutable std::deque<RedisInstrument::Sample> _samples;
+
+#if HIREDIS_MAJOR >= 1
+        RedisPushHandler<CharT>* _pushHandler;
+        mutable RedisResult<RedisReplyBase, CharT> _attribute;
+#endif
+
+        friend class RedisDeferred<CharT>;
+
+        RedisBase(const RedisBase<CharT>&);
+        RedisBase<CharT>& operator=(const RedisBase<CharT>&);
+
+        void append(const char* data, size_t length, size_t entry) const
+        {
+            connect();
+            ::redisAppendFormattedCommand(_context, data, length);
+
+            if (_instrument != 0)
+            {
+                _samples.push_back(RedisInstrument::Sample());
+                _samples.back().protocol = _protocol;
+                _instrument->started(data, length, _samples.back());
+            }
+
+            if (entry != Manual)
+            {
+                _pending.push_back(entry);
+            }
+            else if (_pending.empty())
+            {
+                ++_ahead;
+            }
+            else
+            {
+                _pending.push_back(Manual);
+            }
+        }
+
+        void appendOutput() const
+        {
+            append(_output.data(), _output.size(), Manual);
+        }
+
+        RedisResult<RedisReplyBase, CharT> readFrame() const
+        {
+            redisReply* r;
+
+            if (::redisGetReply(_context, reinterpret_cast<void**>(&r)) != REDIS_OK)
+            {
+                fail();
+            }
+
+            RedisReplyArena* arena = _arena;
+            _arena = 0;
+
+            return RedisResult<RedisReplyBase, CharT>(r, arena);
+        }
+
+        RedisResult<RedisReplyBase, CharT> readReply() const
+        {
+            RedisResult<RedisReplyBase, CharT> reply = readFrame();
+
+#if HIREDIS_MAJOR >= 1
+            // push frames come in between replies, attributes in front of one
+            RedisResult<RedisReplyBase, CharT> attribute;
+
+            while (reply.isPush() || reply.isAttribute())
+            {
+                if (reply.isAttribute())
+                {
+                    attribute.swap(reply);
+                }
+                else if (_pushHandler != 0)
+                {
+                    _pushHandler->pushed(reply);
+                }
+
+                reply = readFrame();
+            }
+
+            _attribute.swap(attribute);
+#endif
+
+            if (!_samples.empty())
+            {
+                RedisInstrument::complete(_samples.front(), reply.get());
+                _samples.pop_front();
+            }
+
+            return reply;
+        }
+
+        // Reads the next expected reply into its slot or into _early
+        void readNext() const
+        {
+            if (_ahead > 0)
+            {
+                _early.push_back(readReply());
+                --_ahead;
+                return;
+            }
+
+            const size_t entry = _pending.front();
+            RedisResult<RedisReplyBase, CharT> reply = readReply();
+            _pending.pop_front();
+
+            if (entry == Manual)
+            {
+                _early.push_back(reply);
+            }
+            else
+            {
+                _slots[entry].reply.swap(reply);
+                _slots[entry].ready = true;
+                releaseSlot(entry);
+            }
+        }
+
+        size_t acquireSlot() const
+        {
+            size_t slot = _free;
+
+            if (slot == Manual)
+            {
+                slot = _slots.size();
+                _slots.push_back(Slot());
+            }
+            else
+            {
+                _free = _slots[slot].next;
+            }
+
+            // one reference for the handle, one for the pending reply
+            _slots[slot].refs = 2;
+            _slots[slot].ready = false;
+
+            return slot;
+        }
+
+        void retainSlot(size_t slot) const
+        {
+            ++_slots[slot].refs;
+        }
+
+        void releaseSlot(size_t slot) const
+        {
+            Slot& s = _slots[slot];
+
+            if (--s.refs == 0)
+            {
+                s.reply = RedisResult<RedisReplyBase, CharT>();
+                s.error.clear();
+                s.next = _free;
+                _free = slot;
+            }
+        }
+
+        bool slotReady(size_t slot) const
+        {
+            return _slots[slot].ready;
+        }
+
+        RedisResult<RedisReplyBase, CharT> resolve(size_t slot) const
+        {
+            while (!_slots[slot].ready)
+            {
+                readNext();
+            }
+
+            if (!_slots[slot].error.empty())
+            {
+                throw RedisException(_slots[slot].error);
+            }
+
+            return _slots[slot].reply;
+        }
+
+        RedisDeferred<CharT> deferOutput(const char* data, size_t length) const
+        {
+            connect();
+
+            RedisDeferred<CharT> deferred(this, acquireSlot());
+            append(data, length, deferred._slot);
+
+            if (_autoPipeline != 0 && _pending.size() >= _autoPipeline)
+            {
+                sync();
+            }
+
+            return deferred;
+        }
+
+        template<class C, class A1>
+        void format(const A1& a1) const
+        {
+            BOOST_STATIC_ASSERT(C::Argc == 2);
+            _output.assign(C::prefix(), C::PrefixLength);
+            RedisProtocol::appendBulk(_output, a1, _scratch);
+        }
+
+        template<class C, class A1, class A2>
+        void format(const A1& a1, const A2& a2) const
+        {
+            BOOST_STATIC_ASSERT(C::Argc == 3);
+            _output.assign(C::prefix(), C::PrefixLength);
+            RedisProtocol::appendBulk(_output, a1, _scratch);
+            RedisProtocol::appendBulk(_output, a2, _scratch);
+        }
+
+        struct IgnoreReply
+        {
+            void operator()(const RedisResult<RedisReplyBase, CharT>&) const { }
+        };
+
+        template<class OutputIterator>
+        struct CopyReply
+        {
+            OutputIterator& out;
+
+            explicit CopyReply(OutputIterator& o)
+                : out(o) { }
+
+            void operator()(const RedisResult<RedisReplyBase, CharT>& reply) const
+            {
+                *out = reply;
+                ++out;
+            }
+        };
+
+        template<class C, class A1, class A2, class A3>
+        void format(const A1& a1, const A2& a2, const A3& a3) const
+        {
+            BOOST_STATIC_ASSERT(C::Argc == 4);
+            _output.assign(C::prefix(), C::PrefixLength);
+            RedisProtocol::appendBulk(_output, a1, _scratch);
+            RedisProtocol::appendBulk(_output, a2, _scratch);
+            RedisProtocol::appendBulk(_output, a3, _scratch);
+        }
+
+        static timeval toTimeval(boost::chrono::milliseconds timeout)
+        {
+            timeval tv;
+            tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+            tv.tv_usec = static_cast<suseconds_t>(timeout.count() % 1000 * 1000);
+            return tv;
+        }
+
+        // hiredis reports an expired socket timeout as EAGAIN before 1.0 and
+        // a connect timeout as ETIMEDOUT
+        static bool timedOut(const redisContext* c)
+        {
+#ifdef REDIS_ERR_TIMEOUT
+            if (c->err == REDIS_ERR_TIMEOUT)
+            {
+                return true;
+            }
+#endif
+            return c->err == REDIS_ERR_IO &&
+                (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT);
+        }
+
+        // Drops the connection and throws its error
+        void fail() const
+        {
+            const bool timeout = timedOut(_context);
+            const std::string what(_context->errstr);
+
+            disconnect();
+
+            if (timeout)
+            {
+                throw RedisTimeoutException(what);
+            }
+
+            throw RedisException(what);
+        }
+
+        void connect() const
+        {
+            if (_context == 0)
+            {
+                _context = (_connectTimeout.count() > 0) ?
+                    ::redisConnectWithTimeout(_host.c_str(), _port, toTimeval(_connectTimeout)) :
+                    ::redisConnect(_host.c_str(), _port);
+
+                if (_context->err)
+                {
+                    const bool timeout = timedOut(_context);
+                    const std::string what(_context->errstr);
+
+                    ::redisFree(_context);
+                    _context = 0;
+
+                    if (timeout)
+                    {
+                        throw RedisTimeoutException(what);
+                    }
+
+                    throw RedisException(what);
+                }
+
+                if (_timeout.count() > 0 &&
+                    ::redisSetTimeout(_context, toTimeval(_timeout)) != REDIS_OK)
+                {
+                    RedisException e(_context->errstr);
+
+                    ::redisFree(_context);
+                    _context = 0;
+
+                    throw e;
+                }
+
+                _context->reader->fn = functions();
+                _context->reader->privdata = &_arena;
 
-            return getString();
+#if HIREDIS_MAJOR >= 1
+                // push frames are read as replies and passed to the handler
+                ::redisSetPushCallback(_context, 0);
+
+                if (_protocol != 2)
+                {
+                    hello();
+                }
+#endif
+            }
         }
 
-        operator boost::int64_t() const
+#if HIREDIS_MAJOR >= 1
+        // Switches a new connection to the protocol version set
+        void hello() const
         {
-            checkError();
+            std::string command(resp::Hello::prefix(), resp::Hello::PrefixLength);
+            RedisProtocol::appendBulk(command, static_cast<boost::int64_t>(_protocol), _scratch);
 
-            if (T::get()->type != REDIS_REPLY_INTEGER)
+            ::redisAppendFormattedCommand(_context, command.data(), command.size());
+
+            RedisResult<RedisReplyBase, CharT> reply = readFrame();
+
+            if (reply.isError())
             {
-                throw std::runtime_error("Invalid reply type");
+                const std::string what(reply.get()->str, reply.get()->len);
+
+                disconnect();
+                throw RedisException(what);
             }
+        }
+#endif
 
-            return T::get()->integer;
+        redisReplyObjectFunctions* functions() const
+        {
+            return _lazy ? &RedisLazyArray::Functions : &RedisReplyArena::Functions;
         }
 
-        operator boost::optional<boost::int64_t>() const
+        void disconnect() const
         {
-            checkError();
+            ::redisFree(_context);
+            _context = 0;
 
-            if (
-                    T::get()->type != REDIS_REPLY_INTEGER &&
-                    T::get()->type != REDIS_REPLY_NIL)
+            for (size_t i = 0; i < _samples.size(); ++i)
             {
-                throw std::runtime_error("Invalid reply type");
+                RedisInstrument::complete(_samples[i], 0);
             }
 
-            if (isNil())
+            _samples.clear();
+
+            for (size_t i = 0; i < _pending.size(); ++i)
             {
-                return boost::optional<boost::int64_t>();
+                if (_pending[i] != Manual)
+                {
+                    Slot& s = _slots[_pending[i]];
+
+                    s.error = "Connection lost";
+                    s.ready = true;
+                    releaseSlot(_pending[i]);
+                }
             }
 
-            return boost::optional<boost::int64_t>(T::get()->integer);
-        }
+            _pending.clear();
+            _ahead = 0;
 
-        size_t size() const
-        {
-            checkError();
-            
-            if (T::get()->type != REDIS_REPLY_ARRAY)
+            if (_arena != 0)
             {
-                throw std::runtime_error("Invalid reply type");
+                RedisReplyArena::destroy(_arena);
+                _arena = 0;
             }
-
-            return T::get()->elements;
         }
 
-        RedisResult<RedisElementBase, CharT> operator[](size_t i) const
-        {
-            checkError();
+    public:
+        typedef RedisCommandBase<CharT> Command;
+        typedef RedisResult<RedisReplyBase, CharT> Reply;
+        typedef RedisResult<RedisElementBase, CharT> Element;
 
-            if (T::get()->type != REDIS_REPLY_ARRAY)
-            {
-                throw std::runtime_error("Invalid reply type");
-            }
+        // Commands in flight at most in doPipeline
+        static const size_t PipelineWindow = 1024;
 
-            if (i >= T::get()->elements)
+        RedisBase(const std::string& host, int port = 6379)
+            : _context(0), _arena(0), _lazy(false), _protocol(2), _host(host), _port(port),
+              _ahead(0), _free(Manual), _autoPipeline(0),
+              _connectTimeout(0), _timeout(0), _instrument(0)
+#if HIREDIS_MAJOR >= 1
+              , _pushHandler(0)
+#endif
+        { }
+
+        virtual ~RedisBase()
+        {
+            if (_context != 0)
             {
-                throw std::runtime_error("Out of range");
+                disconnect();
             }
-
-            return RedisResult<RedisElementBase, CharT>(T::get()->element[i]);
         }
 
-        template <class V>
-        void toValue(V& v)
-        {
-            v = boost::lexical_cast<V>((std::basic_string<CharT>)(*this));
-        }
+        const std::string& host() const { return _host; }
+        int port() const { return _port; }
 
-        template <class V>
-        void toVector(std::vector<V>& v)
+        // In lazy mode elements of array replies read from now on are parsed
+        // into a packed buffer and turned into reply objects on access only
+        void setLazyReplies(bool lazy)
         {
-            for (size_t i = 0; i < size(); ++i)
+            _lazy = lazy;
+
+            if (_context != 0)
             {
-                v.push_back(boost::lexical_cast<V>((std::basic_string<CharT>)(*this)[i]));
+                _context->reader->fn = functions();
             }
         }
-    };
 
-    class RedisReplyBase
-    {
-        redisReply* _r;
-        int* _refs;
+        bool lazyReplies() const { return _lazy; }
 
-        void addRef()
+        // Connecting taking longer throws RedisTimeoutException, 0 waits as
+        // long as the system does. Applies to the next connect.
+        void setConnectTimeout(boost::chrono::milliseconds timeout)
         {
-            ++(*_refs);
+            _connectTimeout = timeout;
         }
 
-        void release()
+        boost::chrono::milliseconds connectTimeout() const { return _connectTimeout; }
+
+        // Socket read or write blocking longer throws RedisTimeoutException
+        // and drops the connection, replies of commands in flight are lost.
+        // 0 for no limit.
+        void setTimeout(boost::chrono::milliseconds timeout)
         {
-            if (--(*_refs) == 0)
+            _timeout = timeout;
+
+            if (_context != 0)
             {
-                ::freeReplyObject(_r);
-                delete _refs;
+                // zero timeval clears the socket timeout
+                if (::redisSetTimeout(_context, toTimeval(timeout)) != REDIS_OK)
+                {
+                    fail();
+                }
             }
         }
 
-    public:
-        RedisReplyBase(redisReply* r)
-            : _r(r), _refs(new int(0))
-        {
-            addRef();
-        }
-
-        RedisReplyBase(const RedisReplyBase& from)
-            : _r(from._r), _refs(from._refs)
-        {
-            addRef();
-        }
+        boost::chrono::milliseconds timeout() const { return _timeout; }
 
-        RedisReplyBase& operator=(const RedisReplyBase& from)
+        // Commands sent from now on are reported to instrument, 0 to stop
+        void setInstrument(RedisInstrument* instrument)
         {
-            if (&from==this) {
-                return *this;
+            if (_instrument == 0 && instrument != 0)
+            {
+                // replies already expected are not reported
+                _samples.assign(_ahead + _pending.size(), RedisInstrument::Sample());
+            }
+            else if (instrument == 0)
+            {
+                _samples.clear();
             }
 
-            release();
-
-            _r = from._r;
-            _refs = from._refs;
-
-            addRef();
-
-            return *this;
+            _instrument = instrument;
         }
 
-        virtual ~RedisReplyBase()
-        {
-            release();
-
-            _r = 0;
-            _refs = 0;
-        }
+        RedisInstrument* instrument() const { return _instrument; }
 
-        redisReply* get() const
+#if HIREDIS_MAJOR >= 1
+        // Protocol negotiated with HELLO, 3 for RESP3 replies with maps,
+        // doubles and push frames. Applies to the next connect.
+        void setProtocol(int protocol)
         {
-            return _r;
+            _protocol = protocol;
         }
-    };
 
-    template<typename CharT>
-    class RedisCommandBase
-    {
-        std::vector<std::string> _parts;
+        int protocol() const { return _protocol; }
 
-        void addPart(const std::basic_string<CharT>& s)
+        // Push frames read from now on are passed to handler, 0 to drop them
+        void setPushHandler(RedisPushHandler<CharT>* handler)
         {
-            std::string data;
-            RedisEncoding<CharT>::encode(s, data);
-            _parts.push_back(data);
+            _pushHandler = handler;
         }
 
-        void addPart(const char* s)
-        {
-            std::string data(s, s + ::strlen(s));
-            _parts.push_back(data);
-        }
+        RedisPushHandler<CharT>* pushHandler() const { return _pushHandler; }
 
-    public:
-        RedisCommandBase() {}
+        // Attribute frame which came in front of the last reply read, empty
+        // handle when there was none
+        const Reply& attribute() const { return _attribute; }
+#endif
 
-        RedisCommandBase(const char* s)
+        typedef RedisDeferred<CharT> Deferred;
+
+        // Deferred commands are sent and their replies read once threshold
+        // of them is queued, with 0 only when one of the replies is accessed
+        void setAutoPipeline(size_t threshold)
         {
-            addPart(s);
+            _autoPipeline = threshold;
         }
 
-        RedisCommandBase(const std::basic_string<CharT>& s)
+        size_t autoPipeline() const { return _autoPipeline; }
+
+        // Replies of begin calls are returned in order, replies of deferred
+        // commands queued in between are read first
+        Reply endCommand() const
         {
-            addPart(s);
-        }
+            if (!_early.empty())
+            {
+                Reply reply = _early.front();
+                _early.pop_front();
 
-        RedisCommandBase(const std::vector<std::string>& parts)
-            : _parts(parts) { }
+                return reply;
+            }
 
-        RedisCommandBase(const RedisCommandBase<CharT>& from)
-            : _parts(from._parts) { }
+            if (_ahead > 0)
+            {
+                --_ahead;
+                return readReply();
+            }
 
-        const std::string& operator[](size_t i) const
-        {
-            return _parts[i];
+            while (!_pending.empty())
+            {
+                if (_pending.front() == Manual)
+                {
+                    Reply reply = readReply();
+                    _pending.pop_front();
+
+                    return reply;
+                }
+
+                readNext();
+            }
+
+            return readReply();
         }
 
-        size_t size() const
+        Deferred defer(const Command& command) const
         {
-            return _parts.size();
+            return deferOutput(command.data(), command.length());
         }
 
-        RedisCommandBase<CharT>& operator=(const std::vector<std::string>& parts)
+        template<class C>
+        Deferred defer() const
         {
-            _parts = parts;
-            return *this;
+            BOOST_STATIC_ASSERT(C::Argc == 1);
+            return deferOutput(C::prefix(), C::PrefixLength);
         }
 
-        RedisCommandBase<CharT>& operator=(const RedisCommandBase<CharT>& from)
+        template<class C, class A1>
+        Deferred defer(const A1& a1) const
         {
-            _parts = from._parts;
-            return *this;
+            format<C>(a1);
+            return deferOutput(_output.data(), _output.size());
         }
 
-        RedisCommandBase<CharT>& operator<<(const std::basic_string<CharT>& s)
+        template<class C, class A1, class A2>
+        Deferred defer(const A1& a1, const A2& a2) const
         {
-            addPart(s);
-            return *this;
+            format<C>(a1, a2);
+            return deferOutput(_output.data(), _output.size());
         }
 
-        RedisCommandBase<CharT>& operator<<(const char* s)
+        template<class C, class A1, class A2, class A3>
+        Deferred defer(const A1& a1, const A2& a2, const A3& a3) const
         {
-            addPart(s);
-            return *this;
+            format<C>(a1, a2, a3);
+            return deferOutput(_output.data(), _output.size());
         }
 
-        RedisCommandBase<CharT>& operator<<(const std::vector<std::basic_string<CharT> >& ss)
+        // Reads replies of all queued deferred commands
+        void sync() const
         {
-            _parts.reserve(_parts.size() + ss.size());
-
-            for (size_t i = 0; i < ss.size(); ++i)
+            while (!_pending.empty())
             {
-                addPart(ss[i]);
+                readNext();
             }
-
-            return *this;
         }
 
-        template<class T> RedisCommandBase<CharT>& operator<<(const T& v)
+        // True while replies of commands sent are still to be read or
+        // returned by endCommand, the connection is then out of step for
+        // other users
+        bool expectsReplies() const
         {
-            addPart(boost::lexical_cast<std::basic_string<CharT> >(v));
-            return *this;
+            return _ahead > 0 || !_pending.empty() || !_early.empty();
         }
-    };
-
-    template<typename CharT>
-    class RedisBase : public RedisConst<CharT>
-    {
-        mutable redisContext* _context;
-
-        std::string _host;
-        int _port;
-
-        RedisBase(const RedisBase<CharT>&);
-        RedisBase<CharT>& operator=(const RedisBase<CharT>&);
 
-        void connect() const
+        // Writes commands appended by begin calls without waiting for their
+        // replies, so that several connections may work on them in parallel
+        void flush() const
         {
             if (_context == 0)
             {
-                _context = ::redisConnect(_host.c_str(), _port);
-
-                if (_context->err)
-                {
-                    RedisException e(_context->errstr);
-
-                    ::redisFree(_context);
-                    _context = 0;
-
-                    throw e;
-                }
-            }
-        }
-
-    public:
-        typedef RedisCommandBase<CharT> Command;
-        typedef RedisResult<RedisReplyBase, CharT> Reply;
-        typedef RedisResult<RedisElementBase, CharT> Element;
-
-        RedisBase(const std::string& host, int port = 6379)
-            : _context(0), _host(host), _port(port) { }
-
-        virtual ~RedisBase()
-        {
-            if (_context != 0)
-            {
-                ::redisFree(_context);
-
-                _context = 0;
+                return;
             }
-        }
-
-        const std::string& host() const { return _host; }
-        int port() const { return _port; }
 
-        Reply endCommand() const
-        {
-            redisReply* r;
+            int done = 0;
 
-            if (::redisGetReply(_context, reinterpret_cast<void**>(&r)) != REDIS_OK)
+            while (!done)
             {
-                RedisException e(_context->errstr);
-
-                ::redisFree(_context);
-                _context = 0;
-
-                throw e;
+                if (::redisBufferWrite(_context, &done) != REDIS_OK)
+                {
+                    fail();
+                }
             }
-
-            return Reply(r);
         }
 
         void beginInfo() const
         {
             connect();
 
-            ::redisAppendCommand(_context, "INFO");
+            beginCommand<resp::Info>();
         }
 
+        // Lines are split in the reply buffer, only keys and values are
+        // decoded. RESP3 servers send the text as a verbatim string.
         std::map<std::basic_string<CharT>, std::basic_string<CharT> > info() const
         {
             beginInfo();
 
             std::map<std::basic_string<CharT>, std::basic_string<CharT> > info;
-            std::basic_string<CharT> lines = endCommand();
+            Reply reply = endCommand();
+            boost::string_view lines = reply.view();
 
-            size_t i = 0;
-            size_t j = lines.find(RedisConst<CharT>::InfoCrLf);
-
-            while (i != std::basic_string<CharT>::npos)
+            while (!lines.empty())
             {
-                std::basic_string<CharT> line = lines.substr(i, j == std::basic_string<CharT>::npos ? j : j - i);
-                i = j == std::basic_string<CharT>::npos ? j : j + RedisConst<CharT>::InfoCrLf.size();
-                j = lines.find(RedisConst<CharT>::InfoCrLf, i);
+                const size_t eol = lines.find("\r\n");
+                const boost::string_view line = lines.substr(0, eol);
+
+                lines = (eol == boost::string_view::npos) ? boost::string_view() : lines.substr(eol + 2);
 
-                size_t p = line.find(RedisConst<CharT>::InfoSeparator);
-                
-                if (p != std::basic_string<CharT>::npos &&
-                    p < (line.size() - 1))
+                const size_t p = line.find(':');
+
+                if (p != boost::string_view::npos && p + 1 < line.size())
                 {
-                    info[line.substr(0, p)] = line.substr(p + 1, std::basic_string<CharT>::npos);
+                    std::basic_string<CharT> key;
+                    RedisEncoding<CharT>::decode(line.data(), p, key);
+                    RedisEncoding<CharT>::decode(line.data() + p + 1, line.size() - p - 1, info[key]);
                 }
             }
 
@@ -494,7 +2188,7 @@ namespace hiredispp
         {
             connect();
 
-            ::redisAppendCommand(_context, "PING");
+            beginCommand<resp::Ping>();
         }
 
         std::basic_string<CharT> ping() const
@@ -507,7 +2201,7 @@ namespace hiredispp
         {
             connect();
 
-            ::redisAppendCommand(_context, "SELECT %d", database);
+            beginCommand<resp::Select>(static_cast<boost::int64_t>(database));
         }
 
         void select(int database) const
@@ -519,7 +2213,7 @@ namespace hiredispp
         void beginGet(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("GET") << key);
+            beginCommand<resp::Get>(key);
         }
 
         std::basic_string<CharT> get(const std::basic_string<CharT>& key) const
@@ -543,7 +2237,7 @@ namespace hiredispp
         void beginExists(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("EXISTS") << key);
+            beginCommand<resp::Exists>(key);
         }
 
         bool exists(const std::basic_string<CharT>& key) const
@@ -555,7 +2249,7 @@ namespace hiredispp
         void beginSet(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
         {
             connect();
-            beginCommand(Command("SET") << key << value);
+            beginCommand<resp::Set>(key, value);
         }
 
         void set(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
@@ -567,7 +2261,7 @@ namespace hiredispp
         void beginSetnx(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
         {
             connect();
-            beginCommand(Command("SETNX") << key << value);
+            beginCommand<resp::Setnx>(key, value);
         }
 
         boost::int64_t setnx(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
@@ -579,7 +2273,7 @@ namespace hiredispp
         void beginIncr(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("INCR") << key);
+            beginCommand<resp::Incr>(key);
         }
 
         boost::int64_t incr(const std::basic_string<CharT>& key) const
@@ -591,7 +2285,7 @@ namespace hiredispp
         void beginKeys(const std::basic_string<CharT>& pattern) const
         {
             connect();
-            beginCommand(Command("KEYS") << pattern);
+            beginCommand<resp::Keys>(pattern);
         }
 
         Reply keys(const std::basic_string<CharT>& pattern) const
@@ -603,7 +2297,7 @@ namespace hiredispp
         void beginDel(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("DEL") << key);
+            beginCommand<resp::Del>(key);
         }
 
         boost::int64_t del(const std::basic_string<CharT>& key) const
@@ -627,7 +2321,7 @@ namespace hiredispp
         void beginLpush(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
         {
             connect();
-            beginCommand(Command("LPUSH") << key << value);
+            beginCommand<resp::Lpush>(key, value);
         }
 
         void lpush(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
@@ -639,7 +2333,7 @@ namespace hiredispp
         void beginLpop(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("LPOP") << key);
+            beginCommand<resp::Lpop>(key);
         }
 
         std::basic_string<CharT> lpop(const std::basic_string<CharT>& key) const
@@ -651,7 +2345,7 @@ namespace hiredispp
         void beginRpush(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
         {
             connect();
-            beginCommand(Command("RPUSH") << key << value);
+            beginCommand<resp::Rpush>(key, value);
         }
 
         void rpush(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
@@ -663,7 +2357,7 @@ namespace hiredispp
         void beginRpop(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("RPOP") << key);
+            beginCommand<resp::Rpop>(key);
         }
 
         std::basic_string<CharT> rpop(const std::basic_string<CharT>& key) const
@@ -675,7 +2369,7 @@ namespace hiredispp
         void beginLindex(const std::basic_string<CharT>& key, boost::int64_t index) const
         {
             connect();
-            beginCommand(Command("LINDEX") << key << index);
+            beginCommand<resp::Lindex>(key, index);
         }
 
         std::basic_string<CharT> lindex(const std::basic_string<CharT>& key, boost::int64_t index) const
@@ -687,7 +2381,7 @@ namespace hiredispp
         void beginLrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
         {
             connect();
-            beginCommand(Command("LRANGE") << key << start << end);
+            beginCommand<resp::Lrange>(key, start, end);
         }
 
         Reply lrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
@@ -699,7 +2393,7 @@ namespace hiredispp
         void beginLlen(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("LLEN") << key);
+            beginCommand<resp::Llen>(key);
         }
 
         boost::int64_t llen(const std::basic_string<CharT>& key) const
@@ -712,7 +2406,7 @@ namespace hiredispp
         void beginHget(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field) const
         {
             connect();
-            beginCommand(Command("HGET") << key << field);
+            beginCommand<resp::Hget>(key, field);
         }
 
         std::basic_string<CharT> hget(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field) const
@@ -724,7 +2418,7 @@ namespace hiredispp
         void beginHdel(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field) const
         {
             connect();
-            beginCommand(Command("HDEL") << key << field);
+            beginCommand<resp::Hdel>(key, field);
         }
 
         boost::int64_t hdel(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field) const
@@ -736,7 +2430,7 @@ namespace hiredispp
         void beginHset(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, const std::basic_string<CharT>& value) const
         {
             connect();
-            beginCommand(Command("HSET") << key << field << value);
+            beginCommand<resp::Hset>(key, field, value);
         }
 
         boost::int64_t hset(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, const std::basic_string<CharT>& value) const
@@ -748,7 +2442,7 @@ namespace hiredispp
         void beginHsetnx(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, const std::basic_string<CharT>& value) const
         {
             connect();
-            beginCommand(Command("HSETNX") << key << field << value);
+            beginCommand<resp::Hsetnx>(key, field, value);
         }
 
         boost::int64_t hsetnx(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, const std::basic_string<CharT>& value) const
@@ -760,7 +2454,7 @@ namespace hiredispp
         void beginHincrby(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, boost::int64_t value) const
         {
             connect();
-            beginCommand(Command("HINCRBY") << key << field << value);
+            beginCommand<resp::Hincrby>(key, field, value);
         }
 
         boost::int64_t hincrby(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, boost::int64_t value) const
@@ -772,7 +2466,7 @@ namespace hiredispp
         void beginHgetall(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("HGETALL") << key);
+            beginCommand<resp::Hgetall>(key);
         }
 
         Reply hgetall(const std::basic_string<CharT>& key) const
@@ -784,7 +2478,7 @@ namespace hiredispp
         void beginSadd(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
         {
             connect();
-            beginCommand(Command("SADD") << key << member);
+            beginCommand<resp::Sadd>(key, member);
         }
 
         boost::int64_t sadd(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
@@ -796,7 +2490,7 @@ namespace hiredispp
         void beginSismember(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
         {
             connect();
-            beginCommand(Command("SISMEMBER") << key << member);
+            beginCommand<resp::Sismember>(key, member);
         }
 
         bool sismember(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
@@ -808,7 +2502,7 @@ namespace hiredispp
         void beginSrem(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
         {
             connect();
-            beginCommand(Command("SREM") << key << member);
+            beginCommand<resp::Srem>(key, member);
         }
 
         boost::int64_t srem(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
@@ -820,7 +2514,7 @@ namespace hiredispp
         void beginSmembers(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("SMEMBERS") << key);
+            beginCommand<resp::Smembers>(key);
         }
 
         Reply smembers(const std::basic_string<CharT>& key) const
@@ -844,7 +2538,7 @@ namespace hiredispp
         void beginSdiff(const std::basic_string<CharT>& key, const std::basic_string<CharT>& diffKey) const
         {
             connect();
-            beginCommand(Command("SDIFF") << key << diffKey);
+            beginCommand<resp::Sdiff>(key, diffKey);
         }
 
         Reply sdiff(const std::basic_string<CharT>& key, const std::basic_string<CharT>& diffKey) const
@@ -856,7 +2550,7 @@ namespace hiredispp
         void beginSunion(const std::vector<std::basic_string<CharT> >& keys) const
         {
             connect();
-            beginCommand(Command("SUINION") << keys);
+            beginCommand(Command("SUNION") << keys);
         }
 
         Reply sunion(const std::vector<std::basic_string<CharT> >& keys) const
@@ -868,7 +2562,7 @@ namespace hiredispp
         void beginSunion(const std::basic_string<CharT>& key0, const std::basic_string<CharT>& key1) const
         {
             connect();
-            beginCommand(Command("SUNION") << key0 << key1);
+            beginCommand<resp::Sunion>(key0, key1);
         }
 
         Reply sunion(const std::basic_string<CharT>& key0, const std::basic_string<CharT>& key1) const
@@ -880,7 +2574,7 @@ namespace hiredispp
         void beginScard(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("SCARD") << key);
+            beginCommand<resp::Scard>(key);
         }
 
         boost::int64_t scard(const std::basic_string<CharT>& key) const
@@ -892,7 +2586,7 @@ namespace hiredispp
         void beginZadd(const std::basic_string<CharT>& key, double score, const std::basic_string<CharT>& member) const
         {
             connect();
-            beginCommand(Command("ZADD") << key << score << member);
+            beginCommand<resp::Zadd>(key, score, member);
         }
 
         boost::int64_t zadd(const std::basic_string<CharT>& key, double score, const std::basic_string<CharT>& member) const
@@ -904,7 +2598,7 @@ namespace hiredispp
         void beginZrem(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
         {
             connect();
-            beginCommand(Command("ZREM") << key << member);
+            beginCommand<resp::Zrem>(key, member);
         }
 
         boost::int64_t zrem(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
@@ -916,7 +2610,7 @@ namespace hiredispp
         void beginZrank(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
         {
             connect();
-            beginCommand(Command("ZRANK") << key << member);
+            beginCommand<resp::Zrank>(key, member);
         }
 
         boost::optional<boost::int64_t> zrank(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
@@ -928,7 +2622,7 @@ namespace hiredispp
         void beginZrevrank(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
         {
             connect();
-            beginCommand(Command("ZREVRANK") << key << member);
+            beginCommand<resp::Zrevrank>(key, member);
         }
 
         boost::optional<boost::int64_t> zrevrank(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
@@ -940,7 +2634,7 @@ namespace hiredispp
         void beginZrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
         {
             connect();
-            beginCommand(Command("ZRANGE") << key << start << end);
+            beginCommand<resp::Zrange>(key, start, end);
         }
 
         Reply zrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
@@ -952,7 +2646,7 @@ namespace hiredispp
         void beginZrevrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
         {
             connect();
-            beginCommand(Command("ZREVRANGE") << key << start << end);
+            beginCommand<resp::Zrevrange>(key, start, end);
         }
 
         Reply zrevrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
@@ -964,7 +2658,7 @@ namespace hiredispp
         void beginZrangebyscore(const std::basic_string<CharT>& key,const std::basic_string<CharT>& min, const std::basic_string<CharT>& max) const
         {
             connect();
-            beginCommand(Command("ZRANGEBYSCORE") << key << min << max);
+            beginCommand<resp::Zrangebyscore>(key, min, max);
         }
 
         Reply zrangebyscore(const std::basic_string<CharT>& key, const std::basic_string<CharT>& min, const std::basic_string<CharT>& max) const
@@ -976,7 +2670,7 @@ namespace hiredispp
         void beginZrevrangebyscore(const std::basic_string<CharT>& key, const std::basic_string<CharT>& max, const std::basic_string<CharT>& min) const
         {
             connect();
-            beginCommand(Command("ZREVRANGEBYSCORE") << key << max << min);
+            beginCommand<resp::Zrevrangebyscore>(key, max, min);
         }
 
         Reply zrevrangebyscore(const std::basic_string<CharT>& key, const std::basic_string<CharT>& max, const std::basic_string<CharT>& min) const
@@ -988,29 +2682,46 @@ namespace hiredispp
         void beginZcard(const std::basic_string<CharT>& key) const
         {
             connect();
-            beginCommand(Command("ZCARD") << key);
+            beginCommand<resp::Zcard>(key);
         }
 
         boost::int64_t zcard(const std::basic_string<CharT>& key) const
         {
-            beginZcard()(key);
+            beginZcard(key);
             return endCommand();
         }
 
         void beginCommand(const Command& command) const
         {
-            connect();
+            append(command.data(), command.length(), Manual);
+        }
 
-            const char* argv[command.size()];
-            size_t argvlen[command.size()];
+        template<class C>
+        void beginCommand() const
+        {
+            BOOST_STATIC_ASSERT(C::Argc == 1);
+            append(C::prefix(), C::PrefixLength, Manual);
+        }
 
-            for (size_t i = 0; i < command.size(); ++i)
-            {
-                argv[i] = command[i].data();
-                argvlen[i] = command[i].size();
-            }
+        template<class C, class A1>
+        void beginCommand(const A1& a1) const
+        {
+            format<C>(a1);
+            appendOutput();
+        }
+
+        template<class C, class A1, class A2>
+        void beginCommand(const A1& a1, const A2& a2) const
+        {
+            format<C>(a1, a2);
+            appendOutput();
+        }
 
-            ::redisAppendCommandArgv(_context, command.size(), argv, argvlen);
+        template<class C, class A1, class A2, class A3>
+        void beginCommand(const A1& a1, const A2& a2, const A3& a3) const
+        {
+            format<C>(a1, a2, a3);
+            appendOutput();
         }
 
         Reply doCommand(const Command& command) const
@@ -1021,32 +2732,75 @@ namespace hiredispp
 
         void doPipeline(const std::vector<Command>& commands) const
         {
-            for (size_t i = 0; i < commands.size(); ++i)
-            {
-                beginCommand(commands[i]);
-            }
-
-            for (size_t i = 0; i < commands.size(); ++i)
-            {
-                endCommand();
-            }
+            streamPipeline(commands.begin(), commands.end(), PipelineWindow, IgnoreReply());
         }
 
         void doPipeline(const std::vector<Command>& commands, std::vector<Reply>& replies) const
         {
-            for (size_t i = 0; i < commands.size(); ++i)
-            {
-                beginCommand(commands[i]);
-            }
+            replies.reserve(replies.size() + commands.size());
+            streamPipelineTo(commands.begin(), commands.end(), PipelineWindow, std::back_inserter(replies));
+        }
+
+        // Sends commands of [first, last) keeping at most window of them
+        // unanswered and passes replies to handler(reply) in order as they
+        // arrive. Window is refilled by half of it at once, the refill is
+        // written while replies already received are handled.
+        template<class InputIterator, class Handler>
+        void streamPipeline(InputIterator first, InputIterator last, size_t window, Handler handler) const
+        {
+            window = std::max<size_t>(window, 1);
 
-            replies.reserve(commands.size());
+            const size_t refill = std::max<size_t>(window / 2, 1);
+            size_t inFlight = 0;
 
-            for (size_t i = 0; i < commands.size(); ++i)
+            try
             {
-                replies.push_back(endCommand());
+                while (first != last || inFlight > 0)
+                {
+                    if (first != last && inFlight + refill <= window)
+                    {
+                        while (first != last && inFlight < window)
+                        {
+                            beginCommand(*first);
+                            ++first;
+                            ++inFlight;
+                        }
+
+                        flush();
+                    }
+
+                    Reply reply = endCommand();
+                    --inFlight;
+
+                    handler(reply);
+                }
+            }
+            catch (...)
+            {
+                // keeps the connection usable when handler throws
+                try
+                {
+                    while (_context != 0 && inFlight > 0)
+                    {
+                        endCommand();
+                        --inFlight;
+                    }
+                }
+                catch (const RedisException&)
+                {
+                }
+
+                throw;
             }
         }
 
+        template<class InputIterator, class OutputIterator>
+        OutputIterator streamPipelineTo(InputIterator first, InputIterator last, size_t window, OutputIterator out) const
+        {
+            streamPipeline(first, last, window, CopyReply<OutputIterator>(out));
+            return out;
+        }
+
         void beginWatch(const std::vector<std::basic_string<CharT> >& keys) const
         {
             beginCommand(Command("WATCH") << keys);
@@ -1067,7 +2821,7 @@ namespace hiredispp
 
         void beginUnwatch() const
         {
-            beginCommand(Command("UNWATCH"));
+            beginCommand<resp::Unwatch>();
         }
 
         void unwatch() const
@@ -1078,14 +2832,14 @@ namespace hiredispp
 
         Reply doTransaction(const std::vector<Command>& commands) const
         {
-            beginCommand(Command("MULTI"));
+            beginCommand<resp::Multi>();
 
             for (size_t i = 0; i < commands.size(); ++i)
             {
                 beginCommand(commands[i]);
             }
 
-            beginCommand(Command("EXEC"));
+            beginCommand<resp::Exec>();
             endCommand();
 
             for (size_t i = 0; i < commands.size(); ++i)
@@ -1097,6 +2851,12 @@ namespace hiredispp
         }
     };
 
+    template<typename CharT>
+    const size_t RedisBase<CharT>::Manual;
+
+    template<typename CharT>
+    const size_t RedisBase<CharT>::PipelineWindow;
+
     typedef RedisBase<char> Redis;
     typedef RedisBase<wchar_t> wRedis;
 
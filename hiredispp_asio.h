@@ -0,0 +1,267 @@
+/*
+ * hiredispp_asio.h
+ */
+
+#ifndef HIREDISPP_ASIO_H
+#define HIREDISPP_ASIO_H
+
+#include "hiredispp.h"
+#include "hiredispp_async.h"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/placeholders.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace hiredispp
+{
+    // Runs connections on a boost::asio io_context. Connections attached to
+    // the loop must be used from the thread running the io_context, the
+    // io_context must outlive them.
+    class RedisAsioLoop : public RedisEventLoop, boost::noncopyable
+    {
+        typedef boost::asio::posix::stream_descriptor Descriptor;
+
+        struct Events
+        {
+            redisAsyncContext* context;
+            Descriptor descriptor;
+            bool reading;
+            bool writing;
+
+            // a wait in flight holds on to the events, they are deleted
+            // when the context is gone and no wait is in flight
+            bool readPending;
+            bool writePending;
+
+            Events(boost::asio::io_context& io, redisAsyncContext* ac)
+                : context(ac), descriptor(io, ac->c.fd),
+                  reading(false), writing(false),
+                  readPending(false), writePending(false) { }
+        };
+
+        // State is shared with the wait in flight, stop or restart bumps the
+        // generation so a wait completing late does nothing
+        class Timer : public RedisTimer
+        {
+            struct State
+            {
+                boost::asio::steady_timer timer;
+                void (*expired)(void*);
+                void* data;
+                unsigned generation;
+
+                State(boost::asio::io_context& io, void (*fn)(void*), void* d)
+                    : timer(io), expired(fn), data(d), generation(0) { }
+            };
+
+            boost::shared_ptr<State> _state;
+
+            static void onTimer(const boost::shared_ptr<State>& state, unsigned generation,
+                                const boost::system::error_code& error)
+            {
+                if (!error && state->expired && state->generation == generation)
+                {
+                    state->expired(state->data);
+                }
+            }
+
+        public:
+            Timer(boost::asio::io_context& io, void (*fn)(void*), void* data)
+                : _state(new State(io, fn, data)) { }
+
+            ~Timer()
+            {
+                _state->expired = NULL;
+                stop();
+            }
+
+            virtual void start(boost::chrono::milliseconds delay)
+            {
+                const unsigned generation = ++_state->generation;
+
+                _state->timer.expires_after(boost::asio::chrono::milliseconds(delay.count()));
+                _state->timer.async_wait(boost::bind(&Timer::onTimer, _state, generation,
+                                                     boost::asio::placeholders::error));
+            }
+
+            virtual void stop()
+            {
+                boost::system::error_code ignored;
+
+                ++_state->generation;
+                _state->timer.cancel(ignored);
+            }
+        };
+
+        boost::asio::io_context& _io;
+
+        static void release(Events* e)
+        {
+            if (e->context == NULL && !e->readPending && !e->writePending)
+            {
+                delete e;
+            }
+        }
+
+        static void waitRead(Events* e)
+        {
+            if (e->reading && !e->readPending)
+            {
+                e->readPending = true;
+                e->descriptor.async_wait(Descriptor::wait_read,
+                                         boost::bind(&RedisAsioLoop::onRead, e,
+                                                     boost::asio::placeholders::error));
+            }
+        }
+
+        static void waitWrite(Events* e)
+        {
+            if (e->writing && !e->writePending)
+            {
+                e->writePending = true;
+                e->descriptor.async_wait(Descriptor::wait_write,
+                                         boost::bind(&RedisAsioLoop::onWrite, e,
+                                                     boost::asio::placeholders::error));
+            }
+        }
+
+        // readiness is level triggered for hiredis, the wait is renewed
+        // until the event is deleted
+        static void onRead(Events* e, const boost::system::error_code& error)
+        {
+            if (e->context && e->reading && error != boost::asio::error::operation_aborted)
+            {
+                redisAsyncHandleRead(e->context);
+            }
+
+            e->readPending = false;
+
+            if (e->context == NULL)
+            {
+                release(e);
+                return;
+            }
+
+            waitRead(e);
+        }
+
+        static void onWrite(Events* e, const boost::system::error_code& error)
+        {
+            if (e->context && e->writing && error != boost::asio::error::operation_aborted)
+            {
+                redisAsyncHandleWrite(e->context);
+            }
+
+            e->writePending = false;
+
+            if (e->context == NULL)
+            {
+                release(e);
+                return;
+            }
+
+            waitWrite(e);
+        }
+
+        static void addRead(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            e->reading = true;
+            waitRead(e);
+        }
+
+        static void delRead(void* privdata)
+        {
+            static_cast<Events*>(privdata)->reading = false;
+        }
+
+        static void addWrite(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            e->writing = true;
+            waitWrite(e);
+        }
+
+        static void delWrite(void* privdata)
+        {
+            static_cast<Events*>(privdata)->writing = false;
+        }
+
+        static void cleanup(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            boost::system::error_code ignored;
+
+            e->context = NULL;
+            e->reading = false;
+            e->writing = false;
+
+            // descriptor is closed by hiredis
+            e->descriptor.cancel(ignored);
+            e->descriptor.release();
+
+            release(e);
+        }
+
+    public:
+        explicit RedisAsioLoop(boost::asio::io_context& io)
+            : _io(io) { }
+
+        virtual bool attach(redisAsyncContext* ac)
+        {
+            if (ac->ev.data != NULL)
+            {
+                return false;
+            }
+
+            Events* e;
+
+            try
+            {
+                e = new Events(_io, ac);
+            }
+            catch (const boost::system::system_error&)
+            {
+                return false;
+            }
+
+            ac->ev.addRead = addRead;
+            ac->ev.delRead = delRead;
+            ac->ev.addWrite = addWrite;
+            ac->ev.delWrite = delWrite;
+            ac->ev.cleanup = cleanup;
+            ac->ev.data = e;
+
+            return true;
+        }
+
+        virtual RedisTimer* createTimer(void (*expired)(void*), void* data)
+        {
+            return new Timer(_io, expired, data);
+        }
+
+        boost::asio::io_context& context() const { return _io; }
+    };
+
+    // Runs completions of commands submitted from other threads on the
+    // io_context
+    class RedisAsioExecutor : public RedisExecutor
+    {
+        boost::asio::io_context& _io;
+
+    public:
+        explicit RedisAsioExecutor(boost::asio::io_context& io)
+            : _io(io) { }
+
+        virtual void post(RedisTask* task)
+        {
+            boost::asio::post(_io, boost::bind(&RedisTask::run, task));
+        }
+    };
+}
+
+#endif // HIREDISPP_ASIO_H
@@ -1,62 +1,566 @@
 #ifndef _HiredisppAsync_H_
 #define _HiredisppAsync_H_
 
+#include <hiredis/async.h>
+#ifndef HIREDISPP_NO_LIBEV
 #include <hiredis/adapters/libev.h>
+#endif
+#include <strings.h>
 #include <memory>
+#include <new>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/chrono/duration.hpp>
+#include <boost/chrono/system_clocks.hpp>
 #include <boost/function.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
-
-#define HIREDISPP_DEBUG
+#include <boost/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
 
 namespace hiredispp
 {
+    // One shot timer of an event loop, expires on the loop thread
+    class RedisTimer
+    {
+    public:
+        virtual ~RedisTimer() {}
+
+        // Arms the timer, timer already armed is rescheduled
+        virtual void start(boost::chrono::milliseconds delay) = 0;
+        virtual void stop() = 0;
+    };
+
+    // Event loop driving async connections, a connection hands its hiredis
+    // context to attach() which installs the read/write event callbacks
+    class RedisEventLoop
+    {
+    public:
+        virtual ~RedisEventLoop() {}
+
+        // false when the context can't be attached, e.g. already attached
+        virtual bool attach(redisAsyncContext* ac) = 0;
+
+        // Timer calling expired(data), owned by the caller
+        virtual RedisTimer* createTimer(void (*expired)(void*), void* data) = 0;
+    };
+
+#ifndef HIREDISPP_NO_LIBEV
+    // Any libev loop, the process wide EV_DEFAULT loop by default
+    class RedisLibevLoop : public RedisEventLoop
+    {
+    public:
+        explicit RedisLibevLoop(struct ev_loop* loop = EV_DEFAULT)
+            : _loop(loop)
+        {}
+
+        virtual bool attach(redisAsyncContext* ac)
+        {
+            return redisLibevAttach(_loop, ac) == REDIS_OK;
+        }
+
+        virtual RedisTimer* createTimer(void (*expired)(void*), void* data)
+        {
+            return new Timer(_loop, expired, data);
+        }
+
+        struct ev_loop* loop() const { return _loop; }
+
+        static RedisLibevLoop& defaultLoop()
+        {
+            static RedisLibevLoop loop;
+            return loop;
+        }
+
+    private:
+        class Timer : public RedisTimer
+        {
+            struct ev_loop* _loop;
+            ev_timer _timer;
+            void (*_expired)(void*);
+            void* _data;
+
+            static void expired(struct ev_loop*, ev_timer* w, int)
+            {
+                Timer* t = static_cast<Timer*>(w->data);
+                t->_expired(t->_data);
+            }
+
+        public:
+            Timer(struct ev_loop* loop, void (*fn)(void*), void* data)
+                : _loop(loop), _expired(fn), _data(data)
+            {
+                ev_timer_init(&_timer, expired, 0., 0.);
+                _timer.data = this;
+            }
+
+            ~Timer()
+            {
+                stop();
+            }
+
+            virtual void start(boost::chrono::milliseconds delay)
+            {
+                ev_timer_stop(_loop, &_timer);
+                ev_timer_set(&_timer, delay.count() / 1000., 0.);
+                ev_timer_start(_loop, &_timer);
+            }
+
+            virtual void stop()
+            {
+                ev_timer_stop(_loop, &_timer);
+            }
+        };
+
+        struct ev_loop* _loop;
+    };
+#endif
+
+    struct RedisReconnectPolicy
+    {
+        // Reconnect after connection errors, off by default
+        bool enabled;
+
+        // Delay before reconnect attempt n is picked at random between half
+        // and all of min(initialDelay * 2^n, maxDelay)
+        boost::chrono::milliseconds initialDelay;
+        boost::chrono::milliseconds maxDelay;
+
+        // Commands kept while disconnected, further commands fail at once
+        size_t maxQueued;
+
+        RedisReconnectPolicy()
+            : enabled(false), initialDelay(100), maxDelay(10000), maxQueued(1024) {}
+    };
+
+    struct RedisFlowControl
+    {
+        // Commands sent or queued and not completed yet, 0 for no limit
+        size_t maxInFlight;
+
+        // Bytes of those commands, 0 for no limit
+        size_t maxOutputBytes;
+
+        RedisFlowControl()
+            : maxInFlight(0), maxOutputBytes(0) {}
+    };
+
+    // Work item handed between threads, run() completes it and disposes of
+    // it. Link is used by the queue currently holding the task.
+    class RedisTask
+    {
+    public:
+        boost::atomic<RedisTask*> next;
+
+        RedisTask() : next(NULL) {}
+
+        virtual void run() = 0;
+
+    protected:
+        virtual ~RedisTask() {}
+    };
+
+    // Runs completions of commands submitted from other threads
+    class RedisExecutor
+    {
+    public:
+        virtual ~RedisExecutor() {}
+
+        // Called from I/O threads, task->run() is called by the executor
+        virtual void post(RedisTask* task) = 0;
+    };
+
     class RedisConnectionAsync
     {
     public:
+        // Completion handlers up to this size are stored without allocation
+        static const size_t HandlerSize = 96;
+
+        // Granularity of command deadlines
+        static boost::chrono::milliseconds deadlineResolution()
+        {
+            return boost::chrono::milliseconds(10);
+        }
+
+#ifndef HIREDISPP_NO_LIBEV
         RedisConnectionAsync(const std::string& host, int port)
-            : _ac(NULL), _host(host), _port(port), _reconnect(false)
+            : _ac(NULL), _host(host), _port(port), _connected(false), _closing(false),
+              _loop(&RedisLibevLoop::defaultLoop()), _free(NULL),
+              _queueHead(NULL), _queueTail(NULL), _queued(0), _attempt(0),
+              _random(static_cast<boost::uint32_t>(reinterpret_cast<size_t>(this))),
+              _inFlight(0), _inFlightBytes(0), _throttled(false),
+              _commandTimeout(0), _wheelEpoch(Clock::now()), _wheelTick(0),
+              _deadlines(0), _expiring(NULL), _timedOut(false), _instrument(NULL)
+        {}
+#endif
+
+        // The loop must outlive the connection, commands are executed and
+        // completed on the thread running the loop
+        RedisConnectionAsync(const std::string& host, int port, RedisEventLoop& loop)
+            : _ac(NULL), _host(host), _port(port), _connected(false), _closing(false),
+              _loop(&loop), _free(NULL),
+              _queueHead(NULL), _queueTail(NULL), _queued(0), _attempt(0),
+              _random(static_cast<boost::uint32_t>(reinterpret_cast<size_t>(this))),
+              _inFlight(0), _inFlightBytes(0), _throttled(false),
+              _commandTimeout(0), _wheelEpoch(Clock::now()), _wheelTick(0),
+              _deadlines(0), _expiring(NULL), _timedOut(false), _instrument(NULL)
         {}
 
+        // Commands still pending are completed through handler blocks owned
+        // by the connection, it must outlive the async context
+        ~RedisConnectionAsync()
+        {
+            _closing=true;
+            _timer.reset();
+            failQueue();
+
+            for (size_t i = 0; i < _chunks.size(); ++i) {
+                delete[] _chunks[i];
+            }
+        }
+
+        // With reconnect enabled, commands given while not connected are
+        // queued and sent once connected; commands in flight when the
+        // connection breaks are sent again if they are idempotent, the
+        // others complete with NULL reply. Handlers given to connect() are
+        // called on every attempt and disconnect.
+        void setReconnect(const RedisReconnectPolicy& policy)
+        {
+            _policy=policy;
+        }
+
+        const RedisReconnectPolicy& reconnectPolicy() const
+        {
+            return _policy;
+        }
+
+        // Commands above the limits are rejected with RedisException, the
+        // writable handler is called once the connection dropped to half of
+        // the limits after a rejection
+        void setFlowControl(const RedisFlowControl& flow)
+        {
+            _flow=flow;
+        }
+
+        const RedisFlowControl& flowControl() const
+        {
+            return _flow;
+        }
+
+        typedef boost::function<void (RedisConnectionAsync&)> OnWritable;
+
+        // Commands sent from now on are reported to instrument, which must
+        // outlive them
+        void setInstrument(RedisInstrument* instrument)
+        {
+            _instrument=instrument;
+        }
+
+        RedisInstrument* instrument() const
+        {
+            return _instrument;
+        }
+
+        template<typename WritableHandler>
+        void onWritable(WritableHandler handler)
+        {
+            _onWritable=handler;
+        }
+
+        // false when the next command would be rejected
+        bool writable() const
+        {
+            return (_flow.maxInFlight == 0 || _inFlight < _flow.maxInFlight) &&
+                (_flow.maxOutputBytes == 0 || _inFlightBytes < _flow.maxOutputBytes);
+        }
+
+        size_t inFlight() const
+        {
+            return _inFlight;
+        }
+
+        size_t inFlightBytes() const
+        {
+            return _inFlightBytes;
+        }
+
         template<typename HandlerC, typename HandlerD>
         void connect(HandlerC handlerC, HandlerD handlerD)
         {
             _onConnected = createOnHandler(handlerC);
             _onDisconnected = createOnHandler(handlerD);
-            asyncConnect();
+            _closing=false;
+            _attempt=0;
+
+            try {
+                asyncConnect();
+            }
+            catch (const RedisException&) {
+                if (!reconnecting()) {
+                    throw;
+                }
+                freeContext();
+                scheduleReconnect();
+            }
         }
         
         void disconnect()
         {
+            _closing=true;
+            if (_timer) {
+                _timer->stop();
+            }
             if (_ac) {
                 redisAsyncDisconnect(_ac);
                 _ac=NULL;
             }
+            failQueue();
+        }
+
+        // Frees the connection at once, pending commands complete with NULL
+        // reply; the disconnect handler is called if it was connected
+        void close()
+        {
+            _closing=true;
+            if (_timer) {
+                _timer->stop();
+            }
+            freeContext();
+            failQueue();
+        }
+
+        // Read-only commands, which get the same reply when sent twice and
+        // are replayed after reconnect. Writes may have been applied before
+        // the connection broke, they are replayed only when sent with
+        // execAsyncReplayable.
+        static bool isIdempotent(const char* data, size_t length)
+        {
+            static const char* const commands[] = {
+                "BITCOUNT", "DBSIZE", "ECHO", "EXISTS", "GET", "GETBIT",
+                "GETRANGE", "HEXISTS", "HGET", "HGETALL", "HKEYS", "HLEN",
+                "HMGET", "HSTRLEN", "HVALS", "INFO", "KEYS", "LINDEX",
+                "LLEN", "LRANGE", "MGET", "PING", "PTTL", "SCARD", "SDIFF",
+                "SINTER", "SISMEMBER", "SMEMBERS", "STRLEN", "SUNION", "TTL",
+                "TYPE", "ZCARD", "ZCOUNT", "ZRANGE", "ZRANGEBYSCORE",
+                "ZRANK", "ZREVRANGE", "ZREVRANGEBYSCORE", "ZREVRANK",
+                "ZSCORE"
+            };
+
+            const boost::string_view name = RedisProtocol::commandName(data, length);
+            char upper[20];
+
+            if (name.size() >= sizeof(upper)) {
+                return false;
+            }
+
+            for (size_t i = 0; i < name.size(); ++i) {
+                upper[i] = static_cast<char>(::toupper(static_cast<unsigned char>(name[i])));
+            }
+            upper[name.size()] = '\0';
+
+            size_t first = 0;
+            size_t last = sizeof(commands) / sizeof(commands[0]);
+
+            while (first < last) {
+                const size_t middle = (first + last) / 2;
+                const int c = ::strcmp(commands[middle], upper);
+
+                if (c == 0) {
+                    return true;
+                }
+                if (c < 0) {
+                    first = middle + 1;
+                }
+                else {
+                    last = middle;
+                }
+            }
+
+            return false;
+        }
+
+        // SET with NX, XX or GET, whose reply tells whether the value was
+        // there before and differs when the command is sent again
+        static bool isConditionalSet(const char* data, size_t length)
+        {
+            const char* end = data + length;
+            const char* p = static_cast<const char*>(::memchr(data, '$', length));
+
+            for (size_t i = 0; p != NULL && p < end && *p == '$'; ++i) {
+                size_t size = 0;
+                const char* arg = p + 1;
+
+                for (; arg < end && *arg >= '0' && *arg <= '9'; ++arg) {
+                    size = size * 10 + static_cast<size_t>(*arg - '0');
+                }
+
+                arg += 2;
+
+                if (arg > end || size > static_cast<size_t>(end - arg)) {
+                    return false;
+                }
+
+                if (i == 0 ? !isWord(arg, size, "SET") :
+                    i >= 3 && (isWord(arg, size, "NX") || isWord(arg, size, "XX") || isWord(arg, size, "GET"))) {
+                    return i != 0;
+                }
+
+                p = arg + size + 2;
+            }
+
+            return false;
+        }
+
+        // Commands not completed in time complete with NULL reply while
+        // timedOut() is true, the reply arriving later is dropped. Deadlines
+        // are kept with deadlineResolution(), 0 for no limit.
+        void setCommandTimeout(boost::chrono::milliseconds timeout)
+        {
+            _commandTimeout=timeout;
+        }
+
+        boost::chrono::milliseconds commandTimeout() const
+        {
+            return _commandTimeout;
+        }
+
+        // true inside the completion handler of a command past its deadline
+        bool timedOut() const
+        {
+            return _timedOut;
         }
 
         template<typename CharT, typename ExecHandler>
         void execAsyncCommand(const RedisCommandBase<CharT> & cmd, ExecHandler handler)
         {
-            if (_ac==NULL || _ac->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING))
+            execAsyncFormatted(cmd.data(), cmd.length(), handler, _commandTimeout);
+        }
+
+        template<typename CharT, typename ExecHandler>
+        void execAsyncCommand(const RedisCommandBase<CharT> & cmd, ExecHandler handler,
+                              boost::chrono::milliseconds timeout)
+        {
+            execAsyncFormatted(cmd.data(), cmd.length(), handler, timeout);
+        }
+
+        template<typename ExecHandler>
+        void execAsyncFormatted(const char* data, size_t length, ExecHandler handler)
+        {
+            execAsyncFormatted(data, length, handler, _commandTimeout);
+        }
+
+        // Command already encoded in RESP, as by RedisCommandBase
+        template<typename ExecHandler>
+        void execAsyncFormatted(const char* data, size_t length, ExecHandler handler,
+                                boost::chrono::milliseconds timeout)
+        {
+            submit(data, length, handler, timeout, isIdempotent(data, length));
+        }
+
+        // Write command replayed after reconnect as read-only ones are, for
+        // callers accepting that the server may have applied it already and
+        // that its reply may then differ. SET with NX, XX or GET is not
+        // replayed, its reply would tell the value is already there.
+        template<typename CharT, typename ExecHandler>
+        void execAsyncReplayable(const RedisCommandBase<CharT> & cmd, ExecHandler handler)
+        {
+            execAsyncReplayable(cmd, handler, _commandTimeout);
+        }
+
+        template<typename CharT, typename ExecHandler>
+        void execAsyncReplayable(const RedisCommandBase<CharT> & cmd, ExecHandler handler,
+                                 boost::chrono::milliseconds timeout)
+        {
+            submit(cmd.data(), cmd.length(), handler, timeout,
+                   !isConditionalSet(cmd.data(), cmd.length()));
+        }
+
+    private:
+        static bool isWord(const char* arg, size_t size, const char* word)
+        {
+            return size == ::strlen(word) && ::strncasecmp(arg, word, size) == 0;
+        }
+
+        template<typename ExecHandler>
+        void submit(const char* data, size_t length, ExecHandler handler,
+                    boost::chrono::milliseconds timeout, bool replayable)
+        {
+            const bool queue = !_connected && reconnecting();
+
+            if (!queue && (_ac==NULL || _ac->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING)))
                 throw RedisException("Can't execute a command, disconnecting or freeing");
 
-            const int sz=cmd.size();
-            const char* argv[sz];
-            size_t argvlen[sz];
-            
-            for (size_t i = 0; i < sz; ++i) {
-                argv[i] = cmd[i].data();
-                argvlen[i] = cmd[i].size();
-            }
-            
-            Handler<ExecHandler> *hand=new Handler<ExecHandler>(handler);
-            int result = 
-                ::redisAsyncCommandArgv(_ac, Handler<ExecHandler>::callback, hand,
-                                        sz, argv, argvlen);
-
-            if (result == REDIS_ERR) {
-                delete hand;
+            if (queue && _queued >= _policy.maxQueued)
+                throw RedisException("Can't execute a command, reconnect queue is full");
+
+            // a command larger than the byte limit still goes alone
+            if ((_flow.maxInFlight && _inFlight >= _flow.maxInFlight) ||
+                (_flow.maxOutputBytes && _inFlight && _inFlightBytes + length > _flow.maxOutputBytes)) {
+                _throttled=true;
+                throw RedisException("Can't execute a command, too many commands in flight");
+            }
+
+            if (timeout.count() > 0) {
+                prepareWheel();
+            }
+
+            HandlerBlock *block=acquireBlock();
+
+            try {
+                // kept for sending later or again
+                block->replay = _policy.enabled && replayable;
+                if (queue || block->replay) {
+                    block->command.assign(data, length);
+                }
+                if (_instrument) {
+                    block->sample.protocol = 2;
+                    _instrument->started(data, length, block->sample);
+                }
+                block->store(handler);
+            }
+            catch (...) {
+                RedisInstrument::complete(block->sample, NULL);
+                releaseBlock(block);
+                throw;
+            }
+
+            if (!queue &&
+                ::redisAsyncFormattedCommand(_ac, HandlerBlock::callback, block,
+                                             data, length) == REDIS_ERR) {
+                RedisInstrument::complete(block->sample, NULL);
+                block->destroy(block);
+                releaseBlock(block);
                 throw RedisException("Can't execute a command, REDIS ERROR");
             }
+
+            block->length = length;
+            _inFlight += 1;
+            _inFlightBytes += length;
+
+            if (queue) {
+                enqueue(block);
+            }
+
+            if (timeout.count() > 0) {
+                armDeadline(block, timeout);
+            }
+        }
+
+    public:
+        bool connected() const
+        {
+            return _connected;
+        }
+
+        // Owning handle of the reply passed to the running completion
+        // handler, keeps the reply alive after the handler returns
+        Redis::Reply takeReply()
+        {
+            Redis::Reply reply;
+            reply.swap(_reply);
+            return reply;
         }
 
     private:
@@ -76,9 +580,6 @@ namespace hiredispp
         public:
             OnHandler(Handler handler) : _handler(handler) {}
             virtual void operator() (boost::shared_ptr<RedisException> &ex) {
-#ifdef HIREDISPP_DEBUG
-                std::cout<<"virtual operator("<<(ex.get() ? "EXCEPTION" : "NULL")<<")"<<std::endl;
-#endif
                 _handler(ex);
             }
         };
@@ -89,84 +590,571 @@ namespace hiredispp
             return std::auto_ptr< BaseOnHandler >(new OnHandler<HandlerT>(handler));
         }
 
-        template<typename Callback>
-        class Handler // : public enable_shared_from_this<Handler <Callback> >
+        // Type erased completion handler in a fixed size block taken from
+        // the connection free list; handlers too big for the block are kept
+        // on the heap
+        struct HandlerBlock
         {
-        public:
-            Handler(Callback c) : _c(c) {}
+            typedef boost::aligned_storage<HandlerSize>::type Storage;
 
-            static void callback(redisAsyncContext *c, void *reply, void *privdata)
+            void (*invoke)(HandlerBlock*, ThisType&, Redis::Element*);
+            void (*destroy)(HandlerBlock*);
+            HandlerBlock* next;
+            Storage storage;
+
+            // encoded command while it may be sent again
+            std::string command;
+            bool replay;
+            size_t length;
+
+            // deadline wheel links, wheelPrev is NULL when not armed
+            HandlerBlock* wheelNext;
+            HandlerBlock** wheelPrev;
+            boost::uint64_t deadline;
+
+            // handler dropped at the deadline, block waits for hiredis to
+            // give it back; returned while its timeout handler runs
+            bool expired;
+            bool returned;
+
+            RedisInstrument::Sample sample;
+
+            template<typename Callback>
+            void store(const Callback& c)
+            {
+                if (sizeof(Callback) <= sizeof(Storage) &&
+                    boost::alignment_of<Callback>::value <= boost::alignment_of<Storage>::value) {
+                    new (storage.address()) Callback(c);
+                    invoke = &invokeInline<Callback>;
+                    destroy = &destroyInline<Callback>;
+                }
+                else {
+                    *static_cast<Callback**>(storage.address()) = new Callback(c);
+                    invoke = &invokeHeap<Callback>;
+                    destroy = &destroyHeap<Callback>;
+                }
+            }
+
+            template<typename Callback>
+            static void invokeInline(HandlerBlock* b, ThisType& ac, Redis::Element* reply)
             {
-                (static_cast< Handler<Callback> * > (privdata)) -> operator() (c,reply);
+                (*static_cast<Callback*>(b->storage.address()))(ac, reply);
             }
 
-            void operator() (redisAsyncContext *c, void *reply)
+            template<typename Callback>
+            static void destroyInline(HandlerBlock* b)
             {
-                if (reply) {
-                    // not a Redis::Reply, to avoid re-release of reply
-                    Redis::Element replyPtr(static_cast<redisReply*>(reply));
-                    _c(*static_cast<ThisType*>(c->data), &replyPtr);
+                static_cast<Callback*>(b->storage.address())->~Callback();
+            }
+
+            template<typename Callback>
+            static void invokeHeap(HandlerBlock* b, ThisType& ac, Redis::Element* reply)
+            {
+                (**static_cast<Callback**>(b->storage.address()))(ac, reply);
+            }
+
+            template<typename Callback>
+            static void destroyHeap(HandlerBlock* b)
+            {
+                delete *static_cast<Callback**>(b->storage.address());
+            }
+
+            // Returns the block to its connection even when handler throws
+            struct Release
+            {
+                HandlerBlock* block;
+                ThisType& ac;
+
+                // command completing inside a timeout handler did not time out
+                bool timedOut;
+
+                ~Release()
+                {
+                    ac._timedOut = timedOut;
+                    if (block && block == ac._expiring) {
+                        // left to expire(), its handler is running
+                        block->returned = true;
+                    }
+                    else if (block) {
+                        if (!block->expired) {
+                            block->destroy(block);
+                        }
+                        ac.retire(block);
+                    }
+                    Redis::Reply().swap(ac._reply);
                 }
-                else {
-                    _c(*static_cast<ThisType*>(c->data), static_cast<Redis::Element*>(NULL));
+            };
+
+            static void fail(HandlerBlock* block, ThisType& ac)
+            {
+                Release release = { block, ac, ac._timedOut };
+                ac._timedOut = false;
+                if (!block->expired) {
+                    RedisInstrument::complete(block->sample, NULL);
+                    block->invoke(block, ac, static_cast<Redis::Element*>(NULL));
                 }
-                delete(this);
             }
 
-        private:
-            Callback _c;
+            static void callback(redisAsyncContext *c, void *reply, void *privdata)
+            {
+                HandlerBlock* block = static_cast<HandlerBlock*>(privdata);
+                ThisType& ac = *static_cast<ThisType*>(c->data);
+
+                {
+                    Release release = { block, ac, ac._timedOut };
+                    ac._timedOut = false;
+
+                    if (reply) {
+                        // reply tree lives in the arena taken from the reader,
+                        // hiredis freeing the reply object leaves it alone
+                        RedisReplyArena*& arena = arenaOf(c);
+                        ac._reply = Redis::Reply(static_cast<redisReply*>(reply), arena);
+                        arena = NULL;
+                    }
+
+                    if (block->expired) {
+                        // handler was dropped at the deadline
+                    }
+                    else if (reply) {
+                        RedisInstrument::complete(block->sample, static_cast<redisReply*>(reply));
+                        Redis::Element replyPtr(static_cast<redisReply*>(reply));
+                        block->invoke(block, ac, &replyPtr);
+                    }
+                    else if (ac.requeue(block)) {
+                        release.block = NULL;
+                    }
+                    else {
+                        RedisInstrument::complete(block->sample, NULL);
+                        block->invoke(block, ac, static_cast<Redis::Element*>(NULL));
+                    }
+                }
+
+                if (ac._throttled) {
+                    ac.checkWritable();
+                }
+            }
         };
-        
+
+        // Arena receiving the reply being parsed by the context reader, see
+        // RedisReplyArena::Functions. One per context: a context still
+        // disconnecting may read replies while the next one connects.
+        static RedisReplyArena*& arenaOf(const redisAsyncContext* ac)
+        {
+            return *static_cast<RedisReplyArena**>(ac->c.reader->privdata);
+        }
+
+        // Replies without handler are left in the arena until the context
+        // goes away
+        static void releaseArena(const redisAsyncContext* ac)
+        {
+            if (ac->c.reader->privdata) {
+                RedisReplyArena* arena=arenaOf(ac);
+                if (arena) {
+                    RedisReplyArena::destroy(arena);
+                }
+                delete static_cast<RedisReplyArena**>(ac->c.reader->privdata);
+                ac->c.reader->privdata=NULL;
+            }
+        }
+
+        static const size_t BlocksPerChunk = 64;
+
+        HandlerBlock* acquireBlock()
+        {
+            if (_free == NULL) {
+                HandlerBlock* chunk = new HandlerBlock[BlocksPerChunk];
+                _chunks.push_back(chunk);
+
+                for (size_t i = 0; i < BlocksPerChunk; ++i) {
+                    chunk[i].next = _free;
+                    _free = &chunk[i];
+                }
+            }
+
+            HandlerBlock* block = _free;
+            _free = block->next;
+            block->wheelPrev = NULL;
+            block->expired = false;
+            block->sample.instrument = NULL;
+            return block;
+        }
+
+        void releaseBlock(HandlerBlock* block)
+        {
+            block->command.clear();
+            block->next = _free;
+            _free = block;
+        }
+
+        // Block given back for good, counted out of the flow control
+        void retire(HandlerBlock* block)
+        {
+            if (block->wheelPrev) {
+                unlinkDeadline(block);
+            }
+            _inFlight -= 1;
+            _inFlightBytes -= block->length;
+            releaseBlock(block);
+        }
+
+        static void link(HandlerBlock*& head, HandlerBlock* block)
+        {
+            block->wheelNext = head;
+            block->wheelPrev = &head;
+            if (head) {
+                head->wheelPrev = &block->wheelNext;
+            }
+            head = block;
+        }
+
+        static void unlink(HandlerBlock* block)
+        {
+            *block->wheelPrev = block->wheelNext;
+            if (block->wheelNext) {
+                block->wheelNext->wheelPrev = block->wheelPrev;
+            }
+            block->wheelPrev = NULL;
+        }
+
+        boost::uint64_t currentTick() const
+        {
+            return static_cast<boost::uint64_t>((Clock::now() - _wheelEpoch) /
+                                                Clock::duration(deadlineResolution()));
+        }
+
+        // allocations done before the command is sent
+        void prepareWheel()
+        {
+            if (_wheel.empty()) {
+                _wheel.resize(WheelSlots, NULL);
+            }
+            if (!_wheelTimer) {
+                _wheelTimer.reset(_loop->createTimer(&wheelTimer, this));
+            }
+        }
+
+        void armDeadline(HandlerBlock* block, boost::chrono::milliseconds timeout)
+        {
+            const boost::uint64_t now = currentTick();
+            const boost::int64_t resolution = deadlineResolution().count();
+            const boost::uint64_t ticks = (timeout.count() + resolution - 1) / resolution;
+
+            if (_deadlines == 0) {
+                // slots passed while idle are empty
+                _wheelTick = now;
+                _wheelTimer->start(deadlineResolution());
+            }
+
+            block->deadline = now + ticks;
+            link(_wheel[block->deadline % WheelSlots], block);
+            ++_deadlines;
+        }
+
+        void unlinkDeadline(HandlerBlock* block)
+        {
+            unlink(block);
+            --_deadlines;
+        }
+
+        static void wheelTimer(void* data)
+        {
+            static_cast<ThisType*>(data)->advanceWheel();
+        }
+
+        // Moves blocks due by now to the expired list first, their handlers
+        // may complete or arm other blocks
+        void advanceWheel()
+        {
+            const boost::uint64_t now = currentTick();
+            HandlerBlock* due = NULL;
+
+            // a late tick catches up, each slot is looked at once at most
+            boost::uint64_t tick = _wheelTick + 1;
+            if (now - _wheelTick > WheelSlots) {
+                tick = now - WheelSlots + 1;
+            }
+
+            for (; tick <= now; ++tick) {
+                HandlerBlock* block = _wheel[tick % WheelSlots];
+
+                while (block) {
+                    HandlerBlock* next = block->wheelNext;
+                    if (block->deadline <= now) {
+                        unlink(block);
+                        link(due, block);
+                    }
+                    block = next;
+                }
+            }
+            _wheelTick = now;
+
+            while (HandlerBlock* block = due) {
+                unlinkDeadline(block);
+                expire(block);
+            }
+
+            if (_deadlines > 0) {
+                _wheelTimer->start(deadlineResolution());
+            }
+        }
+
+        // Calls the handler with NULL reply and drops it, the block stays
+        // with hiredis, or in the reconnect queue, until given back
+        void expire(HandlerBlock* block)
+        {
+            struct Expiring
+            {
+                ThisType& ac;
+                HandlerBlock* block;
+
+                ~Expiring()
+                {
+                    ac._timedOut=false;
+                    ac._expiring=NULL;
+                    block->destroy(block);
+                    if (block->returned) {
+                        ac.retire(block);
+                    }
+                }
+            } expiring = { *this, block };
+
+            block->expired=true;
+            block->returned=false;
+            block->replay=false;
+            _expiring=block;
+            _timedOut=true;
+            RedisInstrument::complete(block->sample, NULL);
+            block->invoke(block, *this, static_cast<Redis::Element*>(NULL));
+        }
+
+        // writable handler runs once below half of the limits, so a
+        // connection at the limit does not wake the submitter per reply
+        void checkWritable()
+        {
+            if ((_flow.maxInFlight && _inFlight > _flow.maxInFlight / 2) ||
+                (_flow.maxOutputBytes && _inFlightBytes > _flow.maxOutputBytes / 2)) {
+                return;
+            }
+
+            _throttled=false;
+            if (_onWritable) {
+                _onWritable(*this);
+            }
+        }
+
+        bool reconnecting() const
+        {
+            return _policy.enabled && !_closing;
+        }
+
+        void enqueue(HandlerBlock* block)
+        {
+            block->next = NULL;
+            if (_queueTail) {
+                _queueTail->next = block;
+            }
+            else {
+                _queueHead = block;
+            }
+            _queueTail = block;
+            ++_queued;
+        }
+
+        HandlerBlock* dequeue()
+        {
+            HandlerBlock* block = _queueHead;
+            if (block) {
+                _queueHead = block->next;
+                if (_queueHead == NULL) {
+                    _queueTail = NULL;
+                }
+                --_queued;
+            }
+            return block;
+        }
+
+        // Command in flight on a broken connection, kept to be sent again
+        bool requeue(HandlerBlock* block)
+        {
+            if (!reconnecting() || !block->replay || _queued >= _policy.maxQueued) {
+                return false;
+            }
+            enqueue(block);
+            return true;
+        }
+
+        void flushQueue()
+        {
+            while (HandlerBlock* block = dequeue()) {
+                if (block->expired) {
+                    HandlerBlock::fail(block, *this);
+                    continue;
+                }
+                if (::redisAsyncFormattedCommand(_ac, HandlerBlock::callback, block,
+                                                 block->command.data(), block->command.size()) != REDIS_OK) {
+                    HandlerBlock::fail(block, *this);
+                    continue;
+                }
+                if (!block->replay) {
+                    block->command.clear();
+                }
+            }
+        }
+
+        void failQueue()
+        {
+            while (HandlerBlock* block = dequeue()) {
+                HandlerBlock::fail(block, *this);
+            }
+        }
+
+        void scheduleReconnect()
+        {
+            if (!_timer) {
+                _timer.reset(_loop->createTimer(&reconnectTimer, this));
+            }
+
+            boost::int64_t ceiling = _policy.initialDelay.count();
+            for (unsigned i = 0; i < _attempt && ceiling < _policy.maxDelay.count(); ++i) {
+                ceiling *= 2;
+            }
+            ceiling = std::max<boost::int64_t>(std::min<boost::int64_t>(ceiling, _policy.maxDelay.count()), 1);
+            ++_attempt;
+
+            // jitter spreads reconnects of clients which lost the same server
+            boost::random::uniform_int_distribution<boost::int64_t> jitter(ceiling / 2, ceiling);
+            _timer->start(boost::chrono::milliseconds(jitter(_random)));
+        }
+
+        static void reconnectTimer(void* data)
+        {
+            ThisType* self = static_cast<ThisType*>(data);
+
+            if (self->_ac || !self->reconnecting()) {
+                return;
+            }
+
+            try {
+                self->asyncConnect();
+            }
+            catch (const RedisException&) {
+                self->freeContext();
+                self->scheduleReconnect();
+            }
+        }
+
+        void freeContext()
+        {
+            if (_ac) {
+                redisAsyncContext* ac=_ac;
+                _ac=NULL;
+                _connected=false;
+                // disconnect callback does not release it when never connected
+                releaseArena(ac);
+                redisAsyncFree(ac);
+            }
+        }
+
         void onConnected(int status)
         {
             boost::shared_ptr<RedisException> ex;
             if (status!=REDIS_OK) {
                 ex.reset(new RedisException((_ac && _ac->errstr) ? _ac->errstr : "REDIS_ERR"));
-                asyncClose(); // we started ev_read/write, we must stop it.
+                // context is freed by hiredis, which detaches it from the loop
                 _ac=NULL;
             }
+            else {
+                _connected=true;
+                _attempt=0;
+                // queued commands go before those sent by the handler
+                flushQueue();
+            }
             _onConnected->operator()(ex);
+            if (status!=REDIS_OK && reconnecting()) {
+                scheduleReconnect();
+            }
         }
         
         void onDisconnected(int status)
         {
             boost::shared_ptr<RedisException> ex;
+            _connected=false;
             if (status!=REDIS_OK) {
                 ex.reset(new RedisException((_ac && _ac->errstr) ? _ac->errstr : "REDIS_ERR"));
                 _ac=NULL;
             }
             _onDisconnected->operator()(ex);
+            if (status!=REDIS_OK && reconnecting()) {
+                scheduleReconnect();
+            }
         }
 
         static void connected(const redisAsyncContext *ac, int status)
         {
-            std::cout<<"static::connected"<<std::endl;
             if (ac && ac->data) {
                 ((RedisConnectionAsync*)(ac->data))->onConnected(status);
             }
+            if (ac && status!=REDIS_OK) {
+                releaseArena(ac);
+            }
         }
         
         static void disconnected(const redisAsyncContext *ac, int status)
         {
-            std::cout<<"static::disconnected"<<std::endl;
             if (ac && ac->data) {
                 ((RedisConnectionAsync*)(ac->data))->onDisconnected(status);
             }
+            if (ac) {
+                releaseArena(ac);
+            }
         }
 
         std::string        _host;
         uint16_t           _port;
-        bool               _reconnect;
+        bool               _connected;
+        bool               _closing;
         redisAsyncContext* _ac;
+        RedisEventLoop*    _loop;
 
         std::auto_ptr<BaseOnHandler>   _onConnected;
         std::auto_ptr<BaseOnHandler>   _onDisconnected;
 
-        int asyncConnect()
+        HandlerBlock*              _free;
+        std::vector<HandlerBlock*> _chunks;
+        Redis::Reply               _reply;
+
+        RedisReconnectPolicy          _policy;
+        boost::scoped_ptr<RedisTimer> _timer;
+        HandlerBlock*                 _queueHead;
+        HandlerBlock*                 _queueTail;
+        size_t                        _queued;
+        unsigned                      _attempt;
+        boost::random::mt19937        _random;
+
+        RedisFlowControl              _flow;
+        size_t                        _inFlight;
+        size_t                        _inFlightBytes;
+        bool                          _throttled;
+        OnWritable                    _onWritable;
+
+        // Hashed wheel of command deadlines, slot i holds blocks due at
+        // ticks congruent to i; its timer ticks while any deadline is armed
+        typedef boost::chrono::steady_clock Clock;
+        static const size_t WheelSlots = 512;
+
+        boost::chrono::milliseconds   _commandTimeout;
+        std::vector<HandlerBlock*>    _wheel;
+        Clock::time_point             _wheelEpoch;
+        boost::uint64_t               _wheelTick;
+        size_t                        _deadlines;
+        boost::scoped_ptr<RedisTimer> _wheelTimer;
+        HandlerBlock*                 _expiring;
+        bool                          _timedOut;
+
+        RedisInstrument*              _instrument;
+
+        void asyncConnect()
         {
-#ifdef HIREDISPP_DEBUG
-            std::cout<<"asyncConnect()"<<std::endl;
-#endif
             assert(_ac==NULL); 
 
             _ac = redisAsyncConnect(_host.c_str(), _port);
@@ -175,28 +1163,20 @@ namespace hiredispp
             if (_ac->err) {
                 throw RedisException((std::string)"RedisAsyncConnect: "+_ac->errstr);
             }
-            if (redisAsyncSetConnectCallback(_ac, &connected)!=REDIS_OK ||
-                redisAsyncSetDisconnectCallback(_ac, &disconnected)!=REDIS_OK) {
-                throw RedisException("RedisAsyncConnect: Can't register callbacks");
-            }
 
-            if (redisLibevAttach(EV_DEFAULT, _ac)!=REDIS_OK) {
-                throw RedisException("redisLibevAttach: nothing should be attached when something is already attached");
-            }
+            // replies are parsed into arenas handed to completion handlers
+            _ac->c.reader->fn = &RedisReplyArena::Functions;
+            _ac->c.reader->privdata = new RedisReplyArena*(NULL);
 
-            // actually start io proccess
-            ev_io_start(EV_DEFAULT, &((((redisLibevEvents*)(_ac->ev.data)))->rev));
-            ev_io_start(EV_DEFAULT, &((((redisLibevEvents*)(_ac->ev.data)))->wev));
-        }
+            // attached before the callbacks are set, setting the connect
+            // callback registers the write event signalling connection
+            if (!_loop->attach(_ac)) {
+                throw RedisException("RedisAsyncConnect: Can't attach to the event loop");
+            }
 
-        void asyncClose()
-        {
-            if (_ac) {
-                ev_io_stop(EV_DEFAULT, &((((redisLibevEvents*)(_ac->ev.data)))->rev));
-                ev_io_stop(EV_DEFAULT, &((((redisLibevEvents*)(_ac->ev.data)))->wev));
-                // redisLibevCleanup(_ac->_adapter_data);
-                // TODO: should we close it or not???
-                // close(_ac->c.fd);
+            if (redisAsyncSetConnectCallback(_ac, &connected)!=REDIS_OK ||
+                redisAsyncSetDisconnectCallback(_ac, &disconnected)!=REDIS_OK) {
+                throw RedisException("RedisAsyncConnect: Can't register callbacks");
             }
         }
     };
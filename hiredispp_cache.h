@@ -0,0 +1,750 @@
+/*
+ * hiredispp_cache.h
+ */
+
+#ifndef HIREDISPP_CACHE_H
+#define HIREDISPP_CACHE_H
+
+#include "hiredispp.h"
+#include <sys/socket.h>
+#include <list>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace hiredispp
+{
+    struct RedisCacheConfig
+    {
+        // Bound of keys, values and bookkeeping held, split evenly between
+        // shards, each shard evicts its least recently used keys
+        size_t maxBytes;
+        size_t shards;
+
+        // Only keys starting with one of the prefixes are cached, all keys
+        // when empty. Server reports every write to a cached prefix.
+        std::vector<std::string> prefixes;
+
+        // Invalidation connection, reconnected after retryInterval when lost
+        boost::chrono::milliseconds connectTimeout;
+        boost::chrono::milliseconds retryInterval;
+
+        // 3 receives invalidations as RESP3 push frames on the invalidation
+        // connection itself, 2 through a subscription; 3 needs hiredis 1.0
+        int protocol;
+
+        RedisCacheConfig()
+            : maxBytes(64 * 1024 * 1024), shards(16),
+              connectTimeout(1000), retryInterval(1000), protocol(2) { }
+    };
+
+    struct RedisCacheStats
+    {
+        boost::uint64_t hits;
+        boost::uint64_t misses;
+
+        // keys dropped on invalidation messages, and whole cache drops on
+        // FLUSHALL or lost invalidation connection
+        boost::uint64_t invalidations;
+        boost::uint64_t flushes;
+        boost::uint64_t evictions;
+
+        size_t keys;
+        size_t bytes;
+    };
+
+    // Near cache of GET and HGET replies kept coherent by CLIENT TRACKING.
+    // A connection of its own turns on tracking in broadcast mode redirected
+    // to itself and subscribes to __redis__:invalidate, or with RESP3 takes
+    // invalidation push frames, so the server reports every changed key of
+    // the cached prefixes no matter which connection read it. Reads may thus
+    // go through any connection. While the invalidation connection is down
+    // the cache is empty and reads go to the server.
+    //
+    //     hiredispp::RedisNearCache cache("127.0.0.1");
+    //     hiredispp::Redis r("127.0.0.1");
+    //     std::string v = cache.get(r, "key");
+    template<typename CharT>
+    class RedisNearCacheBase : boost::noncopyable
+#if HIREDIS_MAJOR >= 1
+        , public RedisPushHandler<CharT>
+#endif
+    {
+    public:
+        typedef std::basic_string<CharT> String;
+        typedef RedisBase<CharT> Redis;
+
+        // State of the cache taken before a read is sent, the reply is only
+        // stored when no invalidation of its shard came in between
+        struct Ticket
+        {
+            size_t shard;
+            boost::uint64_t sequence;
+        };
+
+    private:
+        typedef std::map<String, String> Fields;
+
+        struct Entry
+        {
+            String key;
+            String value;
+            bool hasValue;
+            Fields fields;
+            size_t bytes;
+        };
+
+        typedef std::list<Entry> Lru;
+        typedef boost::unordered_map<String, typename Lru::iterator, boost::hash<String> > Index;
+
+        struct Shard
+        {
+            boost::mutex mutex;
+            Lru lru;
+            Index index;
+            size_t bytes;
+
+            // bumped by every invalidation of a key of this shard
+            boost::uint64_t sequence;
+
+            boost::uint64_t hits;
+            boost::uint64_t misses;
+            boost::uint64_t invalidations;
+            boost::uint64_t evictions;
+
+            Shard()
+                : bytes(0), sequence(0), hits(0), misses(0), invalidations(0), evictions(0) { }
+        };
+
+        // Estimated bookkeeping of an entry and of a hash field
+        static const size_t EntryOverhead = 96;
+        static const size_t FieldOverhead = 48;
+
+        const std::string _host;
+        const int _port;
+        const RedisCacheConfig _config;
+        const size_t _shardBytes;
+
+        boost::scoped_array<Shard> _shards;
+        boost::hash<String> _hash;
+        std::vector<String> _prefixes;
+
+        // Set while the invalidation connection is subscribed
+        boost::atomic<bool> _tracking;
+        boost::atomic<boost::uint64_t> _flushes;
+
+        boost::mutex _mutex;
+        boost::condition_variable _stopped;
+        redisContext* _listener;
+        bool _stopping;
+        boost::thread _thread;
+
+        static size_t bytes(const String& s)
+        {
+            return s.size() * sizeof(CharT);
+        }
+
+        size_t shardOf(const String& key) const
+        {
+            return _hash(key) % _config.shards;
+        }
+
+        // Entry of key moved to the front, shard must be locked
+        Entry* find(Shard& shard, const String& key)
+        {
+            typename Index::iterator i = shard.index.find(key);
+
+            if (i == shard.index.end())
+            {
+                return 0;
+            }
+
+            shard.lru.splice(shard.lru.begin(), shard.lru, i->second);
+            return &*i->second;
+        }
+
+        Entry& create(Shard& shard, const String& key)
+        {
+            Entry* entry = find(shard, key);
+
+            if (entry != 0)
+            {
+                return *entry;
+            }
+
+            shard.lru.push_front(Entry());
+            shard.lru.front().key = key;
+            shard.lru.front().hasValue = false;
+            shard.lru.front().bytes = EntryOverhead + 2 * bytes(key);
+            shard.index[key] = shard.lru.begin();
+            shard.bytes += shard.lru.front().bytes;
+
+            return shard.lru.front();
+        }
+
+        void erase(Shard& shard, typename Lru::iterator i)
+        {
+            shard.bytes -= i->bytes;
+            shard.index.erase(i->key);
+            shard.lru.erase(i);
+        }
+
+        void evict(Shard& shard)
+        {
+            while (shard.bytes > _shardBytes && !shard.lru.empty())
+            {
+                erase(shard, --shard.lru.end());
+                ++shard.evictions;
+            }
+        }
+
+        bool cached(const String& key) const
+        {
+            for (size_t i = 0; i < _prefixes.size(); ++i)
+            {
+                if (key.compare(0, _prefixes[i].size(), _prefixes[i]) == 0)
+                {
+                    return true;
+                }
+            }
+
+            return _prefixes.empty();
+        }
+
+        // Entry to be stored by the ticket holder, NULL when an invalidation
+        // may have been missed since the ticket was taken
+        Entry* prepare(Shard& shard, const Ticket& ticket, const String& key)
+        {
+            if (shard.sequence != ticket.sequence || !tracking() || !cached(key))
+            {
+                return 0;
+            }
+
+            return &create(shard, key);
+        }
+
+        void invalidate(const char* data, size_t size)
+        {
+            String key;
+
+            try
+            {
+                RedisEncoding<CharT>::decode(data, size, key);
+            }
+            catch (const RedisException&)
+            {
+                // key not representable as String can't be cached either
+                return;
+            }
+
+            invalidate(key);
+        }
+
+        // Invalidation message is ["message", channel, keys], keys is nil
+        // when the whole keyspace was flushed
+        void dispatch(const redisReply* r)
+        {
+            if (r->type != REDIS_REPLY_ARRAY || r->elements != 3 ||
+                r->element[0]->type != REDIS_REPLY_STRING ||
+                ::strcmp(r->element[0]->str, "message") != 0)
+            {
+                return;
+            }
+
+            const redisReply* keys = r->element[2];
+
+            if (keys->type == REDIS_REPLY_ARRAY)
+            {
+                for (size_t i = 0; i < keys->elements; ++i)
+                {
+                    invalidate(keys->element[i]->str, keys->element[i]->len);
+                }
+            }
+            else if (keys->type == REDIS_REPLY_STRING)
+            {
+                invalidate(keys->str, keys->len);
+            }
+            else
+            {
+                clear();
+            }
+        }
+
+        static redisReply* command(redisContext* c, const std::vector<std::string>& args)
+        {
+            std::vector<const char*> argv(args.size());
+            std::vector<size_t> argvlen(args.size());
+
+            for (size_t i = 0; i < args.size(); ++i)
+            {
+                argv[i] = args[i].data();
+                argvlen[i] = args[i].size();
+            }
+
+            redisReply* r = 0;
+
+            if (::redisAppendCommandArgv(c, static_cast<int>(args.size()), &argv[0], &argvlen[0]) != REDIS_OK ||
+                ::redisGetReply(c, reinterpret_cast<void**>(&r)) != REDIS_OK)
+            {
+                return 0;
+            }
+
+            return r;
+        }
+
+        // Broadcast tracking of the cached prefixes, invalidations go to
+        // connection redirect or to c itself when it is 0
+        bool track(redisContext* c, boost::int64_t redirect)
+        {
+            std::vector<std::string> args;
+            args.push_back("CLIENT");
+            args.push_back("TRACKING");
+            args.push_back("ON");
+
+            if (redirect != 0)
+            {
+                args.push_back("REDIRECT");
+                args.push_back(boost::lexical_cast<std::string>(redirect));
+            }
+
+            args.push_back("BCAST");
+
+            for (size_t i = 0; i < _config.prefixes.size(); ++i)
+            {
+                args.push_back("PREFIX");
+                args.push_back(_config.prefixes[i]);
+            }
+
+            redisReply* r = command(c, args);
+            const bool tracking = (r != 0 && r->type == REDIS_REPLY_STATUS);
+            ::freeReplyObject(r);
+
+            return tracking;
+        }
+
+        // Tracking must be on before SUBSCRIBE, a subscribed RESP2
+        // connection takes no other commands
+        bool subscribe(redisContext* c)
+        {
+            std::vector<std::string> args;
+            args.push_back("CLIENT");
+            args.push_back("ID");
+
+            redisReply* r = command(c, args);
+            boost::int64_t id = (r != 0 && r->type == REDIS_REPLY_INTEGER) ? r->integer : 0;
+            ::freeReplyObject(r);
+
+            if (id == 0 || !track(c, id))
+            {
+                return false;
+            }
+
+            args[0] = "SUBSCRIBE";
+            args[1] = "__redis__:invalidate";
+
+            r = command(c, args);
+            const bool subscribed = (r != 0 && r->type == REDIS_REPLY_ARRAY);
+            ::freeReplyObject(r);
+
+            return subscribed;
+        }
+
+#if HIREDIS_MAJOR >= 1
+        // RESP3 connection tracks for itself, push frames are read as
+        // replies as RedisBase reads them
+        bool hello(redisContext* c)
+        {
+            ::redisSetPushCallback(c, 0);
+
+            std::vector<std::string> args;
+            args.push_back("HELLO");
+            args.push_back("3");
+
+            redisReply* r = command(c, args);
+            const bool switched = (r != 0 && r->type == REDIS_REPLY_MAP);
+            ::freeReplyObject(r);
+
+            return switched && track(c, 0);
+        }
+#endif
+
+        bool start(redisContext* c)
+        {
+#if HIREDIS_MAJOR >= 1
+            if (_config.protocol == 3)
+            {
+                return hello(c);
+            }
+#endif
+            return subscribe(c);
+        }
+
+        redisContext* connect()
+        {
+            timeval tv;
+            tv.tv_sec = static_cast<time_t>(_config.connectTimeout.count() / 1000);
+            tv.tv_usec = static_cast<suseconds_t>(_config.connectTimeout.count() % 1000 * 1000);
+
+            redisContext* c = ::redisConnectWithTimeout(_host.c_str(), _port, tv);
+
+            if (c == 0 || c->err)
+            {
+                ::redisFree(c);
+                return 0;
+            }
+
+            // hiredis before 1.0 keeps the connect timeout for reads
+            timeval none = { 0, 0 };
+            ::redisSetTimeout(c, none);
+            ::redisEnableKeepAlive(c);
+
+            boost::lock_guard<boost::mutex> lock(_mutex);
+
+            if (_stopping)
+            {
+                ::redisFree(c);
+                return 0;
+            }
+
+            _listener = c;
+            return c;
+        }
+
+        void disconnect(redisContext* c)
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(_mutex);
+                _listener = 0;
+            }
+
+            ::redisFree(c);
+        }
+
+        void listen()
+        {
+            for (;;)
+            {
+                redisContext* c = connect();
+
+                if (c != 0 && start(c))
+                {
+                    // anything stored before may have missed invalidations
+                    clear();
+                    _tracking.store(true, boost::memory_order_release);
+
+                    redisReply* r;
+
+                    while (::redisGetReply(c, reinterpret_cast<void**>(&r)) == REDIS_OK)
+                    {
+#if HIREDIS_MAJOR >= 1
+                        if (r->type == REDIS_REPLY_PUSH)
+                        {
+                            // the result takes over r
+                            pushed(RedisResult<RedisReplyBase, CharT>(r));
+                            continue;
+                        }
+#endif
+                        dispatch(r);
+                        ::freeReplyObject(r);
+                    }
+
+                    _tracking.store(false, boost::memory_order_release);
+                    clear();
+                }
+
+                if (c != 0)
+                {
+                    disconnect(c);
+                }
+
+                boost::unique_lock<boost::mutex> lock(_mutex);
+
+                if (_stopping ||
+                    _stopped.wait_for(lock, _config.retryInterval, boost::bind(&RedisNearCacheBase::stopping, this)))
+                {
+                    return;
+                }
+            }
+        }
+
+        bool stopping() const
+        {
+            return _stopping;
+        }
+
+    public:
+        // Starts the invalidation connection, reads are served from the
+        // server until it is subscribed
+        RedisNearCacheBase(const std::string& host, int port = 6379, const RedisCacheConfig& config = RedisCacheConfig())
+            : _host(host), _port(port), _config(config),
+              _shardBytes(config.shards ? config.maxBytes / config.shards : 0),
+              _shards(new Shard[config.shards ? config.shards : 1]),
+              _tracking(false), _flushes(0), _listener(0), _stopping(false)
+        {
+            if (config.shards == 0)
+            {
+                throw std::invalid_argument("Invalid cache shard count");
+            }
+
+            for (size_t i = 0; i < config.prefixes.size(); ++i)
+            {
+                _prefixes.push_back(String());
+                RedisEncoding<CharT>::decode(config.prefixes[i], _prefixes.back());
+            }
+
+            _thread = boost::thread(boost::bind(&RedisNearCacheBase::listen, this));
+        }
+
+        ~RedisNearCacheBase()
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(_mutex);
+                _stopping = true;
+
+                // unblocks the listener reading invalidations
+                if (_listener != 0)
+                {
+                    ::shutdown(_listener->fd, SHUT_RDWR);
+                }
+            }
+
+            _stopped.notify_all();
+            _thread.join();
+        }
+
+        // True while invalidations are received and reads may be cached
+        bool tracking() const
+        {
+            return _tracking.load(boost::memory_order_acquire);
+        }
+
+        String get(const Redis& redis, const String& key)
+        {
+            String value;
+
+            if (lookup(key, value))
+            {
+                return value;
+            }
+
+            const Ticket t = ticket(key);
+            value = redis.get(key);
+            store(t, key, value);
+
+            return value;
+        }
+
+        String hget(const Redis& redis, const String& key, const String& field)
+        {
+            String value;
+
+            if (lookup(key, field, value))
+            {
+                return value;
+            }
+
+            const Ticket t = ticket(key);
+            value = redis.hget(key, field);
+            store(t, key, field, value);
+
+            return value;
+        }
+
+        // Lower level interface for other connections, such as
+        // RedisConnectionAsync: on a miss take a ticket before sending the
+        // read, store its reply with the ticket.
+
+        bool lookup(const String& key, String& value)
+        {
+            Shard& shard = _shards[shardOf(key)];
+            boost::lock_guard<boost::mutex> lock(shard.mutex);
+
+            // entries are dropped right after tracking stops
+            Entry* entry = tracking() ? find(shard, key) : 0;
+
+            if (entry == 0 || !entry->hasValue)
+            {
+                ++shard.misses;
+                return false;
+            }
+
+            ++shard.hits;
+            value = entry->value;
+            return true;
+        }
+
+        bool lookup(const String& key, const String& field, String& value)
+        {
+            Shard& shard = _shards[shardOf(key)];
+            boost::lock_guard<boost::mutex> lock(shard.mutex);
+            Entry* entry = tracking() ? find(shard, key) : 0;
+            typename Fields::const_iterator i;
+
+            if (entry == 0 || (i = entry->fields.find(field)) == entry->fields.end())
+            {
+                ++shard.misses;
+                return false;
+            }
+
+            ++shard.hits;
+            value = i->second;
+            return true;
+        }
+
+        Ticket ticket(const String& key)
+        {
+            Ticket t;
+            t.shard = shardOf(key);
+
+            boost::lock_guard<boost::mutex> lock(_shards[t.shard].mutex);
+            t.sequence = _shards[t.shard].sequence;
+
+            return t;
+        }
+
+        void store(const Ticket& ticket, const String& key, const String& value)
+        {
+            Shard& shard = _shards[ticket.shard];
+            boost::lock_guard<boost::mutex> lock(shard.mutex);
+            Entry* entry = prepare(shard, ticket, key);
+
+            if (entry == 0)
+            {
+                return;
+            }
+
+            const size_t previous = entry->hasValue ? bytes(entry->value) : 0;
+
+            shard.bytes += bytes(value) - previous;
+            entry->bytes += bytes(value) - previous;
+            entry->value = value;
+            entry->hasValue = true;
+
+            evict(shard);
+        }
+
+        void store(const Ticket& ticket, const String& key, const String& field, const String& value)
+        {
+            Shard& shard = _shards[ticket.shard];
+            boost::lock_guard<boost::mutex> lock(shard.mutex);
+            Entry* entry = prepare(shard, ticket, key);
+
+            if (entry == 0)
+            {
+                return;
+            }
+
+            std::pair<typename Fields::iterator, bool> i = entry->fields.insert(std::make_pair(field, value));
+            const size_t previous = i.second ? 0 : bytes(i.first->second);
+            const size_t size = bytes(value) + (i.second ? FieldOverhead + bytes(field) : 0);
+
+            shard.bytes += size - previous;
+            entry->bytes += size - previous;
+            i.first->second = value;
+
+            evict(shard);
+        }
+
+        // Drops key, reads of it in flight are not stored
+        void invalidate(const String& key)
+        {
+            Shard& shard = _shards[shardOf(key)];
+            boost::lock_guard<boost::mutex> lock(shard.mutex);
+            typename Index::iterator i = shard.index.find(key);
+
+            ++shard.sequence;
+
+            if (i != shard.index.end())
+            {
+                erase(shard, i->second);
+                ++shard.invalidations;
+            }
+        }
+
+        void clear()
+        {
+            for (size_t i = 0; i < _config.shards; ++i)
+            {
+                Shard& shard = _shards[i];
+                boost::lock_guard<boost::mutex> lock(shard.mutex);
+
+                ++shard.sequence;
+                shard.lru.clear();
+                shard.index.clear();
+                shard.bytes = 0;
+            }
+
+            _flushes.fetch_add(1, boost::memory_order_relaxed);
+        }
+
+#if HIREDIS_MAJOR >= 1
+        // Invalidation push frame is ["invalidate", keys], keys is nil when
+        // the whole keyspace was flushed. Also takes those of RESP3
+        // connections it is attached to with setPushHandler().
+        virtual void pushed(const RedisResult<RedisReplyBase, CharT>& push)
+        {
+            if (!push.isPush() || push.size() != 2 ||
+                push[0].get()->type != REDIS_REPLY_STRING ||
+                push[0].view() != boost::string_view("invalidate"))
+            {
+                return;
+            }
+
+            const RedisResult<RedisElementBase, CharT> keys = push[1];
+
+            if (keys.isNil())
+            {
+                clear();
+                return;
+            }
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                const boost::string_view key = keys[i].view();
+                invalidate(key.data(), key.size());
+            }
+        }
+#endif
+
+        RedisCacheStats stats() const
+        {
+            RedisCacheStats s;
+
+            s.hits = 0;
+            s.misses = 0;
+            s.invalidations = 0;
+            s.flushes = _flushes.load(boost::memory_order_relaxed);
+            s.evictions = 0;
+            s.keys = 0;
+            s.bytes = 0;
+
+            for (size_t i = 0; i < _config.shards; ++i)
+            {
+                Shard& shard = _shards[i];
+                boost::lock_guard<boost::mutex> lock(shard.mutex);
+
+                s.hits += shard.hits;
+                s.misses += shard.misses;
+                s.invalidations += shard.invalidations;
+                s.evictions += shard.evictions;
+                s.keys += shard.index.size();
+                s.bytes += shard.bytes;
+            }
+
+            return s;
+        }
+    };
+
+    typedef RedisNearCacheBase<char> RedisNearCache;
+    typedef RedisNearCacheBase<wchar_t> wRedisNearCache;
+}
+
+#endif // HIREDISPP_CACHE_H
@@ -0,0 +1,675 @@
+/*
+ * hiredispp_cluster.h
+ */
+
+#ifndef HIREDISPP_CLUSTER_H
+#define HIREDISPP_CLUSTER_H
+
+#include "hiredispp_shard.h"
+#include <boost/crc.hpp>
+
+namespace hiredispp
+{
+    // Client of Redis Cluster with one connection per master node. Slot table
+    // is loaded from CLUSTER SLOTS on first use and reloaded before the next
+    // command after a MOVED redirect or a connection error.
+    template<typename CharT>
+    class RedisCluster : public RedisKeyCommands<RedisCluster<CharT>, CharT>
+    {
+    public:
+        typedef RedisBase<CharT> Redis;
+        typedef typename Redis::Command Command;
+        typedef typename Redis::Reply Reply;
+
+        static const size_t Slots = 16384;
+        static const int MaxRedirects = 16;
+
+    private:
+        typedef typename RedisFanOut<CharT>::Batches Batches;
+        typedef typename RedisFanOut<CharT>::Replies Replies;
+        typedef std::map<std::string, Redis*> Nodes;
+
+        // CRC16-CCITT (XMODEM) used by Redis Cluster for key slots
+        typedef boost::crc_optimal<16, 0x1021, 0, 0, false, false> Crc16;
+
+        mutable Nodes _nodes;
+        mutable std::vector<Redis*> _slots;
+        mutable bool _stale;
+        mutable std::string _key;
+        bool _lazy;
+        boost::chrono::milliseconds _connectTimeout;
+        boost::chrono::milliseconds _timeout;
+
+        RedisCluster(const RedisCluster<CharT>&);
+        RedisCluster<CharT>& operator=(const RedisCluster<CharT>&);
+
+        // Sends a command to the node serving slot and follows redirects,
+        // slot table is reloaded on next use when the command fails
+        class Route
+        {
+            const RedisCluster<CharT>& _cluster;
+            size_t _slot;
+            Redis* _node;
+            bool _asking;
+            int _redirects;
+            bool _done;
+            Reply _reply;
+
+            Route(const Route&);
+            Route& operator=(const Route&);
+
+        public:
+            Route(const RedisCluster<CharT>& cluster, size_t slot, Redis* node = 0, bool asking = false)
+                : _cluster(cluster), _slot(slot), _node(node), _asking(asking), _redirects(0), _done(false) { }
+
+            ~Route()
+            {
+                if (!_done)
+                {
+                    _cluster._stale = true;
+                }
+            }
+
+            // Node for the next attempt, ASKING is sent ahead after ASK redirect
+            const Redis& node()
+            {
+                if (_node == 0)
+                {
+                    _node = &_cluster.nodeFor(_slot);
+                }
+
+                if (_asking)
+                {
+                    _node->template beginCommand<resp::Asking>();
+                }
+
+                return *_node;
+            }
+
+            // Reads the reply, returns true when command must be sent again
+            bool redirected()
+            {
+                if (_asking)
+                {
+                    _node->endCommand();
+                }
+
+                _reply = _node->endCommand();
+
+                if (!_cluster.redirect(_reply, _slot, _node, _asking))
+                {
+                    _done = true;
+                    return false;
+                }
+
+                if (++_redirects > MaxRedirects)
+                {
+                    throw RedisException("Too many cluster redirects");
+                }
+
+                return true;
+            }
+
+            const Reply& reply() const
+            {
+                return _reply;
+            }
+        };
+
+        Redis& node(const std::string& host, int port) const
+        {
+            const std::string name = host + ":" + boost::lexical_cast<std::string>(port);
+            typename Nodes::iterator i = _nodes.find(name);
+
+            if (i == _nodes.end())
+            {
+                Redis* redis = new Redis(host, port);
+                redis->setLazyReplies(_lazy);
+                redis->setConnectTimeout(_connectTimeout);
+                redis->setTimeout(_timeout);
+
+                i = _nodes.insert(typename Nodes::value_type(name, redis)).first;
+            }
+
+            return *i->second;
+        }
+
+        Redis& nodeFor(size_t slot) const
+        {
+            if (_stale)
+            {
+                refresh();
+            }
+
+            if (_slots[slot] == 0)
+            {
+                throw RedisException("CLUSTERDOWN Hash slot not served");
+            }
+
+            return *_slots[slot];
+        }
+
+        void load(const Redis& from) const
+        {
+            Reply reply = from.doCommand(Command("CLUSTER") << "SLOTS");
+            std::vector<Redis*> slots(Slots, static_cast<Redis*>(0));
+
+            for (size_t i = 0; i < reply.size(); ++i)
+            {
+                // [start, end, [host, port, id], replicas...]
+                typename Redis::Element range = reply[i];
+                typename Redis::Element master = range[2];
+
+                const boost::int64_t start = range[0];
+                const boost::int64_t end = range[1];
+                const redisReply* host = master[0].get();
+                const boost::int64_t port = master[1];
+
+                if (start < 0 || start > end || end >= static_cast<boost::int64_t>(Slots))
+                {
+                    throw std::runtime_error("Invalid reply");
+                }
+
+                // empty host stands for the node that answered
+                Redis& redis = node(host->len != 0 ? std::string(host->str, host->len) : from.host(), static_cast<int>(port));
+
+                std::fill(slots.begin() + start, slots.begin() + end + 1, &redis);
+            }
+
+            _slots.swap(slots);
+        }
+
+        // Returns true for MOVED and ASK errors, node is then set to the target
+        bool redirect(const Reply& reply, size_t slot, Redis*& node, bool& asking) const
+        {
+            asking = false;
+
+            if (!reply.isError())
+            {
+                return false;
+            }
+
+            const redisReply* r = reply.get();
+            const bool moved = r->len > 6 && ::memcmp(r->str, "MOVED ", 6) == 0;
+            const bool ask = !moved && r->len > 4 && ::memcmp(r->str, "ASK ", 4) == 0;
+
+            if (!moved && !ask)
+            {
+                return false;
+            }
+
+            // "MOVED <slot> <host>:<port>"
+            const std::string error(r->str, r->len);
+            const size_t space = error.rfind(' ');
+            const size_t colon = error.rfind(':');
+
+            if (space == std::string::npos || colon == std::string::npos || colon < space)
+            {
+                throw RedisException(error);
+            }
+
+            int port;
+
+            try
+            {
+                port = boost::lexical_cast<int>(error.substr(colon + 1));
+            }
+            catch (const boost::bad_lexical_cast&)
+            {
+                throw RedisException(error);
+            }
+
+            node = &this->node(error.substr(space + 1, colon - space - 1), port);
+
+            if (moved)
+            {
+                _slots[slot] = node;
+                _stale = true;
+            }
+            else
+            {
+                asking = true;
+            }
+
+            return true;
+        }
+
+        size_t slotOf(const char* data, size_t size) const
+        {
+            RedisKeyCommands<RedisCluster<CharT>, CharT>::hashTag(data, size);
+
+            Crc16 crc;
+            crc.process_bytes(data, size);
+
+            return crc.checksum() & (Slots - 1);
+        }
+
+        size_t slotOf(const std::string& key) const
+        {
+            return slotOf(key.data(), key.size());
+        }
+
+        size_t slotOf(const std::wstring& key) const
+        {
+            RedisEncoding<wchar_t>::encode(key, _key);
+            return slotOf(_key);
+        }
+
+        size_t slotOf(const Command& command) const
+        {
+            return command.size() > 1 ? slotOf(command[1]) : 0;
+        }
+
+        std::vector<const Redis*> masters() const
+        {
+            if (_stale)
+            {
+                refresh();
+            }
+
+            std::vector<const Redis*> masters;
+
+            for (size_t slot = 0; slot < Slots; ++slot)
+            {
+                if (_slots[slot] != 0 && std::find(masters.begin(), masters.end(), _slots[slot]) == masters.end())
+                {
+                    masters.push_back(_slots[slot]);
+                }
+            }
+
+            return masters;
+        }
+
+        // Splits commands by node, sends them to all nodes before reading any
+        // reply and sends again redirected ones
+        void pipeline(const std::vector<const Command*>& commands, std::vector<Reply>& replies, int redirects) const
+        {
+            std::vector<size_t> slots(commands.size());
+            std::vector<const Redis*> connections;
+            std::vector<std::vector<size_t> > positions;
+            Batches batches;
+
+            for (size_t i = 0; i < commands.size(); ++i)
+            {
+                slots[i] = slotOf(*commands[i]);
+
+                const Redis* redis = &nodeFor(slots[i]);
+                const size_t n = std::find(connections.begin(), connections.end(), redis) - connections.begin();
+
+                if (n == connections.size())
+                {
+                    connections.push_back(redis);
+                    positions.resize(n + 1);
+                    batches.resize(n + 1);
+                }
+
+                positions[n].push_back(i);
+                batches[n].push_back(commands[i]);
+            }
+
+            Replies nodeReplies;
+
+            try
+            {
+                RedisFanOut<CharT>::dispatch(connections, batches, nodeReplies);
+            }
+            catch (const RedisException&)
+            {
+                _stale = true;
+                throw;
+            }
+
+            replies.resize(commands.size());
+
+            std::vector<const Command*> moved;
+            std::vector<size_t> movedAt;
+
+            for (size_t n = 0; n < connections.size(); ++n)
+            {
+                for (size_t j = 0; j < positions[n].size(); ++j)
+                {
+                    const size_t i = positions[n][j];
+
+                    Redis* target;
+                    bool asking;
+
+                    if (!redirect(nodeReplies[n][j], slots[i], target, asking))
+                    {
+                        replies[i].swap(nodeReplies[n][j]);
+                    }
+                    else if (asking)
+                    {
+                        replies[i] = send(*commands[i], slots[i], target, true);
+                    }
+                    else
+                    {
+                        moved.push_back(commands[i]);
+                        movedAt.push_back(i);
+                    }
+                }
+            }
+
+            if (!moved.empty())
+            {
+                if (redirects >= MaxRedirects)
+                {
+                    throw RedisException("Too many cluster redirects");
+                }
+
+                std::vector<Reply> movedReplies;
+                pipeline(moved, movedReplies, redirects + 1);
+
+                for (size_t i = 0; i < moved.size(); ++i)
+                {
+                    replies[movedAt[i]].swap(movedReplies[i]);
+                }
+            }
+        }
+
+        Reply send(const Command& command, size_t slot, Redis* node = 0, bool asking = false) const
+        {
+            Route route(*this, slot, node, asking);
+
+            do
+            {
+                route.node().beginCommand(command);
+            }
+            while (route.redirected());
+
+            return route.reply();
+        }
+
+        // One command per slot with the given keys, e.g. MGET or DEL
+        void splitBySlot(const char* name, const std::vector<std::basic_string<CharT> >& keys,
+                         std::vector<Command>& commands, std::vector<std::vector<size_t> >& positions) const
+        {
+            std::map<size_t, size_t> commandOf;
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                const size_t slot = slotOf(keys[i]);
+                std::map<size_t, size_t>::iterator c = commandOf.find(slot);
+
+                if (c == commandOf.end())
+                {
+                    c = commandOf.insert(std::make_pair(slot, commands.size())).first;
+                    commands.push_back(Command(name));
+                    positions.resize(commands.size());
+                }
+
+                commands[c->second] << keys[i];
+                positions[c->second].push_back(i);
+            }
+        }
+
+    public:
+        // Seed node, other nodes are discovered from the slot table
+        RedisCluster(const std::string& host, int port = 6379)
+            : _slots(Slots, static_cast<Redis*>(0)), _stale(true), _lazy(false),
+              _connectTimeout(0), _timeout(0)
+        {
+            node(host, port);
+        }
+
+        virtual ~RedisCluster()
+        {
+            for (typename Nodes::iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+            {
+                delete i->second;
+            }
+        }
+
+        // Additional seed node tried when the others are unreachable
+        void addNode(const std::string& host, int port = 6379)
+        {
+            node(host, port);
+        }
+
+        // Loads slot table from the first node that answers, a node sending
+        // a malformed table is skipped as an unreachable one is
+        void refresh() const
+        {
+            std::string error;
+
+            for (typename Nodes::const_iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+            {
+                try
+                {
+                    load(*i->second);
+                    _stale = false;
+
+                    return;
+                }
+                catch (const std::exception& e)
+                {
+                    error = e.what();
+                }
+            }
+
+            throw RedisException("Cluster slots unavailable: " + error);
+        }
+
+        // Connection of the master serving key
+        const Redis& nodeFor(const std::basic_string<CharT>& key) const
+        {
+            return nodeFor(slotOf(key));
+        }
+
+        size_t slotFor(const std::basic_string<CharT>& key) const
+        {
+            return slotOf(key);
+        }
+
+        void setLazyReplies(bool lazy)
+        {
+            _lazy = lazy;
+
+            for (typename Nodes::iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+            {
+                i->second->setLazyReplies(lazy);
+            }
+        }
+
+        // Connect and socket timeouts of known and later discovered nodes,
+        // 0 for none
+        void setConnectTimeout(boost::chrono::milliseconds timeout)
+        {
+            _connectTimeout = timeout;
+
+            for (typename Nodes::iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+            {
+                i->second->setConnectTimeout(timeout);
+            }
+        }
+
+        boost::chrono::milliseconds connectTimeout() const { return _connectTimeout; }
+
+        void setTimeout(boost::chrono::milliseconds timeout)
+        {
+            _timeout = timeout;
+
+            for (typename Nodes::iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+            {
+                i->second->setTimeout(timeout);
+            }
+        }
+
+        boost::chrono::milliseconds timeout() const { return _timeout; }
+
+        template<class C>
+        Reply keyCommand(const std::basic_string<CharT>& key) const
+        {
+            Route route(*this, slotOf(key));
+
+            do
+            {
+                route.node().template beginCommand<C>(key);
+            }
+            while (route.redirected());
+
+            return route.reply();
+        }
+
+        template<class C, class A2>
+        Reply keyCommand(const std::basic_string<CharT>& key, const A2& a2) const
+        {
+            Route route(*this, slotOf(key));
+
+            do
+            {
+                route.node().template beginCommand<C>(key, a2);
+            }
+            while (route.redirected());
+
+            return route.reply();
+        }
+
+        template<class C, class A2, class A3>
+        Reply keyCommand(const std::basic_string<CharT>& key, const A2& a2, const A3& a3) const
+        {
+            Route route(*this, slotOf(key));
+
+            do
+            {
+                route.node().template beginCommand<C>(key, a2, a3);
+            }
+            while (route.redirected());
+
+            return route.reply();
+        }
+
+        std::basic_string<CharT> ping() const
+        {
+            std::vector<const Redis*> nodes = masters();
+            std::basic_string<CharT> status;
+
+            for (size_t n = 0; n < nodes.size(); ++n)
+            {
+                status = nodes[n]->ping();
+            }
+
+            return status;
+        }
+
+        Reply keys(const std::basic_string<CharT>& pattern) const
+        {
+            Command command("KEYS");
+            command << pattern;
+
+            std::vector<const Redis*> nodes = masters();
+            Batches batches(nodes.size(), std::vector<const Command*>(1, &command));
+            Replies replies;
+
+            RedisFanOut<CharT>::dispatch(nodes, batches, replies);
+
+            std::vector<Reply> sources;
+
+            for (size_t n = 0; n < replies.size(); ++n)
+            {
+                sources.push_back(replies[n][0]);
+            }
+
+            return RedisMergedReply<CharT>::concat(sources);
+        }
+
+        Reply mget(const std::vector<std::basic_string<CharT> >& keys) const
+        {
+            std::vector<Command> commands;
+            std::vector<std::vector<size_t> > positions;
+            splitBySlot("MGET", keys, commands, positions);
+
+            std::vector<Reply> replies;
+            doPipeline(commands, replies);
+
+            RedisMergedReply<CharT> merged(keys.size());
+
+            for (size_t c = 0; c < commands.size(); ++c)
+            {
+                merged.add(replies[c], positions[c]);
+            }
+
+            return merged.release();
+        }
+
+        boost::int64_t del(const std::vector<std::basic_string<CharT> >& keys) const
+        {
+            std::vector<Command> commands;
+            std::vector<std::vector<size_t> > positions;
+            splitBySlot("DEL", keys, commands, positions);
+
+            std::vector<Reply> replies;
+            doPipeline(commands, replies);
+
+            boost::int64_t deleted = 0;
+
+            for (size_t c = 0; c < replies.size(); ++c)
+            {
+                deleted += (boost::int64_t)replies[c];
+            }
+
+            return deleted;
+        }
+
+        using RedisKeyCommands<RedisCluster<CharT>, CharT>::del;
+
+        // Commands are routed by their first argument after command name
+        Reply doCommand(const Command& command) const
+        {
+            return send(command, slotOf(command));
+        }
+
+        void doPipeline(const std::vector<Command>& commands) const
+        {
+            std::vector<Reply> replies;
+            doPipeline(commands, replies);
+        }
+
+        void doPipeline(const std::vector<Command>& commands, std::vector<Reply>& replies) const
+        {
+            std::vector<const Command*> pointers(commands.size());
+
+            for (size_t i = 0; i < commands.size(); ++i)
+            {
+                pointers[i] = &commands[i];
+            }
+
+            std::vector<Reply> result;
+            pipeline(pointers, result, 0);
+
+            const size_t first = replies.size();
+            replies.resize(first + result.size());
+
+            for (size_t i = 0; i < result.size(); ++i)
+            {
+                replies[first + i].swap(result[i]);
+            }
+        }
+
+        // All keys of the transaction must hash to the same slot
+        Reply doTransaction(const std::vector<Command>& commands) const
+        {
+            const Redis& redis = nodeFor(commands.empty() ? 0 : slotOf(commands[0]));
+
+            try
+            {
+                return redis.doTransaction(commands);
+            }
+            catch (const RedisException&)
+            {
+                _stale = true;
+                throw;
+            }
+        }
+    };
+
+    template<typename CharT>
+    const size_t RedisCluster<CharT>::Slots;
+
+    template<typename CharT>
+    const int RedisCluster<CharT>::MaxRedirects;
+
+    typedef RedisCluster<char> RedisClusterClient;
+    typedef RedisCluster<wchar_t> wRedisClusterClient;
+}
+
+#endif // HIREDISPP_CLUSTER_H
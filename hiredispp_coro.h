@@ -0,0 +1,462 @@
+/*
+ * hiredispp_coro.h
+ */
+
+#ifndef HIREDISPP_CORO_H
+#define HIREDISPP_CORO_H
+
+#if !defined(__cpp_impl_coroutine) || __cpp_impl_coroutine < 201902L
+#error "hiredispp_coro.h requires C++20 coroutines"
+#endif
+
+#include "hiredispp.h"
+#include "hiredispp_async.h"
+#include <coroutine>
+#include <exception>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace hiredispp
+{
+    // Command in flight from a suspended coroutine. The awaiter lives in the
+    // coroutine frame and completion handler only points to it, so awaiting
+    // a command allocates only the buffer of its encoded command, besides
+    // what hiredis does.
+    class RedisAwaiterBase
+    {
+        struct Resume
+        {
+            RedisAwaiterBase* awaiter;
+
+            void operator()(RedisConnectionAsync& ac, Redis::Element* reply) const
+            {
+                awaiter->complete(ac, reply);
+            }
+        };
+
+        RedisConnectionAsync* _ac;
+        Redis::Command _command;
+        Redis::Reply _reply;
+        bool _lost;
+        bool _timedOut;
+        std::coroutine_handle<> _handle;
+        size_t* _pending;
+
+        void complete(RedisConnectionAsync& ac, Redis::Element* reply)
+        {
+            if (reply)
+            {
+                _reply = ac.takeReply();
+            }
+            else
+            {
+                _lost = true;
+                _timedOut = ac.timedOut();
+            }
+
+            if (_pending == nullptr || --*_pending == 0)
+            {
+                _handle.resume();
+            }
+        }
+
+        template<typename... Awaiters>
+        friend class RedisWhenAll;
+
+        template<typename Awaiter>
+        friend class RedisWhenAllRange;
+
+        friend class RedisCoroConnection;
+
+    protected:
+        explicit RedisAwaiterBase(RedisConnectionAsync& ac)
+            : _ac(&ac), _lost(false), _timedOut(false), _pending(nullptr) { }
+
+        RedisAwaiterBase(RedisConnectionAsync& ac, Redis::Command&& command)
+            : _ac(&ac), _command(std::move(command)), _lost(false), _timedOut(false), _pending(nullptr) { }
+
+        // handle is resumed when the reply arrives, or when pending count of
+        // when_all drops to zero
+        void start(std::coroutine_handle<> handle, size_t* pending)
+        {
+            _handle = handle;
+            _pending = pending;
+            _ac->execAsyncCommand(_command, Resume{this});
+        }
+
+        // marks command not sent, for when_all continuing with the others
+        void fail()
+        {
+            _lost = true;
+        }
+
+        const Redis::Reply& reply() const
+        {
+            if (_timedOut)
+            {
+                throw RedisTimeoutException("Command timed out");
+            }
+
+            if (_lost)
+            {
+                throw RedisException("Connection lost");
+            }
+
+            _reply.checkError();
+            return _reply;
+        }
+
+    public:
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            start(handle, nullptr);
+        }
+    };
+
+    // Awaitable command resuming with the reply converted to T
+    template<typename T>
+    class RedisAwaiter : public RedisAwaiterBase
+    {
+    public:
+        typedef T Result;
+
+        explicit RedisAwaiter(RedisConnectionAsync& ac)
+            : RedisAwaiterBase(ac) { }
+
+        RedisAwaiter(RedisConnectionAsync& ac, Redis::Command&& command)
+            : RedisAwaiterBase(ac, std::move(command)) { }
+
+        T await_resume() const
+        {
+            return static_cast<T>(reply());
+        }
+    };
+
+    template<>
+    class RedisAwaiter<bool> : public RedisAwaiterBase
+    {
+    public:
+        typedef bool Result;
+
+        explicit RedisAwaiter(RedisConnectionAsync& ac)
+            : RedisAwaiterBase(ac) { }
+
+        RedisAwaiter(RedisConnectionAsync& ac, Redis::Command&& command)
+            : RedisAwaiterBase(ac, std::move(command)) { }
+
+        bool await_resume() const
+        {
+            return static_cast<boost::int64_t>(reply()) != 0;
+        }
+    };
+
+    template<>
+    class RedisAwaiter<void> : public RedisAwaiterBase
+    {
+    public:
+        // result of void command inside when_all
+        struct Result { };
+
+        explicit RedisAwaiter(RedisConnectionAsync& ac)
+            : RedisAwaiterBase(ac) { }
+
+        RedisAwaiter(RedisConnectionAsync& ac, Redis::Command&& command)
+            : RedisAwaiterBase(ac, std::move(command)) { }
+
+        void await_resume() const
+        {
+            reply();
+        }
+    };
+
+    namespace detail
+    {
+        template<typename Awaiter>
+        typename Awaiter::Result resumeResult(Awaiter& awaiter)
+        {
+            if constexpr (std::is_void_v<decltype(awaiter.await_resume())>)
+            {
+                awaiter.await_resume();
+                return typename Awaiter::Result();
+            }
+            else
+            {
+                return awaiter.await_resume();
+            }
+        }
+    }
+
+    // Sends all commands before suspending, resumes with the tuple of their
+    // results once every reply arrived; first failed command throws
+    template<typename... Awaiters>
+    class RedisWhenAll
+    {
+        std::tuple<Awaiters...> _awaiters;
+        size_t _pending;
+
+        template<typename Awaiter>
+        void start(Awaiter& awaiter, std::coroutine_handle<> handle)
+        {
+            try
+            {
+                awaiter.start(handle, &_pending);
+            }
+            catch (const RedisException&)
+            {
+                awaiter.fail();
+                --_pending;
+            }
+        }
+
+    public:
+        explicit RedisWhenAll(Awaiters&&... awaiters)
+            : _awaiters(std::move(awaiters)...), _pending(0) { }
+
+        bool await_ready() const noexcept
+        {
+            return sizeof...(Awaiters) == 0;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            // held while sending, no reply may resume the coroutine early
+            _pending = sizeof...(Awaiters) + 1;
+
+            std::apply([&](Awaiters&... a) { (start(a, handle), ...); }, _awaiters);
+
+            return --_pending != 0;
+        }
+
+        std::tuple<typename Awaiters::Result...> await_resume()
+        {
+            return std::apply([](Awaiters&... a)
+            {
+                return std::tuple<typename Awaiters::Result...>{ detail::resumeResult(a)... };
+            }, _awaiters);
+        }
+    };
+
+    // when_all over a range of awaiters of the same type, which must stay in
+    // place until resumed
+    template<typename Awaiter>
+    class RedisWhenAllRange
+    {
+        std::vector<Awaiter>& _awaiters;
+        size_t _pending;
+
+    public:
+        explicit RedisWhenAllRange(std::vector<Awaiter>& awaiters)
+            : _awaiters(awaiters), _pending(0) { }
+
+        bool await_ready() const noexcept
+        {
+            return _awaiters.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            _pending = _awaiters.size() + 1;
+
+            for (Awaiter& awaiter : _awaiters)
+            {
+                try
+                {
+                    awaiter.start(handle, &_pending);
+                }
+                catch (const RedisException&)
+                {
+                    awaiter.fail();
+                    --_pending;
+                }
+            }
+
+            return --_pending != 0;
+        }
+
+        std::vector<typename Awaiter::Result> await_resume()
+        {
+            std::vector<typename Awaiter::Result> results;
+            results.reserve(_awaiters.size());
+
+            for (Awaiter& awaiter : _awaiters)
+            {
+                results.push_back(detail::resumeResult(awaiter));
+            }
+
+            return results;
+        }
+    };
+
+    template<typename... Awaiters>
+    RedisWhenAll<Awaiters...> when_all(Awaiters&&... awaiters)
+    {
+        return RedisWhenAll<Awaiters...>(std::move(awaiters)...);
+    }
+
+    template<typename Awaiter>
+    RedisWhenAllRange<Awaiter> when_all(std::vector<Awaiter>& awaiters)
+    {
+        return RedisWhenAllRange<Awaiter>(awaiters);
+    }
+
+    // Eagerly started coroutine nobody waits for, its frame is released
+    // when it finishes. Exceptions must be handled inside the coroutine.
+    struct RedisCoroutine
+    {
+        struct promise_type
+        {
+            RedisCoroutine get_return_object() noexcept { return RedisCoroutine(); }
+            std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+            std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+            void return_void() noexcept { }
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    // Awaitable commands of a RedisConnectionAsync, used from coroutines
+    // running on the connection's event loop
+    //
+    //     std::string value = co_await conn.get("key");
+    //     auto [a, b] = co_await hiredispp::when_all(conn.get("a"), conn.incr("b"));
+    class RedisCoroConnection
+    {
+        RedisConnectionAsync& _ac;
+
+        typedef std::string String;
+
+        // command is encoded into the awaiter returned, its buffer is the
+        // one allocation of awaiting it
+        template<typename T, typename... Args>
+        RedisAwaiter<T> awaiter(const char* name, const Args&... args) const
+        {
+            RedisAwaiter<T> a(_ac);
+            ((a._command << name) << ... << args);
+            return a;
+        }
+
+    public:
+        explicit RedisCoroConnection(RedisConnectionAsync& ac)
+            : _ac(ac) { }
+
+        RedisConnectionAsync& connection() const { return _ac; }
+
+        RedisAwaiter<Redis::Reply> command(Redis::Command command) const
+        {
+            return RedisAwaiter<Redis::Reply>(_ac, std::move(command));
+        }
+
+        RedisAwaiter<String> ping() const
+        {
+            return awaiter<String>("PING");
+        }
+
+        RedisAwaiter<String> get(const String& key) const
+        {
+            return awaiter<String>("GET", key);
+        }
+
+        RedisAwaiter<Redis::Reply> mget(const std::vector<String>& keys) const
+        {
+            return awaiter<Redis::Reply>("MGET", keys);
+        }
+
+        RedisAwaiter<void> set(const String& key, const String& value) const
+        {
+            return awaiter<void>("SET", key, value);
+        }
+
+        RedisAwaiter<boost::int64_t> setnx(const String& key, const String& value) const
+        {
+            return awaiter<boost::int64_t>("SETNX", key, value);
+        }
+
+        RedisAwaiter<bool> exists(const String& key) const
+        {
+            return awaiter<bool>("EXISTS", key);
+        }
+
+        RedisAwaiter<boost::int64_t> del(const String& key) const
+        {
+            return awaiter<boost::int64_t>("DEL", key);
+        }
+
+        RedisAwaiter<boost::int64_t> incr(const String& key) const
+        {
+            return awaiter<boost::int64_t>("INCR", key);
+        }
+
+        RedisAwaiter<bool> expire(const String& key, boost::int64_t seconds) const
+        {
+            return awaiter<bool>("EXPIRE", key, seconds);
+        }
+
+        RedisAwaiter<String> hget(const String& key, const String& field) const
+        {
+            return awaiter<String>("HGET", key, field);
+        }
+
+        RedisAwaiter<boost::int64_t> hset(const String& key, const String& field, const String& value) const
+        {
+            return awaiter<boost::int64_t>("HSET", key, field, value);
+        }
+
+        RedisAwaiter<Redis::Reply> hgetall(const String& key) const
+        {
+            return awaiter<Redis::Reply>("HGETALL", key);
+        }
+
+        RedisAwaiter<boost::int64_t> lpush(const String& key, const String& value) const
+        {
+            return awaiter<boost::int64_t>("LPUSH", key, value);
+        }
+
+        RedisAwaiter<boost::int64_t> rpush(const String& key, const String& value) const
+        {
+            return awaiter<boost::int64_t>("RPUSH", key, value);
+        }
+
+        RedisAwaiter<String> lpop(const String& key) const
+        {
+            return awaiter<String>("LPOP", key);
+        }
+
+        RedisAwaiter<String> rpop(const String& key) const
+        {
+            return awaiter<String>("RPOP", key);
+        }
+
+        RedisAwaiter<Redis::Reply> lrange(const String& key, boost::int64_t start, boost::int64_t end) const
+        {
+            return awaiter<Redis::Reply>("LRANGE", key, start, end);
+        }
+
+        RedisAwaiter<boost::int64_t> sadd(const String& key, const String& member) const
+        {
+            return awaiter<boost::int64_t>("SADD", key, member);
+        }
+
+        RedisAwaiter<bool> sismember(const String& key, const String& member) const
+        {
+            return awaiter<bool>("SISMEMBER", key, member);
+        }
+
+        RedisAwaiter<Redis::Reply> smembers(const String& key) const
+        {
+            return awaiter<Redis::Reply>("SMEMBERS", key);
+        }
+
+        RedisAwaiter<Redis::Reply> zrange(const String& key, boost::int64_t start, boost::int64_t end) const
+        {
+            return awaiter<Redis::Reply>("ZRANGE", key, start, end);
+        }
+    };
+}
+
+#endif // HIREDISPP_CORO_H
@@ -0,0 +1,312 @@
+/*
+ * hiredispp_epoll.h
+ */
+
+#ifndef HIREDISPP_EPOLL_H
+#define HIREDISPP_EPOLL_H
+
+#include "hiredispp.h"
+#include "hiredispp_async.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <map>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/chrono/ceil.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace hiredispp
+{
+    // Level triggered epoll loop without any dependency, meant to be run one
+    // per thread. Connections attached to the loop must be used from the
+    // thread calling run(), only stop() and wakeup() may be called from other
+    // threads. The loop must outlive the attached connections.
+    class RedisEpollLoop : public RedisEventLoop, boost::noncopyable
+    {
+        struct Events
+        {
+            RedisEpollLoop* loop;
+            redisAsyncContext* context;
+            int fd;
+            boost::uint32_t events;
+        };
+
+        typedef boost::chrono::steady_clock Clock;
+
+        class Timer;
+        typedef std::multimap<Clock::time_point, Timer*> Timers;
+
+        class Timer : public RedisTimer
+        {
+            friend class RedisEpollLoop;
+
+            RedisEpollLoop& _loop;
+            void (*_expired)(void*);
+            void* _data;
+            bool _armed;
+            Timers::iterator _position;
+
+        public:
+            Timer(RedisEpollLoop& loop, void (*fn)(void*), void* data)
+                : _loop(loop), _expired(fn), _data(data), _armed(false) { }
+
+            ~Timer()
+            {
+                stop();
+            }
+
+            virtual void start(boost::chrono::milliseconds delay)
+            {
+                stop();
+                _position = _loop._timers.insert(std::make_pair(Clock::now() + delay, this));
+                _armed = true;
+            }
+
+            virtual void stop()
+            {
+                if (_armed)
+                {
+                    _loop._timers.erase(_position);
+                    _armed = false;
+                }
+            }
+        };
+
+        int _epoll;
+        int _wakeup;
+        boost::atomic<bool> _stopped;
+        std::vector<epoll_event> _ready;
+        Timers _timers;
+
+        // detached while their events may still be in _ready
+        std::vector<Events*> _retired;
+
+        void update(Events* e, boost::uint32_t events)
+        {
+            if (events == e->events)
+            {
+                return;
+            }
+
+            epoll_event ev;
+            ev.events = events;
+            ev.data.ptr = e;
+
+            const int op = (e->events == 0) ? EPOLL_CTL_ADD :
+                           (events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+            // failure is reported by hiredis on the next read or write
+            ::epoll_ctl(_epoll, op, e->fd, &ev);
+            e->events = events;
+        }
+
+        static void addRead(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            e->loop->update(e, e->events | EPOLLIN);
+        }
+
+        static void delRead(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            e->loop->update(e, e->events & ~EPOLLIN);
+        }
+
+        static void addWrite(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            e->loop->update(e, e->events | EPOLLOUT);
+        }
+
+        static void delWrite(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            e->loop->update(e, e->events & ~EPOLLOUT);
+        }
+
+        static void cleanup(void* privdata)
+        {
+            Events* e = static_cast<Events*>(privdata);
+            e->loop->update(e, 0);
+            e->context = NULL;
+            e->loop->_retired.push_back(e);
+        }
+
+        void deleteRetired()
+        {
+            for (size_t i = 0; i < _retired.size(); ++i)
+            {
+                delete _retired[i];
+            }
+
+            _retired.clear();
+        }
+
+        // timeout shortened to the first timer deadline
+        int waitTime(int timeout) const
+        {
+            if (_timers.empty())
+            {
+                return timeout;
+            }
+
+            const Clock::duration left = _timers.begin()->first - Clock::now();
+            const boost::int64_t ms = (left <= Clock::duration::zero()) ? 0 :
+                boost::chrono::ceil<boost::chrono::milliseconds>(left).count();
+
+            return (timeout < 0 || ms < timeout) ? static_cast<int>(ms) : timeout;
+        }
+
+        void expireTimers()
+        {
+            const Clock::time_point now = Clock::now();
+
+            while (!_timers.empty() && _timers.begin()->first <= now)
+            {
+                Timer* t = _timers.begin()->second;
+                _timers.erase(_timers.begin());
+                t->_armed = false;
+                t->_expired(t->_data);
+            }
+        }
+
+    public:
+        explicit RedisEpollLoop(size_t maxEvents = 64)
+            : _epoll(::epoll_create1(EPOLL_CLOEXEC)),
+              _wakeup(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+              _stopped(false), _ready(maxEvents > 0 ? maxEvents : 1)
+        {
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = NULL;
+
+            if (_epoll < 0 || _wakeup < 0 ||
+                ::epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &ev) != 0)
+            {
+                if (_epoll >= 0) ::close(_epoll);
+                if (_wakeup >= 0) ::close(_wakeup);
+                throw RedisException("Can't create epoll loop");
+            }
+        }
+
+        ~RedisEpollLoop()
+        {
+            deleteRetired();
+            ::close(_wakeup);
+            ::close(_epoll);
+        }
+
+        virtual bool attach(redisAsyncContext* ac)
+        {
+            if (ac->ev.data != NULL)
+            {
+                return false;
+            }
+
+            Events* e = new Events;
+            e->loop = this;
+            e->context = ac;
+            e->fd = ac->c.fd;
+            e->events = 0;
+
+            ac->ev.addRead = addRead;
+            ac->ev.delRead = delRead;
+            ac->ev.addWrite = addWrite;
+            ac->ev.delWrite = delWrite;
+            ac->ev.cleanup = cleanup;
+            ac->ev.data = e;
+
+            return true;
+        }
+
+        virtual RedisTimer* createTimer(void (*expired)(void*), void* data)
+        {
+            return new Timer(*this, expired, data);
+        }
+
+        // Descriptor becoming readable when the loop has work, to nest the
+        // loop in another one; runOnce(0) is then called on readiness.
+        // Timers do not make it readable.
+        int fd() const { return _epoll; }
+
+        // Waits up to timeout milliseconds, -1 for no limit, and handles
+        // ready connections and expired timers. Returns the number of
+        // events handled.
+        int runOnce(int timeout = -1)
+        {
+            const int n = ::epoll_wait(_epoll, &_ready[0], static_cast<int>(_ready.size()),
+                                       waitTime(timeout));
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    return 0;
+                }
+
+                throw RedisException("epoll_wait failed");
+            }
+
+            for (int i = 0; i < n; ++i)
+            {
+                Events* e = static_cast<Events*>(_ready[i].data.ptr);
+                const boost::uint32_t events = _ready[i].events;
+
+                if (e == NULL)
+                {
+                    boost::uint64_t value;
+                    while (::read(_wakeup, &value, sizeof(value)) > 0) { }
+                    continue;
+                }
+
+                // either handler may free the context, which retires e
+                if (e->context && (e->events & EPOLLIN) &&
+                    (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                {
+                    redisAsyncHandleRead(e->context);
+                }
+
+                if (e->context && (e->events & EPOLLOUT) &&
+                    (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                {
+                    redisAsyncHandleWrite(e->context);
+                }
+            }
+
+            expireTimers();
+            deleteRetired();
+            return n;
+        }
+
+        // Runs until stop() is called
+        void run()
+        {
+            while (!_stopped.load(boost::memory_order_acquire))
+            {
+                runOnce();
+            }
+
+            _stopped.store(false, boost::memory_order_relaxed);
+        }
+
+        void stop()
+        {
+            _stopped.store(true, boost::memory_order_release);
+            wakeup();
+        }
+
+        // Interrupts a runOnce() waiting in another thread
+        void wakeup()
+        {
+            const boost::uint64_t one = 1;
+            ssize_t r = ::write(_wakeup, &one, sizeof(one));
+            (void)r;
+        }
+    };
+}
+
+#endif // HIREDISPP_EPOLL_H
@@ -0,0 +1,2164 @@
+/*
+ * hiredispp_mock.h
+ */
+
+#ifndef HIREDISPP_MOCK_H
+#define HIREDISPP_MOCK_H
+
+#include "hiredispp.h"
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/random.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace hiredispp
+{
+    struct RedisMockConfig
+    {
+        // Listening address, port 0 picks a free port; server listens on
+        // unixSocket instead when it is not empty
+        std::string host;
+        int port;
+        std::string unixSocket;
+
+        // Each reply is held back by latency plus up to jitter, replies
+        // of a connection keep their order
+        boost::chrono::microseconds latency;
+        boost::chrono::microseconds jitter;
+
+        // GET and MGET of missing keys reply with a value of this size
+        // instead of nil, so reads need no preloaded data
+        size_t valueSize;
+
+        // Probability of a command being answered with an error instead of
+        // being executed, and of the connection being closed on a command
+        double errorRate;
+        double disconnectRate;
+
+        // Seed of latency jitter and injected faults
+        boost::uint32_t seed;
+
+        RedisMockConfig()
+            : host("127.0.0.1"), port(0), latency(0), jitter(0), valueSize(0),
+              errorRate(0), disconnectRate(0), seed(1) { }
+    };
+
+    // In-memory RESP server for tests and benchmarks, running on its own
+    // thread. Implements the commands of RedisBase on strings, lists, sets,
+    // hashes and sorted sets, with MULTI/EXEC; keys do not expire. Clients
+    // switching to RESP3 with HELLO 3 get maps, sets, doubles and nulls.
+    //
+    //     hiredispp::RedisMockServer server;
+    //     hiredispp::Redis r("127.0.0.1", server.port());
+    class RedisMockServer : boost::noncopyable
+    {
+        typedef boost::chrono::steady_clock Clock;
+        typedef std::vector<std::string> Args;
+
+        enum Type { String, List, Set, Hash, ZSet };
+
+        struct Value
+        {
+            Type type;
+            std::string string;
+            std::deque<std::string> list;
+            std::set<std::string> set;
+            std::map<std::string, std::string> hash;
+            std::map<std::string, double> scores;
+            std::set<std::pair<double, std::string> > order;
+
+            explicit Value(Type t)
+                : type(t) { }
+        };
+
+        typedef std::map<std::string, Value> Database;
+
+        // Error reply of a command
+        struct Error
+        {
+            std::string message;
+
+            explicit Error(const std::string& m)
+                : message(m) { }
+        };
+
+        struct Client
+        {
+            int fd;
+            std::string in;
+            size_t parsed;
+            Args args;
+            std::string out;
+            size_t written;
+
+            // bytes of out which may be written, the rest waits for
+            // the due time of its reply
+            size_t ready;
+            std::deque<std::pair<Clock::time_point, size_t> > delayed;
+
+            int db;
+            int protocol;
+            bool multi;
+            bool multiFailed;
+            std::vector<Args> queued;
+            bool closing;
+            bool writing;
+
+            explicit Client(int f)
+                : fd(f), parsed(0), written(0), ready(0), db(0), protocol(2),
+                  multi(false), multiFailed(false), closing(false), writing(false) { }
+        };
+
+        typedef void (RedisMockServer::*Handler)(Client&, const Args&);
+
+        struct Command
+        {
+            Handler handler;
+
+            // exact number of arguments with the name, at least -arity
+            // when negative
+            int arity;
+        };
+
+        static const int Databases = 16;
+
+        RedisMockConfig _config;
+        RedisMockConfig _next;
+        boost::mutex _mutex;
+        boost::atomic<bool> _reconfigure;
+        boost::atomic<bool> _disconnect;
+        boost::atomic<bool> _stopping;
+        boost::atomic<boost::uint64_t> _commands;
+        boost::atomic<size_t> _connections;
+
+        int _listen;
+        int _epoll;
+        int _wakeup;
+        int _timer;
+        int _port;
+
+        std::map<std::string, Command> _table;
+        std::map<int, Client*> _clients;
+        std::vector<Client*> _closed;
+        std::vector<Database> _databases;
+        boost::random::mt19937 _random;
+        Clock::time_point _armed;
+        Client* _current;
+        std::string _reply;
+        boost::thread _thread;
+
+        // Reply encoding, RESP3 types fall back to their RESP2 form for
+        // clients which did not send HELLO 3
+
+        bool resp3() const
+        {
+            return _current->protocol == 3;
+        }
+
+        void status(const char* s)
+        {
+            _reply.push_back('+');
+            _reply.append(s);
+            _reply.append("\r\n", 2);
+        }
+
+        void integer(boost::int64_t v)
+        {
+            char buffer[RedisProtocol::HeaderSpace];
+            char* end = buffer + sizeof(buffer);
+            char* begin = RedisProtocol::formatInteger(v, end);
+
+            _reply.push_back(':');
+            _reply.append(begin, end - begin);
+            _reply.append("\r\n", 2);
+        }
+
+        void bulk(const std::string& s)
+        {
+            RedisProtocol::appendBulk(_reply, s.data(), s.size());
+        }
+
+        void score(double v)
+        {
+            char buffer[32];
+            const size_t size = RedisProtocol::formatDouble(v, buffer, sizeof(buffer));
+
+            if (resp3())
+            {
+                _reply.push_back(',');
+                _reply.append(buffer, size);
+                _reply.append("\r\n", 2);
+            }
+            else
+            {
+                RedisProtocol::appendBulk(_reply, buffer, size);
+            }
+        }
+
+        void text(const std::string& s)
+        {
+            if (resp3())
+            {
+                aggregate('=', s.size() + 4);
+                _reply.append("txt:", 4);
+                _reply.append(s);
+                _reply.append("\r\n", 2);
+            }
+            else
+            {
+                bulk(s);
+            }
+        }
+
+        void nil()
+        {
+            if (resp3())
+            {
+                _reply.append("_\r\n", 3);
+            }
+            else
+            {
+                _reply.append("$-1\r\n", 5);
+            }
+        }
+
+        // Header of type with count n, also used for verbatim string length
+        void aggregate(char type, size_t n)
+        {
+            char buffer[RedisProtocol::HeaderSpace];
+            char* end = buffer + sizeof(buffer);
+            char* begin = RedisProtocol::formatUnsigned(n, end);
+
+            _reply.push_back(type);
+            _reply.append(begin, end - begin);
+            _reply.append("\r\n", 2);
+        }
+
+        void array(size_t n)
+        {
+            aggregate('*', n);
+        }
+
+        // n pairs, or 2n elements of a flat array
+        void map(size_t n)
+        {
+            if (resp3())
+            {
+                aggregate('%', n);
+            }
+            else
+            {
+                array(2 * n);
+            }
+        }
+
+        void set(size_t n)
+        {
+            aggregate(resp3() ? '~' : '*', n);
+        }
+
+        void missing()
+        {
+            if (_config.valueSize > 0)
+            {
+                _reply.push_back('$');
+                char buffer[RedisProtocol::HeaderSpace];
+                char* end = buffer + sizeof(buffer);
+                char* begin = RedisProtocol::formatUnsigned(_config.valueSize, end);
+                _reply.append(begin, end - begin);
+                _reply.append("\r\n", 2);
+                _reply.append(_config.valueSize, 'x');
+                _reply.append("\r\n", 2);
+            }
+            else
+            {
+                nil();
+            }
+        }
+
+        // Arguments
+
+        static boost::int64_t toInteger(const std::string& s)
+        {
+            char* end = 0;
+            errno = 0;
+            const long long v = ::strtoll(s.c_str(), &end, 10);
+
+            if (s.empty() || *end != '\0' || errno == ERANGE)
+            {
+                throw Error("ERR value is not an integer or out of range");
+            }
+
+            return v;
+        }
+
+        static double toDouble(const std::string& s)
+        {
+            if (s == "+inf" || s == "inf")
+            {
+                return std::numeric_limits<double>::infinity();
+            }
+
+            if (s == "-inf")
+            {
+                return -std::numeric_limits<double>::infinity();
+            }
+
+            char* end = 0;
+            const double v = ::strtod(s.c_str(), &end);
+
+            if (s.empty() || *end != '\0' || v != v)
+            {
+                throw Error("ERR value is not a valid float");
+            }
+
+            return v;
+        }
+
+        // Score bound of Z*RANGEBYSCORE, "(" makes it exclusive
+        static double toBound(const std::string& s, bool& exclusive)
+        {
+            exclusive = !s.empty() && s[0] == '(';
+            return toDouble(exclusive ? s.substr(1) : s);
+        }
+
+        // Redis glob pattern of KEYS
+        static bool match(const char* p, const char* s)
+        {
+            for (; *p; ++p)
+            {
+                switch (*p)
+                {
+                case '*':
+                    for (; *s; ++s)
+                    {
+                        if (match(p + 1, s))
+                        {
+                            return true;
+                        }
+                    }
+                    return match(p + 1, s);
+
+                case '?':
+                    if (!*s++)
+                    {
+                        return false;
+                    }
+                    break;
+
+                case '[':
+                {
+                    const bool negate = (p[1] == '^');
+                    bool found = false;
+
+                    for (p += negate ? 2 : 1; *p && *p != ']'; ++p)
+                    {
+                        if (*p == '\\' && p[1])
+                        {
+                            found |= (*++p == *s);
+                        }
+                        else if (p[1] == '-' && p[2] && p[2] != ']')
+                        {
+                            found |= (*s >= *p && *s <= p[2]);
+                            p += 2;
+                        }
+                        else
+                        {
+                            found |= (*p == *s);
+                        }
+                    }
+
+                    if (!*p || !*s || found == negate)
+                    {
+                        return false;
+                    }
+
+                    ++s;
+                    break;
+                }
+
+                case '\\':
+                    if (p[1])
+                    {
+                        ++p;
+                    }
+                    // fall through
+
+                default:
+                    if (*p != *s++)
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            return *s == '\0';
+        }
+
+        // Keyspace
+
+        Database& db()
+        {
+            return _databases[_current->db];
+        }
+
+        Value* find(const std::string& key, Type type)
+        {
+            Database::iterator i = db().find(key);
+
+            if (i == db().end())
+            {
+                return 0;
+            }
+
+            if (i->second.type != type)
+            {
+                throw Error("WRONGTYPE Operation against a key holding the wrong kind of value");
+            }
+
+            return &i->second;
+        }
+
+        Value& create(const std::string& key, Type type)
+        {
+            Value* v = find(key, type);
+            return v ? *v : db().insert(std::make_pair(key, Value(type))).first->second;
+        }
+
+        // Empty containers are removed, as by Redis
+        void prune(const std::string& key, const Value& v)
+        {
+            if (v.list.empty() && v.set.empty() && v.hash.empty() && v.scores.empty() && v.type != String)
+            {
+                db().erase(key);
+            }
+        }
+
+        // Clamps start and stop of LRANGE and ZRANGE to [0, size)
+        static bool range(boost::int64_t& start, boost::int64_t& stop, size_t size)
+        {
+            const boost::int64_t n = static_cast<boost::int64_t>(size);
+
+            if (start < 0) start += n;
+            if (stop < 0) stop += n;
+            if (start < 0) start = 0;
+            if (stop >= n) stop = n - 1;
+
+            return start <= stop && start < n;
+        }
+
+        // Connection and server commands
+
+        void cmdPing(Client&, const Args& a)
+        {
+            if (a.size() > 1)
+            {
+                bulk(a[1]);
+            }
+            else
+            {
+                status("PONG");
+            }
+        }
+
+        void cmdEcho(Client&, const Args& a)
+        {
+            bulk(a[1]);
+        }
+
+        void cmdQuit(Client& c, const Args&)
+        {
+            status("OK");
+            c.closing = true;
+        }
+
+        void cmdSelect(Client& c, const Args& a)
+        {
+            const boost::int64_t n = toInteger(a[1]);
+
+            if (n < 0 || n >= Databases)
+            {
+                throw Error("ERR DB index is out of range");
+            }
+
+            c.db = static_cast<int>(n);
+            status("OK");
+        }
+
+        void cmdInfo(Client&, const Args&)
+        {
+            std::string info = "# Server\r\nredis_version:7.0.0\r\nredis_mode:standalone\r\n"
+                "# Replication\r\nrole:master\r\n"
+                "# Clients\r\nconnected_clients:" +
+                boost::lexical_cast<std::string>(_clients.size()) + "\r\n# Keyspace\r\n";
+
+            for (int i = 0; i < Databases; ++i)
+            {
+                if (!_databases[i].empty())
+                {
+                    info += "db" + boost::lexical_cast<std::string>(i) + ":keys=" +
+                        boost::lexical_cast<std::string>(_databases[i].size()) + ",expires=0\r\n";
+                }
+            }
+
+            text(info);
+        }
+
+        void cmdHello(Client& c, const Args& a)
+        {
+            if (a.size() > 1)
+            {
+                const boost::int64_t protocol = toInteger(a[1]);
+
+                if (protocol != 2 && protocol != 3)
+                {
+                    throw Error("NOPROTO unsupported protocol version");
+                }
+
+                c.protocol = static_cast<int>(protocol);
+            }
+
+            map(7);
+            bulk("server");
+            bulk("redis");
+            bulk("version");
+            bulk("7.0.0");
+            bulk("proto");
+            integer(c.protocol);
+            bulk("id");
+            integer(c.fd);
+            bulk("mode");
+            bulk("standalone");
+            bulk("role");
+            bulk("master");
+            bulk("modules");
+            array(0);
+        }
+
+        void cmdDbsize(Client&, const Args&)
+        {
+            integer(db().size());
+        }
+
+        void cmdFlushdb(Client&, const Args&)
+        {
+            db().clear();
+            status("OK");
+        }
+
+        void cmdFlushall(Client&, const Args&)
+        {
+            for (int i = 0; i < Databases; ++i)
+            {
+                _databases[i].clear();
+            }
+
+            status("OK");
+        }
+
+        // Keys
+
+        void cmdDel(Client&, const Args& a)
+        {
+            boost::int64_t n = 0;
+
+            for (size_t i = 1; i < a.size(); ++i)
+            {
+                n += db().erase(a[i]);
+            }
+
+            integer(n);
+        }
+
+        void cmdExists(Client&, const Args& a)
+        {
+            boost::int64_t n = 0;
+
+            for (size_t i = 1; i < a.size(); ++i)
+            {
+                n += db().count(a[i]);
+            }
+
+            integer(n);
+        }
+
+        void cmdKeys(Client&, const Args& a)
+        {
+            std::vector<const std::string*> keys;
+
+            for (Database::const_iterator i = db().begin(); i != db().end(); ++i)
+            {
+                if (match(a[1].c_str(), i->first.c_str()))
+                {
+                    keys.push_back(&i->first);
+                }
+            }
+
+            array(keys.size());
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                bulk(*keys[i]);
+            }
+        }
+
+        void cmdType(Client&, const Args& a)
+        {
+            static const char* const names[] = { "string", "list", "set", "hash", "zset" };
+            Database::const_iterator i = db().find(a[1]);
+
+            status(i == db().end() ? "none" : names[i->second.type]);
+        }
+
+        // Strings
+
+        void cmdGet(Client&, const Args& a)
+        {
+            Value* v = find(a[1], String);
+
+            if (v)
+            {
+                bulk(v->string);
+            }
+            else
+            {
+                missing();
+            }
+        }
+
+        void cmdSet(Client&, const Args& a)
+        {
+            bool nx = false, xx = false;
+
+            for (size_t i = 3; i < a.size(); ++i)
+            {
+                std::string option = a[i];
+                std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+
+                if (option == "NX")
+                {
+                    nx = true;
+                }
+                else if (option == "XX")
+                {
+                    xx = true;
+                }
+                else if ((option == "EX" || option == "PX") && i + 1 < a.size())
+                {
+                    // accepted, keys do not expire
+                    toInteger(a[++i]);
+                }
+                else
+                {
+                    throw Error("ERR syntax error");
+                }
+            }
+
+            const bool exists = db().count(a[1]) != 0;
+
+            if ((nx && exists) || (xx && !exists))
+            {
+                nil();
+                return;
+            }
+
+            Value& v = db().insert(std::make_pair(a[1], Value(String))).first->second;
+            v = Value(String);
+            v.string = a[2];
+            status("OK");
+        }
+
+        void cmdSetnx(Client&, const Args& a)
+        {
+            if (db().count(a[1]))
+            {
+                integer(0);
+                return;
+            }
+
+            create(a[1], String).string = a[2];
+            integer(1);
+        }
+
+        void cmdMget(Client&, const Args& a)
+        {
+            array(a.size() - 1);
+
+            for (size_t i = 1; i < a.size(); ++i)
+            {
+                Database::const_iterator v = db().find(a[i]);
+
+                if (v != db().end() && v->second.type == String)
+                {
+                    bulk(v->second.string);
+                }
+                else
+                {
+                    missing();
+                }
+            }
+        }
+
+        void cmdMset(Client&, const Args& a)
+        {
+            if (a.size() % 2 == 0)
+            {
+                throw Error("ERR wrong number of arguments for 'mset' command");
+            }
+
+            for (size_t i = 1; i < a.size(); i += 2)
+            {
+                Value& v = db().insert(std::make_pair(a[i], Value(String))).first->second;
+                v = Value(String);
+                v.string = a[i + 1];
+            }
+
+            status("OK");
+        }
+
+        void incrementBy(const std::string& key, boost::int64_t by)
+        {
+            Value& v = create(key, String);
+            const boost::int64_t n = (v.string.empty() ? 0 : toInteger(v.string)) + by;
+
+            v.string = boost::lexical_cast<std::string>(n);
+            integer(n);
+        }
+
+        void cmdIncr(Client&, const Args& a)
+        {
+            incrementBy(a[1], 1);
+        }
+
+        void cmdIncrby(Client&, const Args& a)
+        {
+            incrementBy(a[1], toInteger(a[2]));
+        }
+
+        void cmdDecr(Client&, const Args& a)
+        {
+            incrementBy(a[1], -1);
+        }
+
+        void cmdDecrby(Client&, const Args& a)
+        {
+            incrementBy(a[1], -toInteger(a[2]));
+        }
+
+        void cmdAppend(Client&, const Args& a)
+        {
+            Value& v = create(a[1], String);
+            v.string += a[2];
+            integer(v.string.size());
+        }
+
+        void cmdStrlen(Client&, const Args& a)
+        {
+            Value* v = find(a[1], String);
+            integer(v ? v->string.size() : 0);
+        }
+
+        // Lists
+
+        void push(const Args& a, bool left)
+        {
+            Value& v = create(a[1], List);
+
+            for (size_t i = 2; i < a.size(); ++i)
+            {
+                if (left)
+                {
+                    v.list.push_front(a[i]);
+                }
+                else
+                {
+                    v.list.push_back(a[i]);
+                }
+            }
+
+            integer(v.list.size());
+        }
+
+        void pop(const Args& a, bool left)
+        {
+            Value* v = find(a[1], List);
+
+            if (v == 0)
+            {
+                nil();
+                return;
+            }
+
+            bulk(left ? v->list.front() : v->list.back());
+
+            if (left)
+            {
+                v->list.pop_front();
+            }
+            else
+            {
+                v->list.pop_back();
+            }
+
+            prune(a[1], *v);
+        }
+
+        void cmdLpush(Client&, const Args& a) { push(a, true); }
+        void cmdRpush(Client&, const Args& a) { push(a, false); }
+        void cmdLpop(Client&, const Args& a) { pop(a, true); }
+        void cmdRpop(Client&, const Args& a) { pop(a, false); }
+
+        void cmdLlen(Client&, const Args& a)
+        {
+            Value* v = find(a[1], List);
+            integer(v ? v->list.size() : 0);
+        }
+
+        void cmdLindex(Client&, const Args& a)
+        {
+            Value* v = find(a[1], List);
+            boost::int64_t i = toInteger(a[2]);
+
+            if (v && i < 0)
+            {
+                i += v->list.size();
+            }
+
+            if (v == 0 || i < 0 || i >= static_cast<boost::int64_t>(v->list.size()))
+            {
+                nil();
+            }
+            else
+            {
+                bulk(v->list[i]);
+            }
+        }
+
+        void cmdLrange(Client&, const Args& a)
+        {
+            Value* v = find(a[1], List);
+            boost::int64_t start = toInteger(a[2]), stop = toInteger(a[3]);
+
+            if (v == 0 || !range(start, stop, v->list.size()))
+            {
+                array(0);
+                return;
+            }
+
+            array(stop - start + 1);
+
+            for (boost::int64_t i = start; i <= stop; ++i)
+            {
+                bulk(v->list[i]);
+            }
+        }
+
+        // Hashes
+
+        void cmdHget(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Hash);
+            std::map<std::string, std::string>::const_iterator i;
+
+            if (v && (i = v->hash.find(a[2])) != v->hash.end())
+            {
+                bulk(i->second);
+            }
+            else
+            {
+                nil();
+            }
+        }
+
+        void cmdHmget(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Hash);
+
+            array(a.size() - 2);
+
+            for (size_t f = 2; f < a.size(); ++f)
+            {
+                std::map<std::string, std::string>::const_iterator i;
+
+                if (v && (i = v->hash.find(a[f])) != v->hash.end())
+                {
+                    bulk(i->second);
+                }
+                else
+                {
+                    nil();
+                }
+            }
+        }
+
+        void cmdHset(Client&, const Args& a)
+        {
+            if (a.size() % 2 != 0)
+            {
+                throw Error("ERR wrong number of arguments for 'hset' command");
+            }
+
+            Value& v = create(a[1], Hash);
+            boost::int64_t added = 0;
+
+            for (size_t i = 2; i < a.size(); i += 2)
+            {
+                added += v.hash.insert(std::make_pair(a[i], std::string())).second;
+                v.hash[a[i]] = a[i + 1];
+            }
+
+            integer(added);
+        }
+
+        void cmdHmset(Client& c, const Args& a)
+        {
+            const size_t mark = _reply.size();
+
+            cmdHset(c, a);
+            _reply.resize(mark);
+            status("OK");
+        }
+
+        void cmdHsetnx(Client&, const Args& a)
+        {
+            Value& v = create(a[1], Hash);
+            integer(v.hash.insert(std::make_pair(a[2], a[3])).second);
+        }
+
+        void cmdHdel(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Hash);
+            boost::int64_t n = 0;
+
+            for (size_t i = 2; v && i < a.size(); ++i)
+            {
+                n += v->hash.erase(a[i]);
+            }
+
+            if (v)
+            {
+                prune(a[1], *v);
+            }
+
+            integer(n);
+        }
+
+        void cmdHincrby(Client&, const Args& a)
+        {
+            Value& v = create(a[1], Hash);
+            std::string& field = v.hash[a[2]];
+            const boost::int64_t n = (field.empty() ? 0 : toInteger(field)) + toInteger(a[3]);
+
+            field = boost::lexical_cast<std::string>(n);
+            integer(n);
+        }
+
+        void cmdHlen(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Hash);
+            integer(v ? v->hash.size() : 0);
+        }
+
+        void cmdHexists(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Hash);
+            integer(v ? v->hash.count(a[2]) : 0);
+        }
+
+        void cmdHgetall(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Hash);
+
+            if (v == 0)
+            {
+                map(0);
+                return;
+            }
+
+            map(v->hash.size());
+
+            for (std::map<std::string, std::string>::const_iterator i = v->hash.begin(); i != v->hash.end(); ++i)
+            {
+                bulk(i->first);
+                bulk(i->second);
+            }
+        }
+
+        // Sets
+
+        void members(const std::set<std::string>& members)
+        {
+            set(members.size());
+
+            for (std::set<std::string>::const_iterator i = members.begin(); i != members.end(); ++i)
+            {
+                bulk(*i);
+            }
+        }
+
+        void cmdSadd(Client&, const Args& a)
+        {
+            Value& v = create(a[1], Set);
+            boost::int64_t n = 0;
+
+            for (size_t i = 2; i < a.size(); ++i)
+            {
+                n += v.set.insert(a[i]).second;
+            }
+
+            integer(n);
+        }
+
+        void cmdSrem(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Set);
+            boost::int64_t n = 0;
+
+            for (size_t i = 2; v && i < a.size(); ++i)
+            {
+                n += v->set.erase(a[i]);
+            }
+
+            if (v)
+            {
+                prune(a[1], *v);
+            }
+
+            integer(n);
+        }
+
+        void cmdSismember(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Set);
+            integer(v ? v->set.count(a[2]) : 0);
+        }
+
+        void cmdScard(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Set);
+            integer(v ? v->set.size() : 0);
+        }
+
+        void cmdSmembers(Client&, const Args& a)
+        {
+            Value* v = find(a[1], Set);
+            members(v ? v->set : std::set<std::string>());
+        }
+
+        void cmdSunion(Client&, const Args& a)
+        {
+            std::set<std::string> result;
+
+            for (size_t i = 1; i < a.size(); ++i)
+            {
+                if (Value* v = find(a[i], Set))
+                {
+                    result.insert(v->set.begin(), v->set.end());
+                }
+            }
+
+            members(result);
+        }
+
+        void cmdSdiff(Client&, const Args& a)
+        {
+            Value* first = find(a[1], Set);
+            std::set<std::string> result;
+
+            if (first)
+            {
+                result = first->set;
+            }
+
+            for (size_t i = 2; i < a.size(); ++i)
+            {
+                if (Value* v = find(a[i], Set))
+                {
+                    for (std::set<std::string>::const_iterator m = v->set.begin(); m != v->set.end(); ++m)
+                    {
+                        result.erase(*m);
+                    }
+                }
+            }
+
+            members(result);
+        }
+
+        // Sorted sets
+
+        typedef std::set<std::pair<double, std::string> >::const_iterator Ordered;
+
+        // RESP3 pairs members with their scores in arrays of two
+        void scored(const std::vector<Ordered>& items, bool withScores)
+        {
+            const bool pairs = withScores && resp3();
+
+            array(items.size() * (withScores && !pairs ? 2 : 1));
+
+            for (size_t i = 0; i < items.size(); ++i)
+            {
+                if (pairs)
+                {
+                    array(2);
+                }
+
+                bulk(items[i]->second);
+
+                if (withScores)
+                {
+                    score(items[i]->first);
+                }
+            }
+        }
+
+        static bool isOption(const std::string& arg, const char* option)
+        {
+            return ::strcasecmp(arg.c_str(), option) == 0;
+        }
+
+        void cmdZadd(Client&, const Args& a)
+        {
+            if (a.size() % 2 != 0)
+            {
+                throw Error("ERR syntax error");
+            }
+
+            std::vector<double> scores;
+
+            for (size_t i = 2; i < a.size(); i += 2)
+            {
+                scores.push_back(toDouble(a[i]));
+            }
+
+            Value& v = create(a[1], ZSet);
+            boost::int64_t added = 0;
+
+            for (size_t i = 2; i < a.size(); i += 2)
+            {
+                const double score = scores[(i - 2) / 2];
+                std::map<std::string, double>::iterator m = v.scores.find(a[i + 1]);
+
+                if (m == v.scores.end())
+                {
+                    v.scores.insert(std::make_pair(a[i + 1], score));
+                    ++added;
+                }
+                else
+                {
+                    v.order.erase(std::make_pair(m->second, m->first));
+                    m->second = score;
+                }
+
+                v.order.insert(std::make_pair(score, a[i + 1]));
+            }
+
+            integer(added);
+        }
+
+        void cmdZrem(Client&, const Args& a)
+        {
+            Value* v = find(a[1], ZSet);
+            boost::int64_t n = 0;
+
+            for (size_t i = 2; v && i < a.size(); ++i)
+            {
+                std::map<std::string, double>::iterator m = v->scores.find(a[i]);
+
+                if (m != v->scores.end())
+                {
+                    v->order.erase(std::make_pair(m->second, m->first));
+                    v->scores.erase(m);
+                    ++n;
+                }
+            }
+
+            if (v)
+            {
+                prune(a[1], *v);
+            }
+
+            integer(n);
+        }
+
+        void cmdZcard(Client&, const Args& a)
+        {
+            Value* v = find(a[1], ZSet);
+            integer(v ? v->scores.size() : 0);
+        }
+
+        void cmdZscore(Client&, const Args& a)
+        {
+            Value* v = find(a[1], ZSet);
+            std::map<std::string, double>::const_iterator m;
+
+            if (v && (m = v->scores.find(a[2])) != v->scores.end())
+            {
+                score(m->second);
+            }
+            else
+            {
+                nil();
+            }
+        }
+
+        void rank(const Args& a, bool reverse)
+        {
+            Value* v = find(a[1], ZSet);
+            std::map<std::string, double>::const_iterator m;
+
+            if (v == 0 || (m = v->scores.find(a[2])) == v->scores.end())
+            {
+                nil();
+                return;
+            }
+
+            const size_t r = std::distance(v->order.begin(), v->order.find(std::make_pair(m->second, m->first)));
+            integer(reverse ? v->order.size() - 1 - r : r);
+        }
+
+        void cmdZrank(Client&, const Args& a) { rank(a, false); }
+        void cmdZrevrank(Client&, const Args& a) { rank(a, true); }
+
+        void byRank(const Args& a, bool reverse)
+        {
+            Value* v = find(a[1], ZSet);
+            boost::int64_t start = toInteger(a[2]), stop = toInteger(a[3]);
+            const bool withScores = a.size() > 4 && isOption(a[4], "WITHSCORES");
+
+            if (a.size() > 5 || (a.size() == 5 && !withScores))
+            {
+                throw Error("ERR syntax error");
+            }
+
+            std::vector<Ordered> items;
+
+            if (v && range(start, stop, v->order.size()))
+            {
+                std::vector<Ordered> all;
+
+                for (Ordered i = v->order.begin(); i != v->order.end(); ++i)
+                {
+                    all.push_back(i);
+                }
+
+                if (reverse)
+                {
+                    std::reverse(all.begin(), all.end());
+                }
+
+                items.assign(all.begin() + start, all.begin() + stop + 1);
+            }
+
+            scored(items, withScores);
+        }
+
+        void cmdZrange(Client&, const Args& a) { byRank(a, false); }
+        void cmdZrevrange(Client&, const Args& a) { byRank(a, true); }
+
+        void byScore(const Args& a, bool reverse)
+        {
+            Value* v = find(a[1], ZSet);
+            bool minExclusive, maxExclusive;
+            const double min = toBound(a[reverse ? 3 : 2], minExclusive);
+            const double max = toBound(a[reverse ? 2 : 3], maxExclusive);
+            bool withScores = false;
+            boost::int64_t offset = 0, count = -1;
+
+            for (size_t i = 4; i < a.size(); ++i)
+            {
+                if (isOption(a[i], "WITHSCORES"))
+                {
+                    withScores = true;
+                }
+                else if (isOption(a[i], "LIMIT") && i + 2 < a.size())
+                {
+                    offset = toInteger(a[i + 1]);
+                    count = toInteger(a[i + 2]);
+                    i += 2;
+                }
+                else
+                {
+                    throw Error("ERR syntax error");
+                }
+            }
+
+            std::vector<Ordered> items;
+
+            for (Ordered i = v ? v->order.begin() : Ordered(); v && i != v->order.end(); ++i)
+            {
+                const double s = i->first;
+
+                if ((minExclusive ? s > min : s >= min) && (maxExclusive ? s < max : s <= max))
+                {
+                    items.push_back(i);
+                }
+            }
+
+            if (reverse)
+            {
+                std::reverse(items.begin(), items.end());
+            }
+
+            if (offset > 0 || count >= 0)
+            {
+                const size_t first = std::min<size_t>(std::max<boost::int64_t>(offset, 0), items.size());
+                const size_t last = (count < 0) ? items.size() : std::min<size_t>(first + count, items.size());
+                items = std::vector<Ordered>(items.begin() + first, items.begin() + last);
+            }
+
+            scored(items, withScores);
+        }
+
+        void cmdZrangebyscore(Client&, const Args& a) { byScore(a, false); }
+        void cmdZrevrangebyscore(Client&, const Args& a) { byScore(a, true); }
+
+        // Transactions, WATCH is accepted but never fails EXEC
+
+        void cmdMulti(Client& c, const Args&)
+        {
+            if (c.multi)
+            {
+                throw Error("ERR MULTI calls can not be nested");
+            }
+
+            c.multi = true;
+            c.multiFailed = false;
+            c.queued.clear();
+            status("OK");
+        }
+
+        void cmdExec(Client& c, const Args&)
+        {
+            if (!c.multi)
+            {
+                throw Error("ERR EXEC without MULTI");
+            }
+
+            c.multi = false;
+
+            if (c.multiFailed)
+            {
+                c.queued.clear();
+                throw Error("EXECABORT Transaction discarded because of previous errors.");
+            }
+
+            std::vector<Args> queued;
+            queued.swap(c.queued);
+            array(queued.size());
+
+            for (size_t i = 0; i < queued.size(); ++i)
+            {
+                execute(c, queued[i]);
+            }
+        }
+
+        void cmdDiscard(Client& c, const Args&)
+        {
+            if (!c.multi)
+            {
+                throw Error("ERR DISCARD without MULTI");
+            }
+
+            c.multi = false;
+            c.queued.clear();
+            status("OK");
+        }
+
+        void cmdWatch(Client&, const Args&)
+        {
+            status("OK");
+        }
+
+        void add(const char* name, Handler handler, int arity)
+        {
+            Command c = { handler, arity };
+            _table[name] = c;
+        }
+
+        void createTable()
+        {
+            add("PING", &RedisMockServer::cmdPing, -1);
+            add("ECHO", &RedisMockServer::cmdEcho, 2);
+            add("QUIT", &RedisMockServer::cmdQuit, 1);
+            add("SELECT", &RedisMockServer::cmdSelect, 2);
+            add("INFO", &RedisMockServer::cmdInfo, -1);
+            add("HELLO", &RedisMockServer::cmdHello, -1);
+            add("DBSIZE", &RedisMockServer::cmdDbsize, 1);
+            add("FLUSHDB", &RedisMockServer::cmdFlushdb, -1);
+            add("FLUSHALL", &RedisMockServer::cmdFlushall, -1);
+            add("DEL", &RedisMockServer::cmdDel, -2);
+            add("EXISTS", &RedisMockServer::cmdExists, -2);
+            add("KEYS", &RedisMockServer::cmdKeys, 2);
+            add("TYPE", &RedisMockServer::cmdType, 2);
+            add("GET", &RedisMockServer::cmdGet, 2);
+            add("SET", &RedisMockServer::cmdSet, -3);
+            add("SETNX", &RedisMockServer::cmdSetnx, 3);
+            add("MGET", &RedisMockServer::cmdMget, -2);
+            add("MSET", &RedisMockServer::cmdMset, -3);
+            add("INCR", &RedisMockServer::cmdIncr, 2);
+            add("INCRBY", &RedisMockServer::cmdIncrby, 3);
+            add("DECR", &RedisMockServer::cmdDecr, 2);
+            add("DECRBY", &RedisMockServer::cmdDecrby, 3);
+            add("APPEND", &RedisMockServer::cmdAppend, 3);
+            add("STRLEN", &RedisMockServer::cmdStrlen, 2);
+            add("LPUSH", &RedisMockServer::cmdLpush, -3);
+            add("RPUSH", &RedisMockServer::cmdRpush, -3);
+            add("LPOP", &RedisMockServer::cmdLpop, 2);
+            add("RPOP", &RedisMockServer::cmdRpop, 2);
+            add("LLEN", &RedisMockServer::cmdLlen, 2);
+            add("LINDEX", &RedisMockServer::cmdLindex, 3);
+            add("LRANGE", &RedisMockServer::cmdLrange, 4);
+            add("HGET", &RedisMockServer::cmdHget, 3);
+            add("HMGET", &RedisMockServer::cmdHmget, -3);
+            add("HSET", &RedisMockServer::cmdHset, -4);
+            add("HMSET", &RedisMockServer::cmdHmset, -4);
+            add("HSETNX", &RedisMockServer::cmdHsetnx, 4);
+            add("HDEL", &RedisMockServer::cmdHdel, -3);
+            add("HINCRBY", &RedisMockServer::cmdHincrby, 4);
+            add("HLEN", &RedisMockServer::cmdHlen, 2);
+            add("HEXISTS", &RedisMockServer::cmdHexists, 3);
+            add("HGETALL", &RedisMockServer::cmdHgetall, 2);
+            add("SADD", &RedisMockServer::cmdSadd, -3);
+            add("SREM", &RedisMockServer::cmdSrem, -3);
+            add("SISMEMBER", &RedisMockServer::cmdSismember, 3);
+            add("SCARD", &RedisMockServer::cmdScard, 2);
+            add("SMEMBERS", &RedisMockServer::cmdSmembers, 2);
+            add("SUNION", &RedisMockServer::cmdSunion, -2);
+            add("SDIFF", &RedisMockServer::cmdSdiff, -2);
+            add("ZADD", &RedisMockServer::cmdZadd, -4);
+            add("ZREM", &RedisMockServer::cmdZrem, -3);
+            add("ZCARD", &RedisMockServer::cmdZcard, 2);
+            add("ZSCORE", &RedisMockServer::cmdZscore, 3);
+            add("ZRANK", &RedisMockServer::cmdZrank, 3);
+            add("ZREVRANK", &RedisMockServer::cmdZrevrank, 3);
+            add("ZRANGE", &RedisMockServer::cmdZrange, -4);
+            add("ZREVRANGE", &RedisMockServer::cmdZrevrange, -4);
+            add("ZRANGEBYSCORE", &RedisMockServer::cmdZrangebyscore, -4);
+            add("ZREVRANGEBYSCORE", &RedisMockServer::cmdZrevrangebyscore, -4);
+            add("MULTI", &RedisMockServer::cmdMulti, 1);
+            add("EXEC", &RedisMockServer::cmdExec, 1);
+            add("DISCARD", &RedisMockServer::cmdDiscard, 1);
+            add("WATCH", &RedisMockServer::cmdWatch, -2);
+            add("UNWATCH", &RedisMockServer::cmdWatch, 1);
+        }
+
+        // Appends reply of command a to _reply
+        void execute(Client& c, const Args& a)
+        {
+            std::string name = a[0];
+            std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+            std::map<std::string, Command>::const_iterator i = _table.find(name);
+            const size_t mark = _reply.size();
+
+            try
+            {
+                if (i == _table.end())
+                {
+                    throw Error("ERR unknown command '" + a[0] + "'");
+                }
+
+                const int arity = i->second.arity;
+                const int argc = static_cast<int>(a.size());
+
+                if ((arity > 0 && argc != arity) || (arity < 0 && argc < -arity))
+                {
+                    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                    throw Error("ERR wrong number of arguments for '" + name + "' command");
+                }
+
+                if (c.multi && name != "EXEC" && name != "DISCARD" && name != "MULTI" && name != "WATCH")
+                {
+                    c.queued.push_back(a);
+                    status("QUEUED");
+                    return;
+                }
+
+                (this->*i->second.handler)(c, a);
+            }
+            catch (const Error& e)
+            {
+                if (c.multi)
+                {
+                    c.multiFailed = true;
+                }
+
+                _reply.resize(mark);
+                _reply.push_back('-');
+                _reply.append(e.message);
+                _reply.append("\r\n", 2);
+            }
+        }
+
+        // Protocol and sockets
+
+        enum Parse { Incomplete, Parsed, Invalid };
+
+        static const char* line(const char* p, const char* end)
+        {
+            const char* cr = static_cast<const char*>(::memchr(p, '\r', end - p));
+            return (cr && cr + 1 < end) ? cr : 0;
+        }
+
+        static bool length(const char* p, const char* cr, long& n)
+        {
+            char* e = 0;
+            n = ::strtol(p, &e, 10);
+            return e == cr && n >= -1 && n <= 512 * 1024 * 1024;
+        }
+
+        // Next multi-bulk command of c.in into c.args
+        static Parse parse(Client& c)
+        {
+            const char* begin = c.in.data() + c.parsed;
+            const char* end = c.in.data() + c.in.size();
+            const char* p = begin;
+
+            if (p == end)
+            {
+                return Incomplete;
+            }
+
+            if (*p != '*')
+            {
+                return Invalid;
+            }
+
+            const char* cr = line(p, end);
+            long count;
+
+            if (cr == 0)
+            {
+                return Incomplete;
+            }
+
+            if (!length(p + 1, cr, count) || count < 1)
+            {
+                return Invalid;
+            }
+
+            p = cr + 2;
+
+            for (long i = 0; i < count; ++i)
+            {
+                long size;
+
+                if (p == end || (cr = line(p, end)) == 0)
+                {
+                    return Incomplete;
+                }
+
+                if (*p != '$' || !length(p + 1, cr, size) || size < 0)
+                {
+                    return Invalid;
+                }
+
+                p = cr + 2;
+
+                if (end - p < size + 2)
+                {
+                    return Incomplete;
+                }
+
+                // grown by arguments received, not by the count announced
+                if (static_cast<size_t>(i) == c.args.size())
+                {
+                    c.args.push_back(std::string());
+                }
+
+                c.args[i].assign(p, size);
+                p += size + 2;
+            }
+
+            c.args.resize(count);
+            c.parsed += p - begin;
+            return Parsed;
+        }
+
+        double chance()
+        {
+            return boost::random::uniform_01<double>()(_random);
+        }
+
+        // Reads and executes complete commands, returns false when the
+        // client is to be closed
+        bool process(Client& c)
+        {
+            Parse result;
+
+            while (!c.closing && (result = parse(c)) == Parsed)
+            {
+                _commands.fetch_add(1, boost::memory_order_relaxed);
+
+                if (_config.disconnectRate > 0 && chance() < _config.disconnectRate)
+                {
+                    return false;
+                }
+
+                _current = &c;
+                _reply.clear();
+
+                if (_config.errorRate > 0 && chance() < _config.errorRate)
+                {
+                    _reply.append("-ERR injected error\r\n");
+                }
+                else
+                {
+                    execute(c, c.args);
+                }
+
+                c.out.append(_reply);
+
+                if (_config.latency.count() > 0 || _config.jitter.count() > 0)
+                {
+                    boost::chrono::microseconds delay = _config.latency;
+
+                    if (_config.jitter.count() > 0)
+                    {
+                        delay += boost::chrono::microseconds(_random() % (_config.jitter.count() + 1));
+                    }
+
+                    Clock::time_point due = Clock::now() + delay;
+
+                    if (!c.delayed.empty() && due < c.delayed.back().first)
+                    {
+                        due = c.delayed.back().first;
+                    }
+
+                    c.delayed.push_back(std::make_pair(due, c.out.size()));
+                }
+                else if (c.delayed.empty())
+                {
+                    c.ready = c.out.size();
+                }
+                else
+                {
+                    c.delayed.push_back(std::make_pair(c.delayed.back().first, c.out.size()));
+                }
+            }
+
+            if (!c.closing && result == Invalid)
+            {
+                c.out.append("-ERR Protocol error\r\n");
+                c.ready = c.out.size();
+                c.delayed.clear();
+                c.closing = true;
+            }
+
+            c.in.erase(0, c.parsed);
+            c.parsed = 0;
+
+            return flush(c);
+        }
+
+        void watch(Client& c, bool writing)
+        {
+            if (writing != c.writing)
+            {
+                epoll_event ev;
+                ev.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+                ev.data.ptr = &c;
+                ::epoll_ctl(_epoll, EPOLL_CTL_MOD, c.fd, &ev);
+                c.writing = writing;
+            }
+        }
+
+        // Writes replies which are due, returns false when the client is
+        // to be closed
+        bool flush(Client& c)
+        {
+            const Clock::time_point now = Clock::now();
+
+            while (!c.delayed.empty() && c.delayed.front().first <= now)
+            {
+                c.ready = c.delayed.front().second;
+                c.delayed.pop_front();
+            }
+
+            while (c.written < c.ready)
+            {
+                const ssize_t n = ::send(c.fd, c.out.data() + c.written, c.ready - c.written, MSG_NOSIGNAL);
+
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    break;
+                }
+
+                if (n <= 0)
+                {
+                    return false;
+                }
+
+                c.written += n;
+            }
+
+            if (c.written > 0 && (c.written == c.out.size() || c.written >= 64 * 1024))
+            {
+                c.out.erase(0, c.written);
+                c.ready -= c.written;
+
+                for (size_t i = 0; i < c.delayed.size(); ++i)
+                {
+                    c.delayed[i].second -= c.written;
+                }
+
+                c.written = 0;
+            }
+
+            watch(c, c.written < c.ready);
+
+            return !(c.closing && c.written == c.ready && c.delayed.empty());
+        }
+
+        bool read(Client& c)
+        {
+            char buffer[16 * 1024];
+
+            for (;;)
+            {
+                const ssize_t n = ::recv(c.fd, buffer, sizeof(buffer), 0);
+
+                if (n > 0)
+                {
+                    c.in.append(buffer, n);
+
+                    if (static_cast<size_t>(n) < sizeof(buffer))
+                    {
+                        break;
+                    }
+                }
+                else if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    break;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            return process(c);
+        }
+
+        void close(Client* c)
+        {
+            ::epoll_ctl(_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+            ::close(c->fd);
+            _clients.erase(c->fd);
+            c->fd = -1;
+            _closed.push_back(c);
+            _connections.fetch_sub(1, boost::memory_order_relaxed);
+        }
+
+        void accept()
+        {
+            for (;;)
+            {
+                const int fd = ::accept4(_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                if (fd < 0)
+                {
+                    return;
+                }
+
+                const int one = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                Client* c = new Client(fd);
+                epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+
+                _clients[fd] = c;
+                ::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev);
+                _connections.fetch_add(1, boost::memory_order_relaxed);
+            }
+        }
+
+        // Arms the timer at the first due reply
+        void arm()
+        {
+            Clock::time_point first = Clock::time_point::max();
+
+            for (std::map<int, Client*>::const_iterator i = _clients.begin(); i != _clients.end(); ++i)
+            {
+                if (!i->second->delayed.empty())
+                {
+                    first = std::min(first, i->second->delayed.front().first);
+                }
+            }
+
+            if (first == _armed)
+            {
+                return;
+            }
+
+            itimerspec spec;
+            ::memset(&spec, 0, sizeof(spec));
+
+            if (first != Clock::time_point::max())
+            {
+                // steady_clock is CLOCK_MONOTONIC on Linux
+                const boost::int64_t ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+                    first.time_since_epoch()).count();
+
+                spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+                spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+
+                if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+                {
+                    spec.it_value.tv_nsec = 1;
+                }
+            }
+
+            ::timerfd_settime(_timer, TFD_TIMER_ABSTIME, &spec, NULL);
+            _armed = first;
+        }
+
+        // Frees clients closed in this round, their events may still be pending
+        void release()
+        {
+            for (size_t i = 0; i < _closed.size(); ++i)
+            {
+                delete _closed[i];
+            }
+
+            _closed.clear();
+        }
+
+        void closeAll()
+        {
+            while (!_clients.empty())
+            {
+                close(_clients.begin()->second);
+            }
+        }
+
+        void run()
+        {
+            epoll_event events[64];
+
+            while (!_stopping.load(boost::memory_order_acquire))
+            {
+                const int n = ::epoll_wait(_epoll, events, 64, -1);
+
+                if (_reconfigure.exchange(false))
+                {
+                    boost::lock_guard<boost::mutex> lock(_mutex);
+                    _config = _next;
+                }
+
+                if (_disconnect.exchange(false))
+                {
+                    closeAll();
+                    release();
+                    continue;
+                }
+
+                for (int i = 0; i < n; ++i)
+                {
+                    void* p = events[i].data.ptr;
+
+                    if (p == &_listen)
+                    {
+                        accept();
+                    }
+                    else if (p == &_wakeup)
+                    {
+                        boost::uint64_t value;
+                        while (::read(_wakeup, &value, sizeof(value)) > 0) { }
+                    }
+                    else if (p == &_timer)
+                    {
+                        boost::uint64_t value;
+                        while (::read(_timer, &value, sizeof(value)) > 0) { }
+                        _armed = Clock::time_point::max();
+
+                        std::vector<Client*> due;
+
+                        for (std::map<int, Client*>::const_iterator c = _clients.begin(); c != _clients.end(); ++c)
+                        {
+                            if (!c->second->delayed.empty())
+                            {
+                                due.push_back(c->second);
+                            }
+                        }
+
+                        for (size_t k = 0; k < due.size(); ++k)
+                        {
+                            if (!flush(*due[k]))
+                            {
+                                close(due[k]);
+                            }
+                        }
+                    }
+                    else
+                    {
+                        Client* c = static_cast<Client*>(p);
+
+                        // closed by an earlier event of this round
+                        if (c->fd < 0)
+                        {
+                            continue;
+                        }
+
+                        bool open = true;
+
+                        if (events[i].events & EPOLLOUT)
+                        {
+                            open = flush(*c);
+                        }
+
+                        if (open && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                        {
+                            open = read(*c);
+                        }
+
+                        if (!open)
+                        {
+                            close(c);
+                        }
+                    }
+                }
+
+                arm();
+                release();
+            }
+
+            closeAll();
+            release();
+        }
+
+        void fail(const char* what)
+        {
+            const std::string message = std::string(what) + ": " + ::strerror(errno);
+
+            if (_listen >= 0) ::close(_listen);
+            if (_epoll >= 0) ::close(_epoll);
+            if (_wakeup >= 0) ::close(_wakeup);
+            if (_timer >= 0) ::close(_timer);
+
+            throw RedisException(message);
+        }
+
+        void listenTcp()
+        {
+            addrinfo hints;
+            addrinfo* result = NULL;
+
+            ::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+
+            const std::string port = boost::lexical_cast<std::string>(_config.port);
+
+            if (::getaddrinfo(_config.host.c_str(), port.c_str(), &hints, &result) != 0 || result == NULL)
+            {
+                errno = EINVAL;
+                fail("Can't resolve mock server address");
+            }
+
+            _listen = ::socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            const int one = 1;
+
+            if (_listen < 0 ||
+                ::setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+                ::bind(_listen, result->ai_addr, result->ai_addrlen) != 0)
+            {
+                ::freeaddrinfo(result);
+                fail("Can't bind mock server");
+            }
+
+            ::freeaddrinfo(result);
+
+            sockaddr_storage bound;
+            socklen_t size = sizeof(bound);
+            ::getsockname(_listen, reinterpret_cast<sockaddr*>(&bound), &size);
+
+            _port = ntohs(bound.ss_family == AF_INET6 ?
+                          reinterpret_cast<sockaddr_in6*>(&bound)->sin6_port :
+                          reinterpret_cast<sockaddr_in*>(&bound)->sin_port);
+        }
+
+        void listenUnix()
+        {
+            sockaddr_un address;
+
+            if (_config.unixSocket.size() >= sizeof(address.sun_path))
+            {
+                errno = ENAMETOOLONG;
+                fail("Can't bind mock server");
+            }
+
+            ::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            ::memcpy(address.sun_path, _config.unixSocket.c_str(), _config.unixSocket.size());
+            ::unlink(_config.unixSocket.c_str());
+
+            _listen = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            if (_listen < 0 ||
+                ::bind(_listen, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+            {
+                fail("Can't bind mock server");
+            }
+
+            _port = 0;
+        }
+
+        void add(int fd, void* data)
+        {
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = data;
+
+            if (::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+            {
+                fail("Can't start mock server");
+            }
+        }
+
+        void wakeup()
+        {
+            const boost::uint64_t one = 1;
+            ssize_t r = ::write(_wakeup, &one, sizeof(one));
+            (void)r;
+        }
+
+    public:
+        // Listens at once, serves from a thread started by the constructor
+        explicit RedisMockServer(const RedisMockConfig& config = RedisMockConfig())
+            : _config(config), _next(config), _reconfigure(false), _disconnect(false),
+              _stopping(false), _commands(0), _connections(0),
+              _listen(-1), _epoll(-1), _wakeup(-1), _timer(-1), _port(0),
+              _databases(Databases), _random(config.seed),
+              _armed(Clock::time_point::max()), _current(NULL)
+        {
+            createTable();
+
+            _epoll = ::epoll_create1(EPOLL_CLOEXEC);
+            _wakeup = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            _timer = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+            if (_epoll < 0 || _wakeup < 0 || _timer < 0)
+            {
+                fail("Can't start mock server");
+            }
+
+            if (_config.unixSocket.empty())
+            {
+                listenTcp();
+            }
+            else
+            {
+                listenUnix();
+            }
+
+            if (::listen(_listen, 128) != 0)
+            {
+                fail("Can't listen on mock server");
+            }
+
+            add(_listen, &_listen);
+            add(_wakeup, &_wakeup);
+            add(_timer, &_timer);
+
+            _thread = boost::thread(boost::bind(&RedisMockServer::run, this));
+        }
+
+        ~RedisMockServer()
+        {
+            _stopping.store(true, boost::memory_order_release);
+            wakeup();
+            _thread.join();
+
+            ::close(_listen);
+            ::close(_timer);
+            ::close(_wakeup);
+            ::close(_epoll);
+
+            if (!_config.unixSocket.empty())
+            {
+                ::unlink(_config.unixSocket.c_str());
+            }
+        }
+
+        // Bound TCP port, 0 for a unix socket
+        int port() const
+        {
+            return _port;
+        }
+
+        // Latency, reply size and faults of commands read from now on,
+        // listening address is kept
+        void setConfig(const RedisMockConfig& config)
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(_mutex);
+                _next = config;
+                _next.host = _config.host;
+                _next.port = _config.port;
+                _next.unixSocket = _config.unixSocket;
+            }
+
+            _reconfigure.store(true);
+            wakeup();
+        }
+
+        // Closes every client connection, pending replies are dropped
+        void disconnectAll()
+        {
+            _disconnect.store(true);
+            wakeup();
+        }
+
+        // Commands received, including those answered with injected faults
+        boost::uint64_t commands() const
+        {
+            return _commands.load(boost::memory_order_relaxed);
+        }
+
+        size_t connections() const
+        {
+            return _connections.load(boost::memory_order_relaxed);
+        }
+    };
+}
+
+#endif // HIREDISPP_MOCK_H
@@ -0,0 +1,646 @@
+/*
+ * hiredispp_multi.h
+ */
+
+#ifndef HIREDISPP_MULTI_H
+#define HIREDISPP_MULTI_H
+
+#include "hiredispp.h"
+#include "hiredispp_async.h"
+#include "hiredispp_epoll.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace hiredispp
+{
+    // Intrusive multi producer single consumer queue of tasks. push() is
+    // wait free and may be called from any thread, pop() only from the
+    // consumer thread.
+    class RedisTaskQueue : boost::noncopyable
+    {
+        struct Stub : RedisTask
+        {
+            virtual void run() { }
+        };
+
+        boost::atomic<RedisTask*> _head;
+        RedisTask* _tail;
+        Stub _stub;
+
+    public:
+        RedisTaskQueue()
+            : _head(&_stub), _tail(&_stub) { }
+
+        void push(RedisTask* task)
+        {
+            task->next.store(NULL, boost::memory_order_relaxed);
+            RedisTask* prev = _head.exchange(task);
+            prev->next.store(task, boost::memory_order_release);
+        }
+
+        // NULL when empty or when a push is still in progress
+        RedisTask* pop()
+        {
+            RedisTask* tail = _tail;
+            RedisTask* next = tail->next.load(boost::memory_order_acquire);
+
+            if (tail == &_stub)
+            {
+                if (next == NULL)
+                {
+                    return NULL;
+                }
+
+                _tail = next;
+                tail = next;
+                next = next->next.load(boost::memory_order_acquire);
+            }
+
+            if (next != NULL)
+            {
+                _tail = next;
+                return tail;
+            }
+
+            if (tail != _head.load())
+            {
+                return NULL;
+            }
+
+            push(&_stub);
+            next = tail->next.load(boost::memory_order_acquire);
+
+            if (next != NULL)
+            {
+                _tail = next;
+                return tail;
+            }
+
+            return NULL;
+        }
+
+        bool empty() const
+        {
+            return _tail->next.load() == NULL && _head.load() == _tail;
+        }
+    };
+
+    // Executor run by the thread that submitted commands: completions are
+    // queued until that thread calls poll() or wait()
+    class RedisCompletionQueue : public RedisExecutor, boost::noncopyable
+    {
+        RedisTaskQueue _queue;
+        boost::atomic<bool> _waiting;
+        int _event;
+
+    public:
+        RedisCompletionQueue()
+            : _waiting(false), _event(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        {
+            if (_event < 0)
+            {
+                throw RedisException("Can't create completion queue");
+            }
+        }
+
+        ~RedisCompletionQueue()
+        {
+            ::close(_event);
+        }
+
+        virtual void post(RedisTask* task)
+        {
+            _queue.push(task);
+
+            if (_waiting.exchange(false))
+            {
+                const boost::uint64_t one = 1;
+                ssize_t r = ::write(_event, &one, sizeof(one));
+                (void)r;
+            }
+        }
+
+        // Runs queued completions, returns their number
+        size_t poll()
+        {
+            size_t n = 0;
+
+            for (RedisTask* task = _queue.pop(); task != NULL; task = _queue.pop())
+            {
+                task->run();
+                ++n;
+            }
+
+            return n;
+        }
+
+        // Waits up to timeout milliseconds, -1 for no limit, for at least
+        // one completion and runs queued completions
+        size_t wait(int timeout = -1)
+        {
+            size_t n = poll();
+
+            if (n > 0)
+            {
+                return n;
+            }
+
+            _waiting.store(true);
+
+            if (_queue.empty())
+            {
+                pollfd p = { _event, POLLIN, 0 };
+                ::poll(&p, 1, timeout);
+            }
+
+            _waiting.store(false);
+
+            boost::uint64_t value;
+            while (::read(_event, &value, sizeof(value)) > 0) { }
+
+            return poll();
+        }
+
+        // Descriptor becoming readable when wait() would not block
+        int fd() const { return _event; }
+    };
+
+    struct RedisMultiConfig
+    {
+        // Number of I/O threads, each with its own loop and connection
+        size_t threads;
+
+        // I/O thread i is pinned to CPU cpus[i % cpus.size()], threads are
+        // not pinned when empty
+        std::vector<int> cpus;
+
+        // Commands queued to an I/O thread or in flight on its connection,
+        // 0 for no limit. When reached execAsyncCommand waits for a command
+        // to complete if blockWhenFull, otherwise throws RedisException.
+        // Handlers run on an I/O thread must not block waiting for it.
+        size_t maxInFlight;
+        bool blockWhenFull;
+
+        // Commands not completed in time complete with NULL reply, 0 for
+        // no limit
+        boost::chrono::milliseconds commandTimeout;
+
+        // Attached to the connections of I/O threads when not NULL, must
+        // outlive the client
+        RedisInstrument* instrument;
+
+        // Reconnect of the connections of I/O threads, enabled by default so
+        // threads losing one server retry with spread out backoff. When
+        // disabled a lost connection is opened again by the next command.
+        // Commands submitted before connecting are queued too, maxQueued is
+        // not limited by default and maxInFlight bounds them instead.
+        RedisReconnectPolicy reconnect;
+
+        RedisMultiConfig()
+            : threads(boost::thread::hardware_concurrency()),
+              maxInFlight(0), blockWhenFull(true), commandTimeout(0),
+              instrument(0)
+        {
+            if (threads == 0)
+            {
+                threads = 1;
+            }
+
+            reconnect.enabled = true;
+            reconnect.maxQueued = std::numeric_limits<size_t>::max();
+        }
+    };
+
+    // Async client usable from any thread. Commands are queued to one of the
+    // I/O threads, each running an epoll loop with its own connection; a
+    // submitting thread always uses the same I/O thread, so its commands are
+    // executed in order. Handler is called as handler(Redis::Reply*), with
+    // NULL reply if the connection was lost, by the executor given with the
+    // command or by the I/O thread when none is given.
+    class RedisMultiClient : boost::noncopyable
+    {
+        // Submitted command, encoded command follows the object in the same
+        // allocation
+        class Worker;
+
+        class Command : public RedisTask
+        {
+        public:
+            Worker* worker;
+            RedisExecutor* executor;
+            size_t length;
+            Redis::Reply reply;
+            bool lost;
+
+            const char* data() const
+            {
+                return reinterpret_cast<const char*>(this) + offset();
+            }
+
+            virtual size_t offset() const = 0;
+        };
+
+        template<typename Handler>
+        class CommandImpl : public Command
+        {
+            Handler _handler;
+
+            CommandImpl(const Handler& handler)
+                : _handler(handler) { }
+
+            ~CommandImpl() { }
+
+            static size_t size()
+            {
+                return (sizeof(CommandImpl) + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+            }
+
+        public:
+            static Command* create(const char* data, size_t length, const Handler& handler)
+            {
+                void* p = ::operator new(size() + length);
+                CommandImpl* c;
+
+                try
+                {
+                    c = new (p) CommandImpl(handler);
+                }
+                catch (...)
+                {
+                    ::operator delete(p);
+                    throw;
+                }
+
+                ::memcpy(static_cast<char*>(p) + size(), data, length);
+                c->length = length;
+                c->lost = false;
+                return c;
+            }
+
+            virtual size_t offset() const
+            {
+                return size();
+            }
+
+            virtual void run()
+            {
+                struct Delete
+                {
+                    CommandImpl* c;
+
+                    ~Delete()
+                    {
+                        c->~CommandImpl();
+                        ::operator delete(c);
+                    }
+                } d = { this };
+
+                _handler(lost ? static_cast<Redis::Reply*>(NULL) : &reply);
+            }
+        };
+
+        // Completion handler of a command on its connection
+        struct Done
+        {
+            Command* command;
+
+            void operator()(RedisConnectionAsync& ac, Redis::Element* reply)
+            {
+                if (reply)
+                {
+                    command->reply = ac.takeReply();
+                }
+                else
+                {
+                    command->lost = true;
+                }
+
+                complete(command);
+            }
+        };
+
+        static void complete(Command* command)
+        {
+            command->worker->release();
+
+            if (command->executor)
+            {
+                command->executor->post(command);
+            }
+            else
+            {
+                command->run();
+            }
+        }
+
+        class Worker : boost::noncopyable
+        {
+            RedisEpollLoop _loop;
+            RedisConnectionAsync _connection;
+            RedisTaskQueue _queue;
+            boost::atomic<bool> _idle;
+            boost::atomic<bool> _stopping;
+
+            // set when the connection is lost and does not reconnect itself
+            bool _lost;
+            int _cpu;
+
+            // slots of maxInFlight, submitters wait on _space when blocking
+            const size_t _maxInFlight;
+            const bool _blockWhenFull;
+            boost::atomic<size_t> _inFlight;
+            boost::atomic<size_t> _waiters;
+            boost::mutex _mutex;
+            boost::condition_variable _space;
+
+            boost::thread _thread;
+
+            bool tryAcquire()
+            {
+                size_t n = _inFlight.load(boost::memory_order_relaxed);
+
+                while (n < _maxInFlight)
+                {
+                    if (_inFlight.compare_exchange_weak(n, n + 1))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            void onConnected(boost::shared_ptr<RedisException>& ex)
+            {
+                if (ex)
+                {
+                    lost();
+                }
+            }
+
+            void onDisconnected(boost::shared_ptr<RedisException>&)
+            {
+                lost();
+            }
+
+            void lost()
+            {
+                _lost = !_connection.reconnectPolicy().enabled;
+            }
+
+            // Commands are buffered by hiredis or queued by the reconnect
+            // policy until connected
+            void connect()
+            {
+                _lost = false;
+
+                try
+                {
+                    _connection.connect(boost::bind(&Worker::onConnected, this, _1),
+                                        boost::bind(&Worker::onDisconnected, this, _1));
+                }
+                catch (const RedisException&)
+                {
+                    _connection.close();
+                    _lost = true;
+                }
+            }
+
+            void execute(Command* command)
+            {
+                if (_lost)
+                {
+                    connect();
+                }
+
+                try
+                {
+                    Done done = { command };
+                    _connection.execAsyncFormatted(command->data(), command->length, done);
+                }
+                catch (const RedisException&)
+                {
+                    command->lost = true;
+                    complete(command);
+                }
+            }
+
+            size_t drain()
+            {
+                size_t n = 0;
+
+                for (RedisTask* task = _queue.pop(); task != NULL; task = _queue.pop())
+                {
+                    execute(static_cast<Command*>(task));
+                    ++n;
+                }
+
+                return n;
+            }
+
+            void pin()
+            {
+#ifdef __linux__
+                if (_cpu >= 0)
+                {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    CPU_SET(_cpu, &set);
+                    ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+                }
+#endif
+            }
+
+            void run()
+            {
+                pin();
+                connect();
+
+                while (!_stopping.load(boost::memory_order_acquire))
+                {
+                    drain();
+
+                    // announced before the last look at the queue, a command
+                    // pushed after it sees the flag and wakes the loop
+                    _idle.store(true);
+                    _loop.runOnce(_queue.empty() ? -1 : 0);
+                    _idle.store(false, boost::memory_order_relaxed);
+                }
+
+                // in flight commands complete as lost
+                _connection.close();
+
+                for (RedisTask* task = _queue.pop(); task != NULL; task = _queue.pop())
+                {
+                    Command* command = static_cast<Command*>(task);
+                    command->lost = true;
+                    complete(command);
+                }
+            }
+
+        public:
+            Worker(const std::string& host, int port, int cpu, const RedisMultiConfig& config)
+                : _connection(host, port, _loop), _idle(false), _stopping(false),
+                  _lost(false), _cpu(cpu),
+                  _maxInFlight(config.maxInFlight), _blockWhenFull(config.blockWhenFull),
+                  _inFlight(0), _waiters(0)
+            {
+                _connection.setCommandTimeout(config.commandTimeout);
+                _connection.setInstrument(config.instrument);
+                _connection.setReconnect(config.reconnect);
+                _thread = boost::thread(boost::bind(&Worker::run, this));
+            }
+
+            ~Worker()
+            {
+                _stopping.store(true, boost::memory_order_release);
+                _loop.wakeup();
+                _thread.join();
+            }
+
+            // Takes a slot for a command about to be submitted
+            void acquire()
+            {
+                if (_maxInFlight == 0 || tryAcquire())
+                {
+                    return;
+                }
+
+                if (!_blockWhenFull)
+                {
+                    throw RedisException("Can't execute a command, too many commands in flight");
+                }
+
+                // waiter is counted before the last look at the slots, a
+                // release after it sees the count and takes the mutex
+                boost::unique_lock<boost::mutex> lock(_mutex);
+                _waiters.fetch_add(1);
+
+                while (!tryAcquire())
+                {
+                    _space.wait(lock);
+                }
+
+                _waiters.fetch_sub(1);
+            }
+
+            void release()
+            {
+                if (_maxInFlight == 0)
+                {
+                    return;
+                }
+
+                _inFlight.fetch_sub(1);
+
+                if (_waiters.load() > 0)
+                {
+                    boost::lock_guard<boost::mutex> lock(_mutex);
+                    _space.notify_one();
+                }
+            }
+
+            void submit(Command* command)
+            {
+                _queue.push(command);
+
+                if (_idle.exchange(false))
+                {
+                    _loop.wakeup();
+                }
+            }
+        };
+
+        // Worker the thread sends to, stale when owner is another client;
+        // workers are owned by the client, thread only remembers one
+        struct Affinity
+        {
+            boost::uint64_t owner;
+            Worker* worker;
+        };
+
+        boost::ptr_vector<Worker> _workers;
+        const boost::uint64_t _id;
+        boost::thread_specific_ptr<Affinity> _affinity;
+        boost::atomic<size_t> _next;
+
+        Worker& worker()
+        {
+            Affinity* affinity = _affinity.get();
+
+            if (affinity == NULL || affinity->owner != _id)
+            {
+                affinity = new Affinity;
+                affinity->owner = _id;
+                affinity->worker = &_workers[_next.fetch_add(1, boost::memory_order_relaxed) % _workers.size()];
+                _affinity.reset(affinity);
+            }
+
+            return *affinity->worker;
+        }
+
+    public:
+        RedisMultiClient(const std::string& host, int port = 6379,
+                         const RedisMultiConfig& config = RedisMultiConfig())
+            : _id(RedisInstance::nextId()), _next(0)
+        {
+            if (config.threads == 0)
+            {
+                throw std::invalid_argument("Invalid number of threads");
+            }
+
+            for (size_t i = 0; i < config.threads; ++i)
+            {
+                const int cpu = config.cpus.empty() ? -1 : config.cpus[i % config.cpus.size()];
+                _workers.push_back(new Worker(host, port, cpu, config));
+            }
+        }
+
+        // Commands still queued or in flight complete as lost
+        ~RedisMultiClient()
+        {
+            _workers.clear();
+        }
+
+        size_t threads() const { return _workers.size(); }
+
+        template<typename CharT, typename Handler>
+        void execAsyncCommand(const RedisCommandBase<CharT>& cmd, Handler handler,
+                              RedisExecutor* executor = NULL)
+        {
+            Worker& w = worker();
+            Command* command;
+
+            w.acquire();
+
+            try
+            {
+                command = CommandImpl<Handler>::create(cmd.data(), cmd.length(), handler);
+            }
+            catch (...)
+            {
+                w.release();
+                throw;
+            }
+
+            command->worker = &w;
+            command->executor = executor;
+            w.submit(command);
+        }
+    };
+}
+
+#endif // HIREDISPP_MULTI_H
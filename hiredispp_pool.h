@@ -0,0 +1,528 @@
+/*
+ * hiredispp_pool.h
+ */
+
+#ifndef HIREDISPP_POOL_H
+#define HIREDISPP_POOL_H
+
+#include "hiredispp.h"
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace hiredispp
+{
+    struct RedisPoolConfig
+    {
+        // Connections opened on construction and kept through idle eviction
+        size_t minSize;
+        size_t maxSize;
+
+        // Idle connections above minSize are closed after this period
+        boost::chrono::milliseconds idleTimeout;
+
+        // Connection idle for longer is PINGed before it is handed out
+        boost::chrono::milliseconds healthCheckInterval;
+
+        // Checkout waits that long for a connection when maxSize are in use
+        boost::chrono::milliseconds waitTimeout;
+
+        // Connect and socket timeouts of pooled connections, 0 for none
+        boost::chrono::milliseconds connectTimeout;
+        boost::chrono::milliseconds timeout;
+
+        // Attached to pooled connections when not NULL, must outlive the pool
+        RedisInstrument* instrument;
+
+        // Protocol version negotiated by pooled connections, 3 for RESP3
+        int protocol;
+
+        RedisPoolConfig()
+            : minSize(0), maxSize(16), idleTimeout(60000),
+              healthCheckInterval(5000), waitTimeout(1000),
+              connectTimeout(0), timeout(0), instrument(0), protocol(2) { }
+    };
+
+    struct RedisPoolStats
+    {
+        boost::uint64_t checkouts;
+        boost::uint64_t affineCheckouts;
+        boost::uint64_t contended;
+        boost::uint64_t waits;
+        boost::uint64_t waitMicroseconds;
+        boost::uint64_t timeouts;
+        boost::uint64_t created;
+        boost::uint64_t evicted;
+        boost::uint64_t healthCheckFailures;
+        size_t size;
+        size_t idle;
+    };
+
+    // Thread safe pool of RedisBase connections. A connection returned to the
+    // pool is remembered by the returning thread, the next checkout from that
+    // thread takes it back with a single compare-and-swap, without locking.
+    template<typename CharT>
+    class RedisPool : boost::noncopyable
+    {
+    public:
+        typedef RedisBase<CharT> Redis;
+
+    private:
+        typedef boost::chrono::steady_clock Clock;
+
+        enum State
+        {
+            Free,
+            Idle,
+            Busy
+        };
+
+        struct Entry
+        {
+            boost::scoped_ptr<Redis> redis;
+            boost::atomic<int> state;
+
+            // written only by the thread holding the entry busy
+            Clock::time_point lastUsed;
+            boost::atomic<boost::uint64_t> affineCheckouts;
+
+            Entry()
+                : state(Free), affineCheckouts(0) { }
+        };
+
+        const std::string _host;
+        const int _port;
+        const RedisPoolConfig _config;
+
+        // Entry the thread used last, stale when owner is another pool
+        struct Affinity
+        {
+            boost::uint64_t owner;
+            Entry* entry;
+        };
+
+        boost::scoped_array<Entry> _entries;
+        const boost::uint64_t _id;
+        boost::thread_specific_ptr<Affinity> _affinity;
+
+        boost::mutex _mutex;
+        boost::condition_variable _available;
+        boost::atomic<int> _waiters;
+        size_t _size;
+
+        boost::atomic<boost::int64_t> _lastEviction;
+
+        boost::atomic<boost::uint64_t> _checkouts;
+        boost::atomic<boost::uint64_t> _contended;
+        boost::atomic<boost::uint64_t> _waits;
+        boost::atomic<boost::uint64_t> _waitMicroseconds;
+        boost::atomic<boost::uint64_t> _timeouts;
+        boost::atomic<boost::uint64_t> _created;
+        boost::atomic<boost::uint64_t> _evicted;
+        boost::atomic<boost::uint64_t> _healthCheckFailures;
+
+        static bool tryAcquire(Entry& entry)
+        {
+            int expected = Idle;
+            return entry.state.compare_exchange_strong(expected, Busy, boost::memory_order_acquire);
+        }
+
+        static void increment(boost::atomic<boost::uint64_t>& counter, boost::uint64_t value = 1)
+        {
+            counter.fetch_add(value, boost::memory_order_relaxed);
+        }
+
+        static bool isPong(const std::basic_string<CharT>& reply)
+        {
+            static const char pong[] = "PONG";
+            return reply.size() == 4 && std::equal(reply.begin(), reply.end(), pong);
+        }
+
+        // Entry held busy, on failure it is released before rethrowing
+        void check(Entry& entry)
+        {
+            if (Clock::now() - entry.lastUsed < _config.healthCheckInterval)
+            {
+                return;
+            }
+
+            try
+            {
+                bool healthy;
+
+                try
+                {
+                    healthy = isPong(entry.redis->ping());
+                }
+                catch (const std::exception&)
+                {
+                    healthy = false;
+                }
+
+                if (!healthy)
+                {
+                    // connection in unknown state is replaced, the fresh
+                    // one connects on the first command
+                    increment(_healthCheckFailures);
+                    entry.redis.reset(create());
+                }
+            }
+            catch (...)
+            {
+                discard(entry);
+                throw;
+            }
+        }
+
+        // Returns entry held busy to the free ones
+        void discard(Entry& entry)
+        {
+            entry.redis.reset();
+
+            boost::lock_guard<boost::mutex> lock(_mutex);
+
+            entry.state.store(Free);
+            --_size;
+
+            if (_waiters.load() > 0)
+            {
+                _available.notify_one();
+            }
+        }
+
+        Redis* create() const
+        {
+            Redis* redis = new Redis(_host, _port);
+            redis->setConnectTimeout(_config.connectTimeout);
+            redis->setTimeout(_config.timeout);
+            redis->setInstrument(_config.instrument);
+#if HIREDIS_MAJOR >= 1
+            redis->setProtocol(_config.protocol);
+#endif
+            return redis;
+        }
+
+        Entry* acquireIdle()
+        {
+            for (size_t i = 0; i < _config.maxSize; ++i)
+            {
+                if (tryAcquire(_entries[i]))
+                {
+                    return &_entries[i];
+                }
+            }
+
+            return 0;
+        }
+
+        Entry* acquireFree()
+        {
+            if (_size >= _config.maxSize)
+            {
+                return 0;
+            }
+
+            for (size_t i = 0; i < _config.maxSize; ++i)
+            {
+                Entry& entry = _entries[i];
+
+                if (entry.state.load(boost::memory_order_relaxed) == Free)
+                {
+                    entry.redis.reset(create());
+                    entry.lastUsed = Clock::now();
+                    entry.state.store(Busy, boost::memory_order_relaxed);
+
+                    ++_size;
+                    increment(_created);
+
+                    return &entry;
+                }
+            }
+
+            return 0;
+        }
+
+        Entry* checkout()
+        {
+            Affinity* affinity = _affinity.get();
+            Entry* entry = (affinity != 0 && affinity->owner == _id) ? affinity->entry : 0;
+
+            if (entry != 0 && tryAcquire(*entry))
+            {
+                // single writer counter, no read-modify-write on shared line
+                entry->affineCheckouts.store(entry->affineCheckouts.load(boost::memory_order_relaxed) + 1,
+                                             boost::memory_order_relaxed);
+                check(*entry);
+                return entry;
+            }
+
+            if (affinity == 0 || affinity->owner != _id)
+            {
+                // allocated before checkout, a failure then holds no entry
+                affinity = new Affinity;
+                affinity->owner = _id;
+                affinity->entry = 0;
+                _affinity.reset(affinity);
+            }
+
+            entry = checkoutShared();
+            affinity->entry = entry;
+            check(*entry);
+            return entry;
+        }
+
+        Entry* checkoutShared()
+        {
+            increment(_checkouts);
+
+            boost::unique_lock<boost::mutex> lock(_mutex, boost::try_to_lock);
+
+            if (!lock.owns_lock())
+            {
+                increment(_contended);
+                lock.lock();
+            }
+
+            // waiter is announced before scanning, so a connection returned
+            // after the scan is guaranteed to see it and notify
+            ++_waiters;
+
+            Clock::time_point start;
+            bool waiting = false;
+
+            for (;;)
+            {
+                Entry* entry = acquireIdle();
+
+                if (entry == 0)
+                {
+                    try
+                    {
+                        entry = acquireFree();
+                    }
+                    catch (...)
+                    {
+                        --_waiters;
+                        throw;
+                    }
+                }
+
+                if (entry != 0)
+                {
+                    --_waiters;
+
+                    if (waiting)
+                    {
+                        increment(_waitMicroseconds,
+                                  boost::chrono::duration_cast<boost::chrono::microseconds>(Clock::now() - start).count());
+                    }
+
+                    return entry;
+                }
+
+                if (!waiting)
+                {
+                    waiting = true;
+                    start = Clock::now();
+                    increment(_waits);
+                }
+
+                if (_available.wait_until(lock, start + _config.waitTimeout) == boost::cv_status::timeout)
+                {
+                    entry = acquireIdle();
+
+                    if (entry != 0)
+                    {
+                        --_waiters;
+                        return entry;
+                    }
+
+                    --_waiters;
+                    increment(_timeouts);
+
+                    throw RedisException("Connection pool exhausted");
+                }
+            }
+        }
+
+        void checkin(Entry* entry, bool broken)
+        {
+            if (broken)
+            {
+                try
+                {
+                    entry->redis.reset(create());
+                }
+                catch (...)
+                {
+                    discard(*entry);
+                    return;
+                }
+            }
+
+            entry->lastUsed = Clock::now();
+            entry->state.store(Idle);
+
+            if (_waiters.load() > 0)
+            {
+                boost::lock_guard<boost::mutex> lock(_mutex);
+                _available.notify_one();
+            }
+
+            evict(entry->lastUsed);
+        }
+
+        void evict(Clock::time_point now)
+        {
+            const boost::int64_t ticks = now.time_since_epoch().count();
+            boost::int64_t last = _lastEviction.load(boost::memory_order_relaxed);
+
+            if (ticks - last < Clock::duration(_config.idleTimeout).count() / 2 ||
+                !_lastEviction.compare_exchange_strong(last, ticks, boost::memory_order_relaxed))
+            {
+                return;
+            }
+
+            boost::unique_lock<boost::mutex> lock(_mutex, boost::try_to_lock);
+
+            if (!lock.owns_lock())
+            {
+                return;
+            }
+
+            for (size_t i = 0; i < _config.maxSize && _size > _config.minSize; ++i)
+            {
+                Entry& entry = _entries[i];
+
+                if (tryAcquire(entry))
+                {
+                    if (now - entry.lastUsed > _config.idleTimeout)
+                    {
+                        entry.redis.reset();
+                        entry.state.store(Free);
+
+                        --_size;
+                        increment(_evicted);
+                    }
+                    else
+                    {
+                        entry.state.store(Idle);
+                    }
+                }
+            }
+        }
+
+    public:
+        // Connection checked out for the lifetime of this object
+        class Connection : boost::noncopyable
+        {
+            RedisPool<CharT>& _pool;
+            Entry* _entry;
+            bool _broken;
+
+        public:
+            explicit Connection(RedisPool<CharT>& pool)
+                : _pool(pool), _entry(pool.checkout()), _broken(false) { }
+
+            // Connection still expecting replies, as when left through an
+            // exception after begin calls, is replaced
+            ~Connection()
+            {
+                _pool.checkin(_entry, _broken || _entry->redis->expectsReplies());
+            }
+
+            // Connection is replaced on return, use after leaving it in
+            // a state other users must not see
+            void invalidate()
+            {
+                _broken = true;
+            }
+
+            Redis& operator*() const
+            {
+                return *_entry->redis;
+            }
+
+            Redis* operator->() const
+            {
+                return _entry->redis.get();
+            }
+        };
+
+        RedisPool(const std::string& host, int port = 6379, const RedisPoolConfig& config = RedisPoolConfig())
+            : _host(host), _port(port), _config(config),
+              _entries(new Entry[config.maxSize]), _id(RedisInstance::nextId()),
+              _waiters(0), _size(0), _lastEviction(Clock::now().time_since_epoch().count()),
+              _checkouts(0), _contended(0), _waits(0), _waitMicroseconds(0), _timeouts(0),
+              _created(0), _evicted(0), _healthCheckFailures(0)
+        {
+            if (config.maxSize == 0 || config.minSize > config.maxSize)
+            {
+                throw std::invalid_argument("Invalid pool size");
+            }
+
+            for (size_t i = 0; i < config.minSize; ++i)
+            {
+                Entry* entry = acquireFree();
+
+                try
+                {
+                    entry->redis->ping();
+                }
+                catch (const std::exception&)
+                {
+                    // server may come up later, connection is retried on use
+                }
+
+                entry->state.store(Idle);
+            }
+        }
+
+        // All connections must be returned before the pool is destroyed
+        ~RedisPool() { }
+
+        const std::string& host() const { return _host; }
+        int port() const { return _port; }
+
+        RedisPoolStats stats() const
+        {
+            RedisPoolStats s;
+
+            s.checkouts = _checkouts.load(boost::memory_order_relaxed);
+            s.affineCheckouts = 0;
+            s.contended = _contended.load(boost::memory_order_relaxed);
+            s.waits = _waits.load(boost::memory_order_relaxed);
+            s.waitMicroseconds = _waitMicroseconds.load(boost::memory_order_relaxed);
+            s.timeouts = _timeouts.load(boost::memory_order_relaxed);
+            s.created = _created.load(boost::memory_order_relaxed);
+            s.evicted = _evicted.load(boost::memory_order_relaxed);
+            s.healthCheckFailures = _healthCheckFailures.load(boost::memory_order_relaxed);
+            s.size = 0;
+            s.idle = 0;
+
+            for (size_t i = 0; i < _config.maxSize; ++i)
+            {
+                const int state = _entries[i].state.load(boost::memory_order_relaxed);
+
+                s.affineCheckouts += _entries[i].affineCheckouts.load(boost::memory_order_relaxed);
+                s.size += (state != Free);
+                s.idle += (state == Idle);
+            }
+
+            s.checkouts += s.affineCheckouts;
+
+            return s;
+        }
+    };
+
+    typedef RedisPool<char> RedisConnectionPool;
+    typedef RedisPool<wchar_t> wRedisConnectionPool;
+}
+
+#endif // HIREDISPP_POOL_H
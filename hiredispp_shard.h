@@ -0,0 +1,799 @@
+/*
+ * hiredispp_shard.h
+ */
+
+#ifndef HIREDISPP_SHARD_H
+#define HIREDISPP_SHARD_H
+
+#include "hiredispp.h"
+#include <boost/crc.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+namespace hiredispp
+{
+    // Single key commands of RedisBase for clients spreading keys over
+    // several connections. Derived class sends command C with the key as
+    // its first argument through keyCommand<C>(key, ...) and returns reply.
+    template<class Derived, typename CharT>
+    class RedisKeyCommands
+    {
+        const Derived& derived() const
+        {
+            return static_cast<const Derived&>(*this);
+        }
+
+    public:
+        typedef RedisResult<RedisReplyBase, CharT> Reply;
+
+        // Narrows key to the part enclosed in first {} when it is not empty
+        static void hashTag(const char*& data, size_t& size)
+        {
+            const char* open = static_cast<const char*>(::memchr(data, '{', size));
+
+            if (open != 0)
+            {
+                const char* close = static_cast<const char*>(::memchr(open + 1, '}', data + size - open - 1));
+
+                if (close != 0 && close != open + 1)
+                {
+                    data = open + 1;
+                    size = close - open - 1;
+                }
+            }
+        }
+
+        std::basic_string<CharT> get(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Get>(key);
+        }
+
+        bool exists(const std::basic_string<CharT>& key) const
+        {
+            return(((boost::int64_t)derived().template keyCommand<resp::Exists>(key)) != 0);
+        }
+
+        void set(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
+        {
+            derived().template keyCommand<resp::Set>(key, value);
+        }
+
+        boost::int64_t setnx(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
+        {
+            return derived().template keyCommand<resp::Setnx>(key, value);
+        }
+
+        boost::int64_t incr(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Incr>(key);
+        }
+
+        boost::int64_t del(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Del>(key);
+        }
+
+        void lpush(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
+        {
+            derived().template keyCommand<resp::Lpush>(key, value);
+        }
+
+        std::basic_string<CharT> lpop(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Lpop>(key);
+        }
+
+        void rpush(const std::basic_string<CharT>& key, const std::basic_string<CharT>& value) const
+        {
+            derived().template keyCommand<resp::Rpush>(key, value);
+        }
+
+        std::basic_string<CharT> rpop(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Rpop>(key);
+        }
+
+        std::basic_string<CharT> lindex(const std::basic_string<CharT>& key, boost::int64_t index) const
+        {
+            return derived().template keyCommand<resp::Lindex>(key, index);
+        }
+
+        Reply lrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
+        {
+            return derived().template keyCommand<resp::Lrange>(key, start, end);
+        }
+
+        boost::int64_t llen(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Llen>(key);
+        }
+
+        std::basic_string<CharT> hget(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field) const
+        {
+            return derived().template keyCommand<resp::Hget>(key, field);
+        }
+
+        boost::int64_t hdel(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field) const
+        {
+            return derived().template keyCommand<resp::Hdel>(key, field);
+        }
+
+        boost::int64_t hset(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, const std::basic_string<CharT>& value) const
+        {
+            return derived().template keyCommand<resp::Hset>(key, field, value);
+        }
+
+        boost::int64_t hsetnx(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, const std::basic_string<CharT>& value) const
+        {
+            return derived().template keyCommand<resp::Hsetnx>(key, field, value);
+        }
+
+        boost::int64_t hincrby(const std::basic_string<CharT>& key, const std::basic_string<CharT>& field, boost::int64_t value) const
+        {
+            return derived().template keyCommand<resp::Hincrby>(key, field, value);
+        }
+
+        Reply hgetall(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Hgetall>(key);
+        }
+
+        boost::int64_t sadd(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
+        {
+            return derived().template keyCommand<resp::Sadd>(key, member);
+        }
+
+        bool sismember(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
+        {
+            return ((boost::int64_t)derived().template keyCommand<resp::Sismember>(key, member) == 1);
+        }
+
+        boost::int64_t srem(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
+        {
+            return derived().template keyCommand<resp::Srem>(key, member);
+        }
+
+        Reply smembers(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Smembers>(key);
+        }
+
+        // Keys of multi key set commands must share a hash tag
+        Reply sdiff(const std::basic_string<CharT>& key, const std::basic_string<CharT>& diffKey) const
+        {
+            return derived().template keyCommand<resp::Sdiff>(key, diffKey);
+        }
+
+        Reply sunion(const std::basic_string<CharT>& key0, const std::basic_string<CharT>& key1) const
+        {
+            return derived().template keyCommand<resp::Sunion>(key0, key1);
+        }
+
+        boost::int64_t scard(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Scard>(key);
+        }
+
+        boost::int64_t zadd(const std::basic_string<CharT>& key, double score, const std::basic_string<CharT>& member) const
+        {
+            return derived().template keyCommand<resp::Zadd>(key, score, member);
+        }
+
+        boost::int64_t zrem(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
+        {
+            return derived().template keyCommand<resp::Zrem>(key, member);
+        }
+
+        boost::optional<boost::int64_t> zrank(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
+        {
+            return derived().template keyCommand<resp::Zrank>(key, member);
+        }
+
+        boost::optional<boost::int64_t> zrevrank(const std::basic_string<CharT>& key, const std::basic_string<CharT>& member) const
+        {
+            return derived().template keyCommand<resp::Zrevrank>(key, member);
+        }
+
+        Reply zrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
+        {
+            return derived().template keyCommand<resp::Zrange>(key, start, end);
+        }
+
+        Reply zrevrange(const std::basic_string<CharT>& key, boost::int64_t start, boost::int64_t end) const
+        {
+            return derived().template keyCommand<resp::Zrevrange>(key, start, end);
+        }
+
+        Reply zrangebyscore(const std::basic_string<CharT>& key, const std::basic_string<CharT>& min, const std::basic_string<CharT>& max) const
+        {
+            return derived().template keyCommand<resp::Zrangebyscore>(key, min, max);
+        }
+
+        Reply zrevrangebyscore(const std::basic_string<CharT>& key, const std::basic_string<CharT>& max, const std::basic_string<CharT>& min) const
+        {
+            return derived().template keyCommand<resp::Zrevrangebyscore>(key, max, min);
+        }
+
+        boost::int64_t zcard(const std::basic_string<CharT>& key) const
+        {
+            return derived().template keyCommand<resp::Zcard>(key);
+        }
+    };
+
+    // Multi-bulk reply assembled from elements of replies of other commands,
+    // e.g. MGET split between several connections. Source replies are kept
+    // alive by the arena of the assembled reply.
+    template<typename CharT>
+    class RedisMergedReply
+    {
+        typedef RedisResult<RedisReplyBase, CharT> Reply;
+
+        RedisReplyArena* _arena;
+        redisReply* _r;
+
+        RedisMergedReply(const RedisMergedReply&);
+        RedisMergedReply& operator=(const RedisMergedReply&);
+
+        static void releaseReply(void* reply)
+        {
+            delete static_cast<Reply*>(reply);
+        }
+
+    public:
+        explicit RedisMergedReply(size_t size)
+            : _arena(RedisReplyArena::create(sizeof(redisReply) + size * sizeof(redisReply*))),
+              _r(static_cast<redisReply*>(_arena->allocate(sizeof(redisReply))))
+        {
+            ::memset(_r, 0, sizeof(redisReply));
+
+            _r->type = REDIS_REPLY_ARRAY;
+
+            if (size > 0)
+            {
+                _r->elements = size;
+                _r->element = static_cast<redisReply**>(_arena->allocate(size * sizeof(redisReply*)));
+            }
+        }
+
+        ~RedisMergedReply()
+        {
+            if (_arena != 0)
+            {
+                RedisReplyArena::destroy(_arena);
+            }
+        }
+
+        // Places elements of multi-bulk source at given positions
+        template<class Positions>
+        void add(const Reply& source, const Positions& positions)
+        {
+            const size_t size = source.size();
+
+            if (size != positions.size())
+            {
+                throw std::runtime_error("Invalid reply size");
+            }
+
+            _arena->addCleanup(&releaseReply, new Reply(source));
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                _r->element[positions[i]] = source[i].get();
+            }
+        }
+
+        Reply release()
+        {
+            RedisReplyArena* arena = _arena;
+            _arena = 0;
+
+            return Reply(_r, arena);
+        }
+
+        // Elements of all multi-bulk sources one after another
+        static Reply concat(const std::vector<Reply>& sources)
+        {
+            size_t size = 0;
+
+            for (size_t s = 0; s < sources.size(); ++s)
+            {
+                size += sources[s].size();
+            }
+
+            RedisMergedReply<CharT> merged(size);
+            std::vector<size_t> positions;
+            size_t first = 0;
+
+            for (size_t s = 0; s < sources.size(); ++s)
+            {
+                positions.resize(sources[s].size());
+
+                for (size_t i = 0; i < positions.size(); ++i)
+                {
+                    positions[i] = first + i;
+                }
+
+                merged.add(sources[s], positions);
+                first += positions.size();
+            }
+
+            return merged.release();
+        }
+    };
+
+    // Sends batches of commands over several connections at once
+    template<typename CharT>
+    class RedisFanOut
+    {
+    public:
+        typedef RedisBase<CharT> Redis;
+        typedef typename Redis::Command Command;
+        typedef typename Redis::Reply Reply;
+        typedef std::vector<std::vector<const Command*> > Batches;
+        typedef std::vector<std::vector<Reply> > Replies;
+
+        // Appends every batch to its connection and flushes all of them before
+        // reading any reply. Replies of commands already sent are read even
+        // when one of the connections fails, first error is then rethrown.
+        static void dispatch(const std::vector<const Redis*>& connections, const Batches& batches, Replies& replies)
+        {
+            std::vector<size_t> pending(batches.size());
+            boost::optional<RedisException> error;
+
+            try
+            {
+                for (size_t s = 0; s < batches.size(); ++s)
+                {
+                    for (size_t i = 0; i < batches[s].size(); ++i)
+                    {
+                        connections[s]->beginCommand(*batches[s][i]);
+                        ++pending[s];
+                    }
+                }
+            }
+            catch (const RedisException& e)
+            {
+                error = e;
+            }
+
+            for (size_t s = 0; s < batches.size(); ++s)
+            {
+                if (pending[s] > 0)
+                {
+                    try
+                    {
+                        connections[s]->flush();
+                    }
+                    catch (const RedisException& e)
+                    {
+                        pending[s] = 0;
+
+                        if (!error)
+                        {
+                            error = e;
+                        }
+                    }
+                }
+            }
+
+            replies.resize(batches.size());
+
+            for (size_t s = 0; s < batches.size(); ++s)
+            {
+                replies[s].reserve(pending[s]);
+
+                for (size_t i = 0; i < pending[s]; ++i)
+                {
+                    try
+                    {
+                        replies[s].push_back(connections[s]->endCommand());
+                    }
+                    catch (const RedisException& e)
+                    {
+                        if (!error)
+                        {
+                            error = e;
+                        }
+
+                        break;
+                    }
+                }
+            }
+
+            if (error)
+            {
+                throw *error;
+            }
+        }
+    };
+
+    // Spreads keys over several Redis servers with ketama style consistent
+    // hashing. Key part enclosed in {} is hashed instead of the whole key
+    // when present, so related keys may be kept on the same server.
+    template<typename CharT>
+    class ShardedRedis : public RedisKeyCommands<ShardedRedis<CharT>, CharT>
+    {
+    public:
+        typedef RedisBase<CharT> Redis;
+        typedef typename Redis::Command Command;
+        typedef typename Redis::Reply Reply;
+
+        static const int PointsPerShard = 160;
+
+    private:
+        typedef std::pair<boost::uint32_t, size_t> Point;
+        typedef typename RedisFanOut<CharT>::Batches Batches;
+        typedef typename RedisFanOut<CharT>::Replies Replies;
+
+        boost::ptr_vector<Redis> _shards;
+        std::vector<const Redis*> _connections;
+        std::vector<Point> _continuum;
+        boost::chrono::milliseconds _connectTimeout;
+        boost::chrono::milliseconds _timeout;
+
+        mutable std::string _key;
+
+        ShardedRedis(const ShardedRedis<CharT>&);
+        ShardedRedis<CharT>& operator=(const ShardedRedis<CharT>&);
+
+        static boost::uint32_t hash(const char* data, size_t size)
+        {
+            boost::crc_32_type crc;
+            crc.process_bytes(data, size);
+
+            // spreads close CRC values of similar point names over the ring
+            boost::uint32_t h = crc.checksum();
+            h ^= h >> 16;
+            h *= 0x85ebca6b;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35;
+            h ^= h >> 16;
+
+            return h;
+        }
+
+        static bool pointLess(const Point& point, boost::uint32_t h)
+        {
+            return point.first < h;
+        }
+
+        size_t shardOf(const char* data, size_t size) const
+        {
+            if (_continuum.empty())
+            {
+                throw RedisException("No shards");
+            }
+
+            RedisKeyCommands<ShardedRedis<CharT>, CharT>::hashTag(data, size);
+
+            typename std::vector<Point>::const_iterator i =
+                std::lower_bound(_continuum.begin(), _continuum.end(), hash(data, size), pointLess);
+
+            return (i == _continuum.end() ? _continuum.front() : *i).second;
+        }
+
+        size_t shardOf(const std::string& key) const
+        {
+            return shardOf(key.data(), key.size());
+        }
+
+        size_t shardOf(const std::wstring& key) const
+        {
+            RedisEncoding<wchar_t>::encode(key, _key);
+            return shardOf(_key);
+        }
+
+        size_t shardOf(const Command& command) const
+        {
+            return command.size() > 1 ? shardOf(command[1]) : 0;
+        }
+
+        void dispatch(const Batches& batches, Replies& replies) const
+        {
+            RedisFanOut<CharT>::dispatch(_connections, batches, replies);
+        }
+
+        void checkSameShard(const std::basic_string<CharT>& key0, const std::basic_string<CharT>& key1) const
+        {
+            if (shardOf(key0) != shardOf(key1))
+            {
+                throw RedisException("Command keys span several shards");
+            }
+        }
+
+    public:
+        ShardedRedis() : _connectTimeout(0), _timeout(0) { }
+
+        virtual ~ShardedRedis() { }
+
+        // Weight scales share of keys mapped to the shard
+        void addShard(const std::string& host, int port = 6379, int weight = 1)
+        {
+            _shards.push_back(new Redis(host, port));
+            _shards.back().setConnectTimeout(_connectTimeout);
+            _shards.back().setTimeout(_timeout);
+            _connections.push_back(&_shards.back());
+
+            const size_t shard = _shards.size() - 1;
+            const int points = PointsPerShard * weight;
+
+            for (int i = 0; i < points; ++i)
+            {
+                const std::string name = host + ":" + boost::lexical_cast<std::string>(port) +
+                    "-" + boost::lexical_cast<std::string>(i);
+
+                _continuum.push_back(Point(hash(name.data(), name.size()), shard));
+            }
+
+            std::sort(_continuum.begin(), _continuum.end());
+        }
+
+        size_t size() const
+        {
+            return _shards.size();
+        }
+
+        const Redis& shard(size_t i) const
+        {
+            return _shards[i];
+        }
+
+        // Connection serving key, may be used for pipelining keys of one shard
+        const Redis& shardFor(const std::basic_string<CharT>& key) const
+        {
+            return _shards[shardOf(key)];
+        }
+
+        void setLazyReplies(bool lazy)
+        {
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                _shards[s].setLazyReplies(lazy);
+            }
+        }
+
+        // Connect and socket timeouts of current and later added shards,
+        // 0 for none
+        void setConnectTimeout(boost::chrono::milliseconds timeout)
+        {
+            _connectTimeout = timeout;
+
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                _shards[s].setConnectTimeout(timeout);
+            }
+        }
+
+        boost::chrono::milliseconds connectTimeout() const { return _connectTimeout; }
+
+        void setTimeout(boost::chrono::milliseconds timeout)
+        {
+            _timeout = timeout;
+
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                _shards[s].setTimeout(timeout);
+            }
+        }
+
+        boost::chrono::milliseconds timeout() const { return _timeout; }
+
+        template<class C>
+        Reply keyCommand(const std::basic_string<CharT>& key) const
+        {
+            const Redis& redis = shardFor(key);
+            redis.template beginCommand<C>(key);
+            return redis.endCommand();
+        }
+
+        template<class C, class A2>
+        Reply keyCommand(const std::basic_string<CharT>& key, const A2& a2) const
+        {
+            const Redis& redis = shardFor(key);
+            redis.template beginCommand<C>(key, a2);
+            return redis.endCommand();
+        }
+
+        template<class C, class A2, class A3>
+        Reply keyCommand(const std::basic_string<CharT>& key, const A2& a2, const A3& a3) const
+        {
+            const Redis& redis = shardFor(key);
+            redis.template beginCommand<C>(key, a2, a3);
+            return redis.endCommand();
+        }
+
+        // Keys of both set commands must map to the same shard, the shard of
+        // the first key would otherwise run them without the second
+        Reply sdiff(const std::basic_string<CharT>& key, const std::basic_string<CharT>& diffKey) const
+        {
+            checkSameShard(key, diffKey);
+            return keyCommand<resp::Sdiff>(key, diffKey);
+        }
+
+        Reply sunion(const std::basic_string<CharT>& key0, const std::basic_string<CharT>& key1) const
+        {
+            checkSameShard(key0, key1);
+            return keyCommand<resp::Sunion>(key0, key1);
+        }
+
+        std::basic_string<CharT> ping() const
+        {
+            std::basic_string<CharT> status;
+
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                status = _shards[s].ping();
+            }
+
+            return status;
+        }
+
+        void select(int database) const
+        {
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                _shards[s].select(database);
+            }
+        }
+
+        Reply keys(const std::basic_string<CharT>& pattern) const
+        {
+            Command command("KEYS");
+            command << pattern;
+
+            Batches batches(_shards.size(), std::vector<const Command*>(1, &command));
+            Replies replies;
+            dispatch(batches, replies);
+
+            std::vector<Reply> sources;
+
+            for (size_t s = 0; s < replies.size(); ++s)
+            {
+                sources.push_back(replies[s][0]);
+            }
+
+            return RedisMergedReply<CharT>::concat(sources);
+        }
+
+        Reply mget(const std::vector<std::basic_string<CharT> >& keys) const
+        {
+            std::vector<std::vector<size_t> > positions(_shards.size());
+            std::vector<Command> commands(_shards.size(), Command("MGET"));
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                const size_t s = shardOf(keys[i]);
+
+                positions[s].push_back(i);
+                commands[s] << keys[i];
+            }
+
+            Batches batches(_shards.size());
+
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                if (!positions[s].empty())
+                {
+                    batches[s].push_back(&commands[s]);
+                }
+            }
+
+            Replies replies;
+            dispatch(batches, replies);
+
+            RedisMergedReply<CharT> merged(keys.size());
+
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                if (!positions[s].empty())
+                {
+                    merged.add(replies[s][0], positions[s]);
+                }
+            }
+
+            return merged.release();
+        }
+
+        boost::int64_t del(const std::vector<std::basic_string<CharT> >& keys) const
+        {
+            std::vector<Command> commands(_shards.size(), Command("DEL"));
+            Batches batches(_shards.size());
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                const size_t s = shardOf(keys[i]);
+
+                if (batches[s].empty())
+                {
+                    batches[s].push_back(&commands[s]);
+                }
+
+                commands[s] << keys[i];
+            }
+
+            Replies replies;
+            dispatch(batches, replies);
+
+            boost::int64_t deleted = 0;
+
+            for (size_t s = 0; s < replies.size(); ++s)
+            {
+                if (!replies[s].empty())
+                {
+                    deleted += (boost::int64_t)replies[s][0];
+                }
+            }
+
+            return deleted;
+        }
+
+        using RedisKeyCommands<ShardedRedis<CharT>, CharT>::del;
+
+        // Commands are routed by their first argument after command name
+        Reply doCommand(const Command& command) const
+        {
+            const Redis& redis = _shards[shardOf(command)];
+            redis.beginCommand(command);
+            return redis.endCommand();
+        }
+
+        void doPipeline(const std::vector<Command>& commands) const
+        {
+            std::vector<Reply> replies;
+            doPipeline(commands, replies);
+        }
+
+        void doPipeline(const std::vector<Command>& commands, std::vector<Reply>& replies) const
+        {
+            std::vector<std::vector<size_t> > positions(_shards.size());
+            Batches batches(_shards.size());
+
+            for (size_t i = 0; i < commands.size(); ++i)
+            {
+                const size_t s = shardOf(commands[i]);
+
+                positions[s].push_back(i);
+                batches[s].push_back(&commands[i]);
+            }
+
+            Replies shardReplies;
+            dispatch(batches, shardReplies);
+
+            const size_t first = replies.size();
+            replies.resize(first + commands.size());
+
+            for (size_t s = 0; s < _shards.size(); ++s)
+            {
+                for (size_t i = 0; i < positions[s].size(); ++i)
+                {
+                    replies[first + positions[s][i]].swap(shardReplies[s][i]);
+                }
+            }
+        }
+
+        // All commands of the transaction must be routed to the same shard
+        Reply doTransaction(const std::vector<Command>& commands) const
+        {
+            if (commands.empty())
+            {
+                return _shards[0].doTransaction(commands);
+            }
+
+            const size_t s = shardOf(commands[0]);
+
+            for (size_t i = 1; i < commands.size(); ++i)
+            {
+                if (shardOf(commands[i]) != s)
+                {
+                    throw RedisException("Transaction keys span several shards");
+                }
+            }
+
+            return _shards[s].doTransaction(commands);
+        }
+    };
+
+    typedef ShardedRedis<char> ShardedRedisClient;
+    typedef ShardedRedis<wchar_t> wShardedRedisClient;
+}
+
+#endif // HIREDISPP_SHARD_H
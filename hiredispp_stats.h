@@ -0,0 +1,507 @@
+/*
+ * hiredispp_stats.h
+ */
+
+#ifndef HIREDISPP_STATS_H
+#define HIREDISPP_STATS_H
+
+#include "hiredispp.h"
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace hiredispp
+{
+    // Log-linear histogram in the manner of HdrHistogram: values below
+    // SubBuckets are exact, above each power of two is split in SubBuckets
+    // buckets, so any value is kept within 1/SubBuckets of its bucket
+    class RedisHistogram
+    {
+    public:
+        static const unsigned SubBucketBits = 5;
+        static const size_t SubBuckets = 1 << SubBucketBits;
+
+        // Values from 2^(MaxExponent + 1) on are counted in the last bucket
+        static const unsigned MaxExponent = 40;
+        static const size_t Buckets = (MaxExponent - SubBucketBits + 2) * SubBuckets;
+
+        static size_t bucketOf(boost::uint64_t value)
+        {
+            if (value < SubBuckets)
+            {
+                return static_cast<size_t>(value);
+            }
+
+            const boost::uint64_t limit = (static_cast<boost::uint64_t>(2) << MaxExponent) - 1;
+
+            if (value > limit)
+            {
+                value = limit;
+            }
+
+            const unsigned shift = highestBit(value) - SubBucketBits;
+
+            return (shift + 1) * SubBuckets + static_cast<size_t>((value >> shift) & (SubBuckets - 1));
+        }
+
+        // Highest value counted in bucket
+        static boost::uint64_t highestOf(size_t bucket)
+        {
+            if (bucket < SubBuckets)
+            {
+                return bucket;
+            }
+
+            const unsigned shift = static_cast<unsigned>(bucket / SubBuckets - 1);
+            const boost::uint64_t low = static_cast<boost::uint64_t>(SubBuckets + bucket % SubBuckets) << shift;
+
+            return low + (static_cast<boost::uint64_t>(1) << shift) - 1;
+        }
+
+        RedisHistogram()
+            : _counts(Buckets), _count(0), _sum(0),
+              _min(std::numeric_limits<boost::uint64_t>::max()), _max(0) { }
+
+        void record(boost::uint64_t value, boost::uint64_t count = 1)
+        {
+            _counts[bucketOf(value)] += count;
+            _count += count;
+            _sum += value * count;
+            _min = std::min(_min, value);
+            _max = std::max(_max, value);
+        }
+
+        void merge(const RedisHistogram& other)
+        {
+            for (size_t i = 0; i < Buckets; ++i)
+            {
+                _counts[i] += other._counts[i];
+            }
+
+            _count += other._count;
+            _sum += other._sum;
+            _min = std::min(_min, other._min);
+            _max = std::max(_max, other._max);
+        }
+
+        boost::uint64_t count() const { return _count; }
+        boost::uint64_t countAt(size_t bucket) const { return _counts[bucket]; }
+        boost::uint64_t min() const { return _count ? _min : 0; }
+        boost::uint64_t max() const { return _max; }
+
+        double mean() const
+        {
+            return _count ? static_cast<double>(_sum) / _count : 0.;
+        }
+
+        // Highest value within precision below which percent of values are
+        boost::uint64_t percentile(double percent) const
+        {
+            if (_count == 0)
+            {
+                return 0;
+            }
+
+            boost::uint64_t rank = static_cast<boost::uint64_t>(percent / 100. * _count + 0.5);
+            rank = std::max<boost::uint64_t>(rank, 1);
+
+            boost::uint64_t seen = 0;
+
+            for (size_t i = 0; i < Buckets; ++i)
+            {
+                seen += _counts[i];
+
+                if (seen >= rank)
+                {
+                    return std::min(highestOf(i), _max);
+                }
+            }
+
+            return _max;
+        }
+
+    private:
+        static unsigned highestBit(boost::uint64_t value)
+        {
+#ifdef __GNUC__
+            return 63 - __builtin_clzll(value);
+#else
+            unsigned bit = 0;
+
+            while (value >>= 1)
+            {
+                ++bit;
+            }
+
+            return bit;
+#endif
+        }
+
+        friend class RedisStats;
+
+        std::vector<boost::uint64_t> _counts;
+        boost::uint64_t _count;
+        boost::uint64_t _sum;
+        boost::uint64_t _min;
+        boost::uint64_t _max;
+    };
+
+    struct RedisCommandStats
+    {
+        // Commands sent, replies read, and both in RESP encoding
+        boost::uint64_t calls;
+        boost::uint64_t bytesSent;
+        boost::uint64_t bytesReceived;
+
+        // Error replies, lost and timed out commands
+        boost::uint64_t errors;
+
+        // Nanoseconds from sending to reply, of completed commands
+        RedisHistogram latency;
+
+        RedisCommandStats()
+            : calls(0), bytesSent(0), bytesReceived(0), errors(0) { }
+    };
+
+    // Statistics by command name
+    typedef std::map<std::string, RedisCommandStats> RedisStatsSnapshot;
+
+    // Per command latency histograms and counters of the connections it is
+    // attached to with setInstrument(). Each thread records into its own
+    // shard without locking or atomic read-modify-write; snapshot() merges
+    // the shards while they are being written.
+    class RedisStats : public RedisInstrument, boost::noncopyable
+    {
+        typedef boost::atomic<boost::uint64_t> Counter;
+
+        // Written by the owning thread only
+        struct Command : boost::noncopyable
+        {
+            std::string name;
+            Counter calls;
+            Counter bytesSent;
+            Counter bytesReceived;
+            Counter errors;
+            Counter sum;
+            Counter min;
+            Counter max;
+            Counter buckets[RedisHistogram::Buckets];
+
+            explicit Command(const std::string& n)
+                : name(n), calls(0), bytesSent(0), bytesReceived(0), errors(0),
+                  sum(0), min(std::numeric_limits<boost::uint64_t>::max()), max(0)
+            {
+                for (size_t i = 0; i < RedisHistogram::Buckets; ++i)
+                {
+                    buckets[i].store(0, boost::memory_order_relaxed);
+                }
+            }
+        };
+
+        static void add(Counter& counter, boost::uint64_t value)
+        {
+            counter.store(counter.load(boost::memory_order_relaxed) + value, boost::memory_order_relaxed);
+        }
+
+        // Commands of one thread, found by name in an open addressed table
+        struct Shard : boost::noncopyable
+        {
+            static const size_t Slots = 256;
+            static const size_t MaxName = 31;
+
+            struct Slot
+            {
+                char name[MaxName + 1];
+                Command* command;
+            };
+
+            Slot slots[Slots];
+            size_t used;
+            Command* other;
+            boost::ptr_vector<Command> commands;
+
+            Shard()
+                : used(0), other(0)
+            {
+                for (size_t i = 0; i < Slots; ++i)
+                {
+                    slots[i].command = 0;
+                }
+            }
+        };
+
+        // Shard of the thread, stale when owner is another stats; shards
+        // are owned by the stats, they outlive their threads
+        struct LocalShard
+        {
+            boost::uint64_t owner;
+            Shard* shard;
+        };
+
+        mutable boost::mutex _mutex;
+        boost::ptr_vector<Shard> _shards;
+        const boost::uint64_t _id;
+        boost::thread_specific_ptr<LocalShard> _local;
+
+        static boost::uint64_t now()
+        {
+            return boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+                boost::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        Shard& local()
+        {
+            LocalShard* cached = _local.get();
+
+            if (cached == 0 || cached->owner != _id)
+            {
+                cached = new LocalShard;
+                cached->owner = _id;
+                cached->shard = 0;
+                _local.reset(cached);
+            }
+
+            if (cached->shard == 0)
+            {
+                boost::lock_guard<boost::mutex> lock(_mutex);
+                _shards.push_back(new Shard);
+                cached->shard = &_shards.back();
+            }
+
+            return *cached->shard;
+        }
+
+        Command* create(Shard& shard, const std::string& name)
+        {
+            boost::lock_guard<boost::mutex> lock(_mutex);
+            shard.commands.push_back(new Command(name));
+            return &shard.commands.back();
+        }
+
+        // Names which don't fit the table are counted as OTHER
+        Command* find(Shard& shard, boost::string_view name)
+        {
+            char upper[Shard::MaxName + 1];
+            boost::uint32_t hash = 2166136261u;
+
+            if (name.empty() || name.size() > Shard::MaxName)
+            {
+                return other(shard);
+            }
+
+            for (size_t i = 0; i < name.size(); ++i)
+            {
+                upper[i] = static_cast<char>(::toupper(static_cast<unsigned char>(name[i])));
+                hash = (hash ^ static_cast<unsigned char>(upper[i])) * 16777619u;
+            }
+
+            upper[name.size()] = '\0';
+
+            for (size_t i = hash % Shard::Slots; ; i = (i + 1) % Shard::Slots)
+            {
+                Shard::Slot& slot = shard.slots[i];
+
+                if (slot.command == 0)
+                {
+                    // kept below three quarters full
+                    if (shard.used >= Shard::Slots / 4 * 3)
+                    {
+                        return other(shard);
+                    }
+
+                    slot.command = create(shard, std::string(upper, name.size()));
+                    ::memcpy(slot.name, upper, name.size() + 1);
+                    ++shard.used;
+                    return slot.command;
+                }
+
+                if (::strcmp(slot.name, upper) == 0)
+                {
+                    return slot.command;
+                }
+            }
+        }
+
+        Command* other(Shard& shard)
+        {
+            if (shard.other == 0)
+            {
+                shard.other = create(shard, "OTHER");
+            }
+
+            return shard.other;
+        }
+
+        static void merge(const Command& command, RedisCommandStats& stats)
+        {
+            stats.calls += command.calls.load(boost::memory_order_relaxed);
+            stats.bytesSent += command.bytesSent.load(boost::memory_order_relaxed);
+            stats.bytesReceived += command.bytesReceived.load(boost::memory_order_relaxed);
+            stats.errors += command.errors.load(boost::memory_order_relaxed);
+
+            RedisHistogram& h = stats.latency;
+            boost::uint64_t count = 0;
+
+            for (size_t i = 0; i < RedisHistogram::Buckets; ++i)
+            {
+                const boost::uint64_t n = command.buckets[i].load(boost::memory_order_relaxed);
+                h._counts[i] += n;
+                count += n;
+            }
+
+            if (count > 0)
+            {
+                h._count += count;
+                h._sum += command.sum.load(boost::memory_order_relaxed);
+                h._min = std::min(h._min, command.min.load(boost::memory_order_relaxed));
+                h._max = std::max(h._max, command.max.load(boost::memory_order_relaxed));
+            }
+        }
+
+    public:
+        RedisStats()
+            : _id(RedisInstance::nextId()) { }
+
+        // Connections must be detached or gone before the stats
+        ~RedisStats() { }
+
+        virtual void started(const char* data, size_t length, Sample& sample)
+        {
+            Command* command = find(local(), RedisProtocol::commandName(data, length));
+
+            add(command->calls, 1);
+            add(command->bytesSent, length);
+
+            sample.token = command;
+            sample.start = now();
+            sample.instrument = this;
+        }
+
+        // Completion is counted to the shard of the thread which started
+        // the command, connections move between threads only when idle
+        virtual void completed(const Sample& sample, const redisReply* reply)
+        {
+            Command* command = static_cast<Command*>(sample.token);
+
+            if (reply == 0 || reply->type == REDIS_REPLY_ERROR)
+            {
+                add(command->errors, 1);
+            }
+
+            if (reply == 0)
+            {
+                return;
+            }
+
+            const boost::uint64_t latency = now() - sample.start;
+
+            add(command->buckets[RedisHistogram::bucketOf(latency)], 1);
+            add(command->sum, latency);
+            add(command->bytesReceived, encodedSize(reply, sample.protocol));
+
+            if (latency < command->min.load(boost::memory_order_relaxed))
+            {
+                command->min.store(latency, boost::memory_order_relaxed);
+            }
+
+            if (latency > command->max.load(boost::memory_order_relaxed))
+            {
+                command->max.store(latency, boost::memory_order_relaxed);
+            }
+        }
+
+        // Merged statistics of all threads, may be taken from any thread
+        RedisStatsSnapshot snapshot() const
+        {
+            RedisStatsSnapshot result;
+            boost::lock_guard<boost::mutex> lock(_mutex);
+
+            for (size_t i = 0; i < _shards.size(); ++i)
+            {
+                const Shard& shard = _shards[i];
+
+                for (size_t j = 0; j < shard.commands.size(); ++j)
+                {
+                    merge(shard.commands[j], result[shard.commands[j].name]);
+                }
+            }
+
+            return result;
+        }
+
+        // Size of reply in RESP of the given version, elements of lazy
+        // arrays are not walked
+        static size_t encodedSize(const redisReply* r, int protocol = 2)
+        {
+            char digits[RedisProtocol::HeaderSpace];
+            char* end = digits + sizeof(digits);
+
+            switch (r->type)
+            {
+            case REDIS_REPLY_NIL:
+                // $-1 in RESP2, _ in RESP3
+                return protocol >= 3 ? 3 : 5;
+
+            case REDIS_REPLY_INTEGER:
+                return 3 + (end - RedisProtocol::formatInteger(r->integer, end));
+
+            case REDIS_REPLY_STRING:
+                return 5 + r->len + (end - RedisProtocol::formatUnsigned(r->len, end));
+
+            case REDIS_REPLY_ARRAY:
+#if HIREDIS_MAJOR >= 1
+            case REDIS_REPLY_SET:
+            case REDIS_REPLY_PUSH:
+            case REDIS_REPLY_MAP:
+            case REDIS_REPLY_ATTR:
+#endif
+            {
+                size_t header = r->elements;
+
+#if HIREDIS_MAJOR >= 1
+                // header counts pairs, hiredis holds keys and values
+                if (r->type == REDIS_REPLY_MAP || r->type == REDIS_REPLY_ATTR)
+                {
+                    header /= 2;
+                }
+#endif
+
+                size_t size = 3 + (end - RedisProtocol::formatUnsigned(header, end));
+
+                for (size_t i = 0; r->element != 0 && i < r->elements; ++i)
+                {
+                    size += encodedSize(r->element[i], protocol);
+                }
+
+                return size;
+            }
+
+#if HIREDIS_MAJOR >= 1
+            case REDIS_REPLY_BOOL:
+                return 4;
+
+            case REDIS_REPLY_VERB:
+                // hiredis drops the "txt:" prefix counted in the length
+                return 9 + r->len + (end - RedisProtocol::formatUnsigned(r->len + 4, end));
+#endif
+
+            default:
+                return 3 + r->len;
+            }
+        }
+    };
+}
+
+#endif // HIREDISPP_STATS_H
@@ -0,0 +1,444 @@
+//
+// g++ -O2 micro_benchmark.cpp -o micro_benchmark -I.. -lboost_program_options -lboost_chrono -lhiredis
+//
+// Times command construction, UTF-8 transcoding and reply parsing and
+// conversion on canned RESP buffers, without a server. Each case is run
+// for --time milliseconds and reported as ns/op and allocations/op; with
+// glibc every malloc is counted, including those of hiredis.
+//
+//   ./micro_benchmark --filter reply --format csv
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <hiredispp/hiredispp.h>
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+
+using namespace std;
+using namespace hiredispp;
+
+namespace po = boost::program_options;
+
+static boost::uint64_t allocations = 0;
+
+#ifdef __GLIBC__
+extern "C"
+{
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t n, size_t size);
+    void* __libc_realloc(void* p, size_t size);
+
+    void* malloc(size_t size)
+    {
+        ++allocations;
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t n, size_t size)
+    {
+        ++allocations;
+        return __libc_calloc(n, size);
+    }
+
+    void* realloc(void* p, size_t size)
+    {
+        ++allocations;
+        return __libc_realloc(p, size);
+    }
+}
+#endif
+
+// Keeps the optimizer from dropping results
+static volatile size_t sink;
+
+// Reply parsed from buffer by hiredis reader into an arena, as
+// RedisBase::readReply does
+class CannedReply
+{
+public:
+    CannedReply(const string& data, bool lazy)
+        : _data(data), _arena(NULL),
+          _reader(redisReaderCreateWithFunctions(lazy ? &RedisLazyArray::Functions : &RedisReplyArena::Functions))
+    {
+        _reader->privdata = &_arena;
+    }
+
+    ~CannedReply()
+    {
+        redisReaderFree(_reader);
+    }
+
+    template<typename CharT>
+    RedisResult<RedisReplyBase, CharT> parse()
+    {
+        redisReply* r = NULL;
+
+        if (redisReaderFeed(_reader, _data.data(), _data.size()) != REDIS_OK ||
+            redisReaderGetReply(_reader, reinterpret_cast<void**>(&r)) != REDIS_OK || r == NULL)
+        {
+            throw RedisException("Can't parse canned reply");
+        }
+
+        RedisReplyArena* arena = _arena;
+        _arena = NULL;
+
+        return RedisResult<RedisReplyBase, CharT>(r, arena);
+    }
+
+    Redis::Reply parse()
+    {
+        return parse<char>();
+    }
+
+private:
+    CannedReply(const CannedReply&);
+    CannedReply& operator=(const CannedReply&);
+
+    string _data;
+    RedisReplyArena* _arena;
+    redisReader* _reader;
+};
+
+static string bulk(const string& s)
+{
+    return "$" + boost::lexical_cast<string>(s.size()) + "\r\n" + s + "\r\n";
+}
+
+static string multiBulk(size_t n, const string& element)
+{
+    string data = "*" + boost::lexical_cast<string>(n) + "\r\n";
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        data += element;
+    }
+
+    return data;
+}
+
+// Hash of n fields with integer values, as HGETALL returns it
+static string hashReply(size_t n)
+{
+    string data = "*" + boost::lexical_cast<string>(2 * n) + "\r\n";
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        data += bulk("field:" + boost::lexical_cast<string>(i));
+        data += bulk(boost::lexical_cast<string>(i * 1000));
+    }
+
+    return data;
+}
+
+struct Case
+{
+    string name;
+    boost::function<void ()> op;
+};
+
+typedef boost::chrono::steady_clock Clock;
+
+// Doubles the iterations until the case runs for the given time
+static void measure(const Case& c, boost::chrono::milliseconds time, const string& format)
+{
+    c.op();
+
+    for (boost::uint64_t n = 1; ; n *= 2)
+    {
+        const boost::uint64_t before = allocations;
+        const Clock::time_point start = Clock::now();
+
+        for (boost::uint64_t i = 0; i < n; ++i)
+        {
+            c.op();
+        }
+
+        const Clock::duration elapsed = Clock::now() - start;
+        const boost::uint64_t allocs = allocations - before;
+
+        if (elapsed >= time || n >= (boost::uint64_t(1) << 40))
+        {
+            const double ns = static_cast<double>(
+                boost::chrono::duration_cast<boost::chrono::nanoseconds>(elapsed).count()) / n;
+            char line[256];
+
+            if (format == "csv")
+            {
+                snprintf(line, sizeof(line), "%s,%.1f,%.2f,%llu", c.name.c_str(), ns,
+                         static_cast<double>(allocs) / n, static_cast<unsigned long long>(n));
+            }
+            else
+            {
+                snprintf(line, sizeof(line), "%-40s %12.1f %12.2f %12llu", c.name.c_str(), ns,
+                         static_cast<double>(allocs) / n, static_cast<unsigned long long>(n));
+            }
+
+            cout << line << endl;
+            return;
+        }
+    }
+}
+
+// Command construction
+
+static void commandArgs(Redis::Command& cmd, const string& value, size_t args)
+{
+    cmd.clear();
+    cmd << "RPUSH";
+
+    for (size_t i = 0; i < args; ++i)
+    {
+        cmd << value;
+    }
+
+    sink = cmd.length();
+}
+
+static void commandIntegers(Redis::Command& cmd, size_t args)
+{
+    cmd.clear();
+    cmd << "ZADD" << "key";
+
+    for (size_t i = 0; i < args; ++i)
+    {
+        cmd << static_cast<long long>(i * 1000003);
+    }
+
+    sink = cmd.length();
+}
+
+static void commandWide(wRedis::Command& cmd, const wstring& value, size_t args)
+{
+    cmd.clear();
+    cmd << L"RPUSH";
+
+    for (size_t i = 0; i < args; ++i)
+    {
+        cmd << value;
+    }
+
+    sink = cmd.length();
+}
+
+// Transcoding
+
+static void encodeWide(const wstring& s, string& out)
+{
+    out.clear();
+    RedisEncoding<wchar_t>::encode(s, out);
+    sink = out.size();
+}
+
+static void decodeWide(const string& s, wstring& out)
+{
+    out.clear();
+    RedisEncoding<wchar_t>::decode(s.data(), s.size(), out);
+    sink = out.size();
+}
+
+// Reply path
+
+static void replyStatus(CannedReply& c)
+{
+    Redis::Reply r = c.parse();
+    sink = r.view().size();
+}
+
+static void replyInteger(CannedReply& c)
+{
+    Redis::Reply r = c.parse();
+    sink = static_cast<size_t>(static_cast<boost::int64_t>(r));
+}
+
+static void replyString(CannedReply& c)
+{
+    Redis::Reply r = c.parse();
+    sink = static_cast<string>(r).size();
+}
+
+static void replyView(CannedReply& c)
+{
+    Redis::Reply r = c.parse();
+    sink = r.view().size();
+}
+
+static void replyVector(CannedReply& c)
+{
+    vector<string> v;
+    c.parse().toVector(v);
+    sink = v.size();
+}
+
+static void replyLazyLast(CannedReply& c)
+{
+    Redis::Reply r = c.parse();
+    sink = static_cast<string>(r[r.size() - 1]).size();
+}
+
+static void replyMap(CannedReply& c)
+{
+    map<string, boost::int64_t> m;
+    c.parse().toMap(m);
+    sink = m.size();
+}
+
+static void replyScored(CannedReply& c)
+{
+    vector<pair<string, double> > v;
+    c.parse().toScoredPairs(v);
+    sink = v.size();
+}
+
+static void replyWideVector(CannedReply& c)
+{
+    vector<wstring> v;
+    c.parse<wchar_t>().toVector(v);
+    sink = v.size();
+}
+
+int main(int argc, char** argv)
+{
+    string filter;
+    string format;
+    int    time;
+
+    po::options_description desc("options");
+
+    desc.add_options()
+        ("help", "produce this help message")
+        ("filter", po::value<string>(&filter)->default_value(""), "run cases with names containing this")
+        ("time", po::value<int>(&time)->default_value(200), "milliseconds per case")
+        ("format", po::value<string>(&format)->default_value("text"), "text or csv")
+        ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        cout << desc << endl;
+        return 0;
+    }
+
+    vector<Case> cases;
+
+    // command construction by argument count and size
+    static Redis::Command cmd;
+    static wRedis::Command wcmd;
+    static const size_t counts[] = { 1, 3, 10, 100 };
+    static const size_t sizes[] = { 8, 64, 1024 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        for (size_t n = 0; n < sizeof(counts) / sizeof(counts[0]); ++n)
+        {
+            const string name = "command/args:" + boost::lexical_cast<string>(counts[n]) +
+                "/size:" + boost::lexical_cast<string>(sizes[s]);
+            Case c = { name, boost::bind(commandArgs, boost::ref(cmd), string(sizes[s], 'v'), counts[n]) };
+            cases.push_back(c);
+        }
+    }
+
+    for (size_t n = 0; n < sizeof(counts) / sizeof(counts[0]); ++n)
+    {
+        Case c = { "command/integers:" + boost::lexical_cast<string>(counts[n]),
+                   boost::bind(commandIntegers, boost::ref(cmd), counts[n]) };
+        cases.push_back(c);
+    }
+
+    // wide strings, ASCII and non-ASCII
+    const wstring ascii(64, L'v');
+    const wstring accented(64, L'é');
+    const wstring cjk(64, L'中');
+
+    {
+        Case c1 = { "command/wide/args:10/ascii:64", boost::bind(commandWide, boost::ref(wcmd), ascii, 10) };
+        Case c2 = { "command/wide/args:10/cjk:64", boost::bind(commandWide, boost::ref(wcmd), cjk, 10) };
+        cases.push_back(c1);
+        cases.push_back(c2);
+    }
+
+    static string encoded;
+    static wstring decoded;
+    const wstring texts[] = { wstring(16, L'v'), wstring(1024, L'v'), accented, wstring(1024, L'é'), cjk };
+    const char* textNames[] = { "ascii:16", "ascii:1024", "latin:64", "latin:1024", "cjk:64" };
+
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i)
+    {
+        string utf8;
+        RedisEncoding<wchar_t>::encode(texts[i], utf8);
+
+        Case e = { string("encoding/encode/") + textNames[i], boost::bind(encodeWide, texts[i], boost::ref(encoded)) };
+        Case d = { string("encoding/decode/") + textNames[i], boost::bind(decodeWide, utf8, boost::ref(decoded)) };
+        cases.push_back(e);
+        cases.push_back(d);
+    }
+
+    // canned replies
+    static CannedReply status("+OK\r\n", false);
+    static CannedReply integer(":1234567890\r\n", false);
+    static CannedReply small(bulk(string(16, 'v')), false);
+    static CannedReply large(bulk(string(16384, 'v')), false);
+    static CannedReply array10(multiBulk(10, bulk(string(16, 'v'))), false);
+    static CannedReply array1000(multiBulk(1000, bulk(string(16, 'v'))), false);
+    static CannedReply lazy1000(multiBulk(1000, bulk(string(16, 'v'))), true);
+    static CannedReply hash100(hashReply(100), false);
+    static CannedReply scored100(hashReply(100), false);
+
+    {
+        Case c[] = {
+            { "reply/status", boost::bind(replyStatus, boost::ref(status)) },
+            { "reply/integer", boost::bind(replyInteger, boost::ref(integer)) },
+            { "reply/string:16", boost::bind(replyString, boost::ref(small)) },
+            { "reply/string:16384", boost::bind(replyString, boost::ref(large)) },
+            { "reply/view:16384", boost::bind(replyView, boost::ref(large)) },
+            { "reply/vector:10", boost::bind(replyVector, boost::ref(array10)) },
+            { "reply/vector:1000", boost::bind(replyVector, boost::ref(array1000)) },
+            { "reply/wide/vector:1000", boost::bind(replyWideVector, boost::ref(array1000)) },
+            { "reply/lazy/last:1000", boost::bind(replyLazyLast, boost::ref(lazy1000)) },
+            { "reply/map:100", boost::bind(replyMap, boost::ref(hash100)) },
+            { "reply/scored:100", boost::bind(replyScored, boost::ref(scored100)) },
+        };
+
+        cases.insert(cases.end(), c, c + sizeof(c) / sizeof(c[0]));
+    }
+
+    if (format == "csv")
+    {
+        cout << "case,ns_per_op,allocs_per_op,iterations" << endl;
+    }
+    else
+    {
+        cout << "case                                          ns/op    allocs/op   iterations" << endl;
+    }
+
+    try
+    {
+        for (size_t i = 0; i < cases.size(); ++i)
+        {
+            if (cases[i].name.find(filter) != string::npos)
+            {
+                measure(cases[i], boost::chrono::milliseconds(time), format);
+            }
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        cerr << ex.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+//
+// g++ mock_test.cpp -o mock_test -I.. -lboost_thread -lboost_chrono -lhiredis -lev
+//
+// Smoke test of the client against the in-process mock server, needs no
+// redis-server: blocking commands, deferred replies, the connection pool,
+// async commands on an epoll loop and RESP3 replies with hiredis 1.0 or
+// later. Prints failed checks and exits with 1 when there are any.
+//
+
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+
+#include <hiredispp/hiredispp.h>
+#include <hiredispp/hiredispp_async.h>
+#include <hiredispp/hiredispp_epoll.h>
+#include <hiredispp/hiredispp_mock.h>
+#include <hiredispp/hiredispp_pool.h>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+using namespace std;
+using namespace hiredispp;
+
+static int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+static void check(bool ok, const char* condition, const char* file, int line)
+{
+    if (!ok)
+    {
+        cerr << file << ":" << line << ": check failed: " << condition << endl;
+        ++failures;
+    }
+}
+
+static void testSync(int port)
+{
+    Redis r("127.0.0.1", port);
+
+    CHECK(r.ping() == "PONG");
+
+    r.set("foo", "bar");
+    CHECK((string)r.get("foo") == "bar");
+    CHECK(r.incr("n") == 1);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        r.rpush("l", boost::lexical_cast<string>(i));
+    }
+
+    vector<int> v;
+    r.lrange("l", 0, -1).toVector(v);
+    CHECK(v.size() == 10 && v[9] == 9);
+
+    r.hset("h", "a", "1");
+    r.hset("h", "b", "2");
+    map<string, string> h;
+    r.hgetall("h").toMap(h);
+    CHECK(h.size() == 2 && h["b"] == "2");
+
+    vector<Redis::Command> commands;
+    vector<Redis::Reply> replies;
+
+    for (int i = 0; i < 100; ++i)
+    {
+        commands.push_back(Redis::Command("ECHO") << i);
+    }
+
+    r.doPipeline(commands, replies);
+    CHECK(replies.size() == 100 && (string)replies[99] == "99");
+
+    // error replies of doCommand are returned, not thrown
+    CHECK(r.doCommand(Redis::Command("NOSUCHCOMMAND")).isError());
+    CHECK(r.ping() == "PONG");
+}
+
+static void testDeferred(int port)
+{
+    Redis r("127.0.0.1", port);
+    vector<Redis::Deferred> sets, gets;
+
+    for (int i = 0; i < 50; ++i)
+    {
+        const string key = "d" + boost::lexical_cast<string>(i);
+        sets.push_back(r.defer<resp::Set>(key, boost::lexical_cast<string>(i)));
+        gets.push_back(r.defer<resp::Get>(key));
+    }
+
+    CHECK(!gets[0].ready());
+    CHECK((string)gets[20] == "20");
+    CHECK(sets[20].ready() && !gets[21].ready());
+
+    // blocking call after deferred ones reads their replies first
+    CHECK((string)r.get("d7") == "7");
+    CHECK(gets[49].ready() && (string)gets[49] == "49");
+}
+
+static void testPool(int port)
+{
+    RedisPoolConfig config;
+    config.maxSize = 2;
+    RedisConnectionPool pool("127.0.0.1", port, config);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        RedisConnectionPool::Connection c(pool);
+        c->set("p", boost::lexical_cast<string>(i));
+    }
+
+    {
+        RedisConnectionPool::Connection a(pool);
+        RedisConnectionPool::Connection b(pool);
+        CHECK((string)a->get("p") == "9");
+        CHECK(b->ping() == "PONG");
+    }
+
+    RedisPoolStats stats = pool.stats();
+    CHECK(stats.size >= 1 && stats.size <= 2);
+}
+
+class AsyncTest
+{
+public:
+    static const int Commands = 1000;
+
+    AsyncTest(int port)
+        : _ac("127.0.0.1", port, _loop), _done(0), _errors(0) { }
+
+    void run()
+    {
+        _ac.connect(boost::bind(&AsyncTest::onConnected, this, _1),
+                    boost::bind(&AsyncTest::onDisconnected, this, _1));
+
+        for (int i = 0; i < Commands; ++i)
+        {
+            Redis::Command command;
+            command << "INCR" << "async";
+            _ac.execAsyncCommand(command, boost::bind(&AsyncTest::onReply, this, _1, _2, i));
+        }
+
+        _loop.run();
+
+        CHECK(_done == Commands);
+        CHECK(_errors == 0);
+    }
+
+private:
+    void onConnected(boost::shared_ptr<RedisException>& ex)
+    {
+        CHECK(!ex);
+    }
+
+    void onDisconnected(boost::shared_ptr<RedisException>&)
+    {
+        _loop.stop();
+    }
+
+    void onReply(RedisConnectionAsync& ac, Redis::Element* reply, int i)
+    {
+        if (reply == NULL || reply->get()->type != REDIS_REPLY_INTEGER ||
+            reply->get()->integer != i + 1)
+        {
+            ++_errors;
+        }
+
+        if (++_done == Commands)
+        {
+            ac.disconnect();
+        }
+    }
+
+    RedisEpollLoop _loop;
+    RedisConnectionAsync _ac;
+    int _done;
+    int _errors;
+};
+
+static void testAsync(int port)
+{
+    AsyncTest test(port);
+    test.run();
+}
+
+#if HIREDIS_MAJOR >= 1
+static void testResp3(int port)
+{
+    Redis r("127.0.0.1", port);
+    r.setProtocol(3);
+
+    r.hset("h3", "a", "1");
+    Redis::Reply h = r.hgetall("h3");
+    CHECK(h.isMap());
+
+    map<string, int> m;
+    h.toMap(m);
+    CHECK(m["a"] == 1);
+
+    r.zadd("z3", 1.5, "a");
+    Redis::Reply score = r.doCommand(Redis::Command("ZSCORE") << "z3" << "a");
+    double d = 0;
+    score.toValue(d);
+    CHECK(score.isDouble() && d == 1.5);
+
+    CHECK(r.doCommand(Redis::Command("GET") << "missing").isNil());
+
+    RedisPoolConfig config;
+    config.protocol = 3;
+    RedisConnectionPool pool("127.0.0.1", port, config);
+    RedisConnectionPool::Connection c(pool);
+    CHECK(c->hgetall("h3").isMap());
+}
+#endif
+
+static void run(const char* name, void (*test)(int), int port)
+{
+    try
+    {
+        test(port);
+    }
+    catch (const std::exception& e)
+    {
+        cerr << name << ": " << e.what() << endl;
+        ++failures;
+    }
+}
+
+int main()
+{
+    RedisMockServer server;
+    const int port = server.port();
+
+    run("sync", testSync, port);
+    run("deferred", testDeferred, port);
+    run("pool", testPool, port);
+    run("async", testAsync, port);
+#if HIREDIS_MAJOR >= 1
+    run("resp3", testResp3, port);
+#endif
+
+    cout << (failures == 0 ? "ok" : "failed") << ", " << server.commands() << " commands" << endl;
+    return failures == 0 ? 0 : 1;
+}